@@ -33,6 +33,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <err.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/un.h>
@@ -40,14 +41,18 @@
 #include <search.h>
 
 #include <algorithm>
+#include <deque>
 #include <list>
 #include <map>
 #include <string>
 
 #include "event_unhandled_exception.hh"
+#include "flight_recorder.hh"
+#include "metrics.hh"
 #include "smart_bufferevent.hh"
 #include "smart_event.hh"
 #include "smart_fd.hh"
+#include "trace.hh"
 
 class serverside;
 
@@ -57,6 +62,15 @@ struct api_ss_conn {
 	smart_bufferevent<event_unhandled_exception::handle> be;
 
 	std::map<std::string, std::unique_ptr<status_notify_token>> codes;
+	/* Pending SYNC commands, oldest first. */
+	std::list<std::unique_ptr<backend_sync_token>> syncs;
+
+	conn_metrics metrics;
+	flight_recorder recorder;
+	/* Bytes at the start of the input buffer already recorded. */
+	size_t recorded_in;
+	/* Trace ID given to SEND commands, 0 for none. */
+	uint32_t trace_id;
 
 	api_ss_conn(serverside &ss, int fd);
 
@@ -79,12 +93,32 @@ struct api_ss_conn {
 	command_function stop;
 	command_function enable_server;
 	command_function disable_server;
+	command_function query_metrics;
+	command_function query_generation;
+	command_function dump_recorders;
+	command_function trace;
+	command_function sync;
+
+	int write(const std::string &str)
+	{
+		metrics.bytes_out += str.length();
+		bool eol = !str.empty() && str[str.length() - 1] == '\n';
+
+		if (eol)
+			metrics.lines_out++;
+		recorder.record(CAPTURE_OUT, str.data(), str.length(), !eol);
+		return be.write(str);
+	}
 
 	void start_notify(const std::string &code, backend_ptr::notify_cb cb, int replace);
 	void stop_notify(const std::string &code);
 
 	void query_notify_cb(const std::string &code, const std::string &val);
 	void notify_cb(const std::string &code, const std::string &val);
+	void trace_deliver(const std::string &code);
+	void sync_cb();
+
+	std::string recorder_name() const;
 
 	void handle(const std::string &line);
 	void readcb();
@@ -103,6 +137,8 @@ public:
 	socklen_t addrlen;
 	bool should_unlink;
 	bool disabled;
+	/* Capability generation, 0 until first asked for. */
+	uint64_t generation;
 
 	smart_event<event_unhandled_exception::handle> ev;
 
@@ -116,31 +152,41 @@ public:
 
 std::list<serverside> serversides;
 
+/* Clients often come and go before anyone dumps, so keep the last few. */
+struct closed_recorder
+{
+	std::string name;
+	flight_recorder recorder;
+};
+
+static std::deque<closed_recorder> closed_recorders;
+static const size_t max_closed_recorders = 8;
+
 void
 api_ss_conn::query_commands(const std::string &arg)
 {
-	be.write("QCMD");
+	write("QCMD");
 	for (size_t i = 0 ; i < arg.length() ; i += 4) {
 		std::string cmd = arg.substr(i, 4);
 		if (!ss.bdev.query_command(cmd)) {
-			be.write(cmd);
+			write(cmd);
 		}
 	}
-	be.write("\n");
+	write("\n");
 	bufferevent_enable(be, EV_WRITE);
 }
 
 void
 api_ss_conn::query_status(const std::string &arg)
 {
-	be.write("QSTS");
+	write("QSTS");
 	for (size_t i = 0 ; i < arg.length() ; i += 4) {
 		std::string cmd = arg.substr(i, 4);
 		if (!ss.bdev.query_status(cmd)) {
-			be.write(cmd);
+			write(cmd);
 		}
 	}
-	be.write("\n");
+	write("\n");
 	bufferevent_enable(be, EV_WRITE);
 }
 
@@ -160,6 +206,10 @@ api_ss_conn::send_command(const std::string &arg)
 		args.emplace_back(debase64_int24(a.c_str()));
 	}
 
+	trace_scope ts(trace_id);
+	if (trace_id)
+		trace_event(trace_id, "client", ",\"conn\":%s,\"command\":%s",
+				trace_quote(recorder_name()).c_str(), trace_quote(arg).c_str());
 	ss.bdev.send_command(cmd, args);
 }
 
@@ -183,13 +233,23 @@ api_ss_conn::stop_notify(const std::string &code)
 	codes.erase(code);
 }
 
+void
+api_ss_conn::trace_deliver(const std::string &code)
+{
+	trace_event(trace_current, "deliver", ",\"conn\":%s,\"code\":%s",
+			trace_quote(recorder_name()).c_str(), trace_quote(code).c_str());
+}
+
 void
 api_ss_conn::query_notify_cb(const std::string &code, const std::string &val)
 {
-	be.write("STAT");
-	be.write(code);
-	be.write(val);
-	be.write("\n");
+	if (trace_current)
+		trace_deliver(code);
+	metrics.notifications++;
+	write("STAT");
+	write(code);
+	write(val);
+	write("\n");
 
 	bufferevent_enable(be, EV_WRITE);
 	stop_notify(code);
@@ -198,10 +258,13 @@ api_ss_conn::query_notify_cb(const std::string &code, const std::string &val)
 void
 api_ss_conn::notify_cb(const std::string &code, const std::string &val)
 {
-	be.write("STAT");
-	be.write(code);
-	be.write(val);
-	be.write("\n");
+	if (trace_current)
+		trace_deliver(code);
+	metrics.notifications++;
+	write("STAT");
+	write(code);
+	write(val);
+	write("\n");
 
 	bufferevent_enable(be, EV_WRITE);
 }
@@ -219,10 +282,10 @@ api_ss_conn::query(const std::string &arg)
 	int res = ss.bdev.query(arg, buf);
 
 	if (!res) {
-		be.write("STAT");
-		be.write(arg);
-		be.write(buf);
-		be.write("\n");
+		write("STAT");
+		write(arg);
+		write(buf);
+		write("\n");
 		bufferevent_enable(be, EV_WRITE);
 		return;
 	}
@@ -269,6 +332,128 @@ api_ss_conn::disable_server(const std::string &arg)
 	}
 }
 
+void
+api_ss_conn::query_metrics(const std::string &arg)
+{
+	std::string out;
+
+	ss.bdev.format_metrics(out);
+	for (auto &s : serversides) {
+		if (&s.bdev != &ss.bdev)
+			continue;
+		for (auto &conn : s.conns) {
+			char prefix[32];
+
+			snprintf(prefix, sizeof(prefix), "conn%d", conn.fd.fd);
+			conn.metrics.format(out, prefix);
+		}
+	}
+
+	write("QMET");
+	write(out);
+	write("\n");
+	bufferevent_enable(be, EV_WRITE);
+}
+
+/*
+ * The generation is a hash of the commands and statuses the backend
+ * supports, so clients can cache what QCMD and QSTS would answer for as long
+ * as it stays the same. It only changes when the daemon is configured with a
+ * different backend type or built with different tables.
+ */
+static uint64_t
+capability_generation(backend_ptr &bdev)
+{
+	static const char *const commands[] = {
+#define COMMAND(name, code, nargs) code,
+#include "all_commands.h"
+#undef COMMAND
+		NULL
+	};
+	static const char *const statuses[] = {
+#define NOTIFY(name, code, type) code,
+#include "all_notify.h"
+#undef NOTIFY
+		NULL
+	};
+	uint64_t h = 14695981039346656037ULL;
+	auto add = [&h](const char *code) {
+		for (const char *cp = code ; *cp ; cp++)
+			h = (h ^ (unsigned char)*cp) * 1099511628211ULL;
+	};
+
+	for (const char *const *c = commands ; *c ; c++) {
+		if (!bdev.query_command(*c))
+			add(*c);
+	}
+	add("/");
+	for (const char *const *s = statuses ; *s ; s++) {
+		if (!bdev.query_status(*s))
+			add(*s);
+	}
+	return h ? h : 1;
+}
+
+void
+api_ss_conn::query_generation(const std::string &arg)
+{
+	char buf[24];
+
+	if (!ss.generation)
+		ss.generation = capability_generation(ss.bdev);
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)ss.generation);
+	write("QGEN");
+	write(buf);
+	write("\n");
+	bufferevent_enable(be, EV_WRITE);
+}
+
+void
+api_ss_conn::dump_recorders(const std::string &arg)
+{
+	write("DREC");
+	write(flight_recorder_dump());
+	write("\n");
+	bufferevent_enable(be, EV_WRITE);
+}
+
+/*
+ * TRCE<id> tags the following SEND commands on this connection with a trace
+ * ID, TRCE alone stops. Ignored unless the daemon writes a trace file.
+ */
+void
+api_ss_conn::trace(const std::string &arg)
+{
+	if (!trace_enabled())
+		return;
+	trace_id = strtoul(arg.c_str(), NULL, 10);
+}
+
+/*
+ * SYNC is answered with SYNC once the device has answered, or the daemon
+ * given up on, every command queued before it.
+ */
+void
+api_ss_conn::sync(const std::string &arg)
+{
+	auto token = ss.bdev.sync(std::bind(&api_ss_conn::sync_cb, this));
+
+	if (!token) {
+		write("SYNC\n");
+		bufferevent_enable(be, EV_WRITE);
+		return;
+	}
+	syncs.push_back(std::move(token));
+}
+
+void
+api_ss_conn::sync_cb()
+{
+	syncs.pop_front();
+	write("SYNC\n");
+	bufferevent_enable(be, EV_WRITE);
+}
+
 #include "api_serverside_command.h"
 
 void
@@ -276,14 +461,15 @@ api_ss_conn::handle(const std::string &line)
 {
 	const struct api_serverside_command *cmd;
 
-	if (ss.disabled && line.substr(0, 4) != "SENA") {
-		be.write("EDIS\n");
+	if (ss.disabled && line.substr(0, 4) != "SENA" && line.substr(0, 4) != "SYNC") {
+		write("EDIS\n");
 		bufferevent_enable(be, EV_WRITE);
 		return;
 	}
 
 	if (line.length() < 4) {
 		warnx ("Short line: %s", line.c_str());
+		metrics.lines_dropped++;
 		return;
 	}
 
@@ -292,7 +478,8 @@ api_ss_conn::handle(const std::string &line)
 		(this->*cmd->handler)(line.substr(4));
 	else {
 		warnx("Unknown command: %s", line.c_str());
-		be.write("ECMD\n");
+		metrics.lines_dropped++;
+		write("ECMD\n");
 		bufferevent_enable(be, EV_WRITE);
 	}
 }
@@ -302,10 +489,16 @@ api_ss_conn::readcb()
 {
 	char *line;
 
+	if (EVBUFFER_LENGTH(be->input) > recorded_in)
+		recorder.record(CAPTURE_IN, EVBUFFER_DATA(be->input) + recorded_in, EVBUFFER_LENGTH(be->input) - recorded_in);
+
 	while ((line = evbuffer_readline(be->input))) {
+		metrics.lines_in++;
+		metrics.bytes_in += strlen(line) + 1;
 		handle(line);
 		free(line);
 	}
+	recorded_in = EVBUFFER_LENGTH(be->input);
 }
 
 void
@@ -326,6 +519,11 @@ api_ss_conn::errorcb(short what)
 	if (EVBUFFER_LENGTH(be->input))
 		handle(std::string((const char*)EVBUFFER_DATA(be->input), EVBUFFER_LENGTH(be->input)));
 
+	recorder.record(CAPTURE_CLOSE, NULL, 0);
+	closed_recorders.push_back(closed_recorder{recorder_name(), std::move(recorder)});
+	if (closed_recorders.size() > max_closed_recorders)
+		closed_recorders.pop_front();
+
 	ss.conns.erase(std::find(ss.conns.begin(), ss.conns.end(), *this));
 }
 
@@ -351,8 +549,10 @@ serverside::accept_connection(int fd)
 
 api_ss_conn::api_ss_conn(serverside &ss, int fd)
 	: fd(fd), ss(ss), be(fd, std::bind(&api_ss_conn::readcb, this), std::bind(&api_ss_conn::writecb, this),
-			std::bind(&api_ss_conn::errorcb, this, std::placeholders::_1))
+			std::bind(&api_ss_conn::errorcb, this, std::placeholders::_1)),
+	recorder(8 * 1024), recorded_in(0), trace_id(0)
 {
+	recorder.record(CAPTURE_OPEN, NULL, 0);
 	bufferevent_enable(be, EV_READ);
 }
 
@@ -368,10 +568,9 @@ serverside_listen_fd(std::string name, backend_ptr &bdev, int fd)
 	serversides.emplace_back(std::move(name), bdev, (struct sockaddr*)&addr, addrlen, false, fd);
 }
 
-void
-serverside_listen_local(std::string name, backend_ptr &bdev, const std::string &path) {
-	struct sockaddr_storage addr;
-	struct sockaddr_un *sun = (struct sockaddr_un *)&addr;
+static int
+listen_local_socket(const std::string &path, struct sockaddr_storage *addr) {
+	struct sockaddr_un *sun = (struct sockaddr_un *)addr;
 	int s;
 	struct stat st;
 
@@ -397,7 +596,128 @@ serverside_listen_local(std::string name, backend_ptr &bdev, const std::string &
 	if (listen(s, 128))
 		err(1, "listen");
 
-	serversides.emplace_back(std::move(name), bdev, (struct sockaddr*)&addr, sizeof(*sun), true, s);
+	return s;
+}
+
+void
+serverside_listen_local(std::string name, backend_ptr &bdev, const std::string &path) {
+	struct sockaddr_storage addr;
+	int s = listen_local_socket(path, &addr);
+
+	serversides.emplace_back(std::move(name), bdev, (struct sockaddr*)&addr, sizeof(struct sockaddr_un), true, s);
+}
+
+/* A stats reply being written, the connection is closed once it's out. */
+struct stats_conn {
+	std::list<stats_conn> &conns;
+	smart_bufferevent<event_unhandled_exception::handle> be;
+
+	stats_conn(std::list<stats_conn> &conns, smart_fd fd)
+		: conns(conns), be(std::move(fd), nullptr, std::bind(&stats_conn::close, this),
+				std::bind(&stats_conn::errorcb, this, std::placeholders::_1))
+	{
+	}
+
+	void errorcb(short what)
+	{
+		warn("stats write");
+		close();
+	}
+
+	void close()
+	{
+		for (auto it = conns.begin() ; it != conns.end() ; ++it) {
+			if (&*it == this) {
+				conns.erase(it);
+				return;
+			}
+		}
+	}
+};
+
+/*
+ * The stats socket writes the metrics of all backends and connections to
+ * anyone connecting, then closes the connection.
+ */
+class stats_listener {
+public:
+	std::string path;
+	smart_event<event_unhandled_exception::handle> ev;
+	std::list<stats_conn> conns;
+
+	stats_listener(std::string path, int fd)
+		: path(std::move(path))
+	{
+		ev.set_fd(fd);
+		ev.set(EV_READ | EV_PERSIST, std::bind(&stats_listener::accept_connection, this, std::placeholders::_1));
+		if (ev.add())
+			err(1, "event_add(%d)", fd);
+	}
+
+	~stats_listener()
+	{
+		unlink(path.c_str());
+	}
+
+	void accept_connection(int fd)
+	{
+		smart_fd cfd(accept(fd, NULL, NULL));
+		std::string out;
+
+		if (!cfd) {
+			warn("stats accept");
+			return;
+		}
+
+		backend_format_metrics(out);
+		for (auto &ss : serversides) {
+			for (auto &conn : ss.conns) {
+				char prefix[64];
+
+				snprintf(prefix, sizeof(prefix), "%s.conn%d", ss.name.c_str(), conn.fd.fd);
+				conn.metrics.format(out, prefix);
+			}
+		}
+		out += "\n";
+
+		/* Written as the reader takes it, a slow one doesn't hold up the daemon. */
+		fcntl(cfd, F_SETFL, O_NONBLOCK);
+		conns.emplace_back(conns, std::move(cfd));
+		if (conns.back().be.write(out)) {
+			warn("stats write");
+			conns.pop_back();
+		}
+	}
+};
+
+std::list<stats_listener> stats_listeners;
+
+void
+serverside_listen_stats(const std::string &path) {
+	struct sockaddr_storage addr;
+	int s = listen_local_socket(path, &addr);
+
+	stats_listeners.emplace_back(path, s);
+}
+
+std::string
+api_ss_conn::recorder_name() const
+{
+	char name[64];
+
+	snprintf(name, sizeof(name), "%s.conn%d", ss.name.c_str(), fd.fd);
+	return name;
+}
+
+void
+serverside_dump_recorders(capture_writer &w)
+{
+	for (auto &c : closed_recorders)
+		w.add(CAPTURE_CONN, "", c.name, c.recorder);
+	for (auto &ss : serversides) {
+		for (auto &conn : ss.conns)
+			w.add(CAPTURE_CONN, "", conn.recorder_name(), conn.recorder);
+	}
 }
 
 void
@@ -436,7 +756,7 @@ serverside_listen_tcp(std::string name, backend_ptr &bdev, const std::string &se
 }
 
 serverside::serverside(std::string name, backend_ptr &bdev, const struct sockaddr *addr, socklen_t addrlen, bool should_unlink, int fd)
-	: name(std::move(name)), fd(fd), bdev(bdev), addrlen(addrlen), should_unlink(should_unlink)
+	: name(std::move(name)), fd(fd), bdev(bdev), addrlen(addrlen), should_unlink(should_unlink), disabled(false), generation(0)
 {
 	memcpy(&this->addr, addr, addrlen);
 
@@ -459,5 +779,6 @@ serverside::~serverside()
 void
 serverside_close_all (void)
 {
+	stats_listeners.clear();
 	serversides.clear();
 }
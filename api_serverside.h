@@ -37,10 +37,13 @@ void serverside_close_all(void);
 #include <string>
 
 class backend_ptr;
+class capture_writer;
 
 void serverside_listen_fd(std::string name, backend_ptr &bdev, int fd);
 void serverside_listen_local(std::string name, backend_ptr &bdev, const std::string &path);
 void serverside_listen_tcp(std::string name, backend_ptr &bdev, const std::string &serv);
+void serverside_listen_stats(const std::string &path);
+void serverside_dump_recorders(capture_writer &w);
 
 #endif
 
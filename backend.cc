@@ -40,8 +40,11 @@
 #include <fcntl.h>
 #include <stdarg.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <sys/stat.h>
 
+#include <algorithm>
 #include <forward_list>
 #include <functional>
 #include <list>
@@ -55,6 +58,7 @@
 #include "smart_event.hh"
 #include "smart_evbuffer.hh"
 #include "event_unhandled_exception.hh"
+#include "trace.hh"
 
 #include "backend_type.h"
 
@@ -99,7 +103,17 @@ add_backend_device(const char *str) {
 
 	std::string type(str, next - str);
 	str = next + 1;
-	next = strchr(str, ':');
+	if (strncmp(str, "tcp://", 6) == 0) {
+		/* The path has a :port, and the host might be an [IPv6] address. */
+		next = str + 6;
+		if (*next == '[' && strchr(next, ']'))
+			next = strchr(next, ']');
+		next = strchr(next, ':');
+		if (!next)
+			errx (1, "No port for backend: %s:%s", name.c_str(), str);
+		next = strchr(next + 1, ':');
+	} else
+		next = strchr(str, ':');
 
 	std::string path, client;
 	if (next) {
@@ -117,18 +131,40 @@ add_backend_device(const char *str) {
 		path = std::string(str);
 	}
 
+	struct line_profile profile;
+	line_profile_default(&profile);
+
+	/* Serial options follow the path, as in /dev/ttyUSB0,115200,8n1. */
+	size_t comma = path.find(',');
+	if (comma != std::string::npos) {
+		if (path.compare(0, 6, "tcp://") == 0)
+			errx (1, "%s: Serial options are set on the serial server", name.c_str());
+		if (line_profile_parse(&profile, path.c_str() + comma + 1))
+			errx (1, "%s: Bad serial options: %s", name.c_str(), path.c_str() + comma + 1);
+		path.erase(comma);
+	}
+
 	const struct backend_type *bt = backend_type(type.c_str(), type.length());
 	if (!bt)
 		errx (1, "Unknown device type: %s", type.c_str());
 
 	backend_device::create(name, bt->creator, path, client, ms);
+	backend_device::impl(backends.back()).type = bt->name;
+	backend_device::impl(backends.back()).profile = profile;
+	if (path.compare(0, 6, "tcp://") == 0)
+		backend_device::impl(backends.back()).resolve_line();
 }
 
 backend_device::backend_device(backend_ptr &ptr, std::string name, std::string line, std::string client, int throttle)
-	: ptr(ptr), name(std::move(name)), line(std::move(line)), client(std::move(client))
+	: ptr(ptr), name(std::move(name)), line(std::move(line)), line_up(false), flushing(NULL), flushed(0),
+	reconnect_delay(0), reopen(false),
+	client(std::move(client)), last_written(NULL), window(0), max_retries(2), recorder(64 * 1024), commands_queued(0), commands_done(0)
 {
 	out_throttle.tv_sec = throttle / 1000;
 	out_throttle.tv_usec = (throttle % 1000) * 1000;
+	reply_timeout.tv_sec = 1;
+	reply_timeout.tv_usec = 0;
+	line_profile_default(&profile);
 }
 
 void
@@ -136,10 +172,25 @@ backend_device::readcb(short what) {
 	size_t len;
 
 	int res = input.read(line_fd, 1024);
+	if (res < 0 && tcp_line()) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		warn("%s: read", name.c_str());
+		line_lost();
+		return;
+	}
 	if (res < 0)
 		err (1, "evbuffer_read");
+	if (res == 0 && tcp_line()) {
+		warnx("%s: Connection closed", name.c_str());
+		line_lost();
+		return;
+	}
 	if (res == 0)
 		event_loopexit (NULL);
+	metrics.bytes_in += res;
+	if (res > 0)
+		recorder.record(CAPTURE_IN, input.data() + input.length() - res, res);
 
 	while ((len = input.length())) {
 		unsigned char *data = input.data();
@@ -153,54 +204,568 @@ backend_device::readcb(short what) {
 			break;
 
 		if (i > 0) {
+			/* output_replied sets the trace of the command answered. */
+			trace_scope ts(0);
+
 			data[i] = '\0';
-			update_status((char*)data, output.inptr());
+			metrics.packets_in++;
+			update_status(packet_view((char*)data, i), output.inptr());
 		}
 		input.drain(i + 1);
 	}
 }
 
+/*
+ * Returns false if out wasn't written in full. A serial line that fails is
+ * fatal. On a tcp:// line the rest of a partial write waits for the socket,
+ * and a command never written is put back in the queue if the line is lost.
+ */
+bool
+backend_device::write_output(struct backend_output &out)
+{
+	ssize_t res = write (line_fd, out.data, out.len);
+
+	if (res != out.len) {
+		if (!tcp_line())
+			err (1, "write");
+		if (res >= 0 || errno == EAGAIN || errno == EINTR) {
+			flushing = &out;
+			flushed = res > 0 ? res : 0;
+			watch_line(EV_READ | EV_WRITE);
+			return false;
+		}
+		warn("%s: write", name.c_str());
+		line_lost();
+		return false;
+	}
+	output_written(out);
+	return true;
+}
+
+void
+backend_device::flushcb()
+{
+	struct backend_output &out = *flushing;
+	ssize_t res = write (line_fd, out.data + flushed, out.len - flushed);
+
+	if (res < 0) {
+		if (errno == EAGAIN || errno == EINTR)
+			return;
+		warn("%s: write", name.c_str());
+		line_lost();
+		return;
+	}
+	flushed += res;
+	if (flushed < out.len)
+		return;
+
+	flushing = NULL;
+	watch_line(EV_READ);
+	output_written(out);
+}
+
+void
+backend_device::output_written(struct backend_output &out)
+{
+	struct timeval wait = reply_timeout;
+	bool first = out.tries == 0;
+
+	recorder.record(CAPTURE_OUT, out.data, out.len);
+	gettimeofday(&out.sent, NULL);
+	metrics.bytes_out += out.len;
+	metrics.packets_out++;
+
+	if (out.tries++ == 0) {
+		struct timeval waited;
+
+		timersub(&out.sent, &out.queued, &waited);
+		metrics.command_to_write.add(waited);
+		metrics.queue_wait_usec += (uint64_t)waited.tv_sec * 1000000 + waited.tv_usec;
+	}
+	if (out.trace)
+		trace_event(out.trace, "write", ",\"backend\":%s,\"data\":%s,\"try\":%d",
+				trace_quote(name).c_str(), trace_quote(out.data, out.len).c_str(), out.tries);
+
+	if (timercmp(&out.throttle, &wait, >))
+		wait = out.throttle;
+	if (out.resync)
+		out.deadline = out.sent;
+	else
+		timeradd(&out.sent, &wait, &out.deadline);
+
+	if (output.inptr() == &out)
+		arm_reply_timer();
+	if (!first)
+		return;
+
+	/* Whatever is left in the queue now waits for the throttle. */
+	if (timerisset(&metrics.stall_start)) {
+		struct timeval stalled;
+
+		timersub(&out.sent, &metrics.stall_start, &stalled);
+		metrics.throttle_stall_usec += (uint64_t)stalled.tv_sec * 1000000 + stalled.tv_usec;
+		timerclear(&metrics.stall_start);
+	}
+	if (output.has_unsent())
+		metrics.stall_start = out.sent;
+
+	if (out.throttle.tv_sec > 0 || out.throttle.tv_usec > 0)
+		last_throttle = out.throttle;
+	else
+		last_throttle = out_throttle;
+	last_written = &out;
+	write_ev.add(last_throttle);
+}
+
 void
 backend_device::writecb() {
+	if (!line_up || flushing)
+		return;
+	if (window && output.in_flight() >= window)
+		return;
+
+	/* A retried command is answered after anything written since, so it waits alone. */
+	const struct backend_output *in = output.inptr();
+	if (in && in->tries > 1)
+		return;
+
 	auto out = output.to_send();
 
 	if (out == output.end())
 		return;
 
-	if (write (line_fd, out->data, out->len) != out->len)
-		err (1, "write");
+	write_output(*out);
+}
+
+/*
+ * Replies come in the order the commands were written, so only the oldest
+ * command waiting for one can time out.
+ */
+void
+backend_device::arm_reply_timer()
+{
+	const struct backend_output *out = output.inptr();
+	struct timeval now, left;
 
-	if (out->throttle.tv_sec > 0 || out->throttle.tv_usec > 0)
-		write_ev.add(out->throttle);
+	reply_ev.del();
+	if (!line_up || !out || out == flushing)
+		return;
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&out->deadline, &now, >))
+		timersub(&out->deadline, &now, &left);
 	else
-		write_ev.add(out_throttle);
+		timerclear(&left);
+	reply_ev.add(left);
+}
+
+void
+backend_device::replycb()
+{
+	const struct backend_output *out;
+	struct timeval now;
+	bool dropped = false;
+
+	if (!line_up)
+		return;
+
+	gettimeofday(&now, NULL);
+	while ((out = output.inptr()) && out != flushing && !timercmp(&out->deadline, &now, >)) {
+		if (out->resync) {
+			remove_output(&out);
+			continue;
+		}
+		if (out->retries > 0) {
+			struct backend_output *rout = const_cast<struct backend_output*>(out);
+
+			warnx("%s: No reply to %.*s, retrying", name.c_str(), (int)out->len - 1, out->data);
+			metrics.commands_retried++;
+			rout->retries--;
+			write_output(*rout);
+			break;
+		}
+		warnx("%s: No reply to %.*s, dropping", name.c_str(), (int)out->len - 1, out->data);
+		metrics.commands_dropped++;
+		if (out->trace)
+			trace_event(out->trace, "dropped", ",\"backend\":%s,\"data\":%s",
+					trace_quote(name).c_str(), trace_quote(out->data, out->len).c_str());
+		remove_output(&out);
+		dropped = true;
+	}
+
+	if (dropped)
+		resync();
+	arm_reply_timer();
+	if (!write_ev.pending(EV_TIMEOUT))
+		writecb();
+}
+
+/*
+ * Throw away any partial packet and terminate whatever the device might have
+ * received of a lost command. The CR is written before any other command
+ * still queued, but after what is being written now.
+ */
+void
+backend_device::resync()
+{
+	backend_output out;
+
+	input.reset();
+	if (!line_up)
+		return;
+
+	memset(&out, 0, sizeof(out));
+	out.data = strdup("\r");
+	if (!out.data)
+		err (1, "strdup");
+	out.len = 1;
+	out.resync = 1;
+	gettimeofday(&out.queued, NULL);
+	commands_queued++;
+	output.push_next(out);
+}
+
+/*
+ * Called by the backends when a reply matching out has been read. Anything
+ * written before out won't be answered anymore and is removed with it. The
+ * latency is fed to the pacer and, if out was the last command written with
+ * the default throttle, it is cut short to what the pacer considers safe.
+ */
+void
+backend_device::output_replied(const struct backend_output **inptr, const struct backend_output *out)
+{
+	struct timeval now, latency, ready, left;
+	struct timeval sent = out->sent;
+	bool was_last = out == last_written;
+
+	gettimeofday(&now, NULL);
+	if (out->tries == 1) {
+		/* Can't tell which write a retried command's reply belongs to. */
+		timersub(&now, &sent, &latency);
+		pacer.sample(latency);
+		metrics.write_to_reply.add(latency);
+	}
+	if (out->trace) {
+		trace_current = out->trace;
+		trace_event(out->trace, "reply", ",\"backend\":%s,\"data\":%s",
+				trace_quote(name).c_str(), trace_quote(out->data, out->len).c_str());
+	}
+
+	while (*inptr != out) {
+		if ((*inptr)->resync) {
+			remove_output(inptr);
+			continue;
+		}
+		metrics.commands_dropped++;
+		if ((*inptr)->trace)
+			trace_event((*inptr)->trace, "dropped", ",\"backend\":%s,\"data\":%s",
+					trace_quote(name).c_str(), trace_quote((*inptr)->data, (*inptr)->len).c_str());
+		remove_output(inptr);
+	}
+	remove_output(inptr);
+	arm_reply_timer();
+
+	if (!write_ev.pending(EV_TIMEOUT)) {
+		writecb();
+		return;
+	}
+	/* An explicit throttle is a wait the device needs even after replying. */
+	if (!was_last || timerisset(&out->throttle))
+		return;
+
+	struct timeval iv = pacer.interval(last_throttle);
+	timeradd(&sent, &iv, &ready);
+	write_ev.del();
+	if (timercmp(&ready, &now, >)) {
+		timersub(&ready, &now, &left);
+		write_ev.add(left);
+	} else {
+		writecb();
+	}
 }
 
 void
 backend_device::open()
 {
-	line_fd = open_line (line.c_str(), O_RDWR);
+	write_ev.set_fd(-1);
+	write_ev.set(EV_TIMEOUT, std::bind(&backend_device::writecb, this));
+	reply_ev.set_fd(-1);
+	reply_ev.set(EV_TIMEOUT, std::bind(&backend_device::replycb, this));
+
+	if (tcp_line()) {
+		reconnect_ev.set_fd(-1);
+		reconnect_ev.set(EV_TIMEOUT, std::bind(&backend_device::reconnectcb, this));
+		connect_line();
+		return;
+	}
+
+	line_fd = open_line (line.c_str(), O_RDWR, &profile);
 	if (!line_fd)
 		err (1, "open_line");
+	metrics.opens++;
+	recorder.record(CAPTURE_OPEN, NULL, 0);
+	line_up = true;
 
 	read_ev.set_fd(line_fd);
 	read_ev.set(EV_READ | EV_PERSIST, std::bind(&backend_device::readcb, this, std::placeholders::_2));
-	write_ev.set_fd(-1);
-	write_ev.set(EV_TIMEOUT, std::bind(&backend_device::writecb, this));
 
 	if (read_ev.add())
 		err (1, "event_add");
 }
 
+/*
+ * Lines given as tcp://host:port are on serial servers such as ser2net.
+ * They are connected without blocking, and reconnected on their own when
+ * lost, backing off up to half a minute. Commands keep queueing meanwhile.
+ */
+bool
+backend_device::tcp_line() const
+{
+	return line.compare(0, 6, "tcp://") == 0;
+}
+
+/*
+ * Looked up before the event loop runs, so that a slow or missing DNS
+ * server can't stall the other lines later. Use an address to not depend
+ * on one at all.
+ */
+void
+backend_device::resolve_line()
+{
+	std::string host = line.substr(6);
+	std::string port;
+	size_t pos = host.rfind(':');
+	struct addrinfo hints, *res;
+	int e;
+
+	if (pos != std::string::npos) {
+		port = host.substr(pos + 1);
+		host.erase(pos);
+	}
+	if (host.size() > 2 && host[0] == '[' && host[host.size() - 1] == ']')
+		host = host.substr(1, host.size() - 2);
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = PF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	e = getaddrinfo(host.c_str(), port.c_str(), &hints, &res);
+	if (e)
+		errx (1, "%s: %s: %s", name.c_str(), line.c_str(), gai_strerror(e));
+	line_addrs.reset(res, freeaddrinfo);
+}
+
+void
+backend_device::connect_line()
+{
+	struct addrinfo *ai;
+	int fd = -1;
+
+	read_ev.reset();
+	line_fd.close();
+
+	for (ai = line_addrs.get() ; ai ; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (fcntl(fd, F_SETFL, O_NONBLOCK) == 0
+				&& (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0 || errno == EINPROGRESS))
+			break;
+		::close(fd);
+		fd = -1;
+	}
+	if (fd < 0) {
+		warn("%s: %s", name.c_str(), line.c_str());
+		line_lost();
+		return;
+	}
+
+	line_fd = fd;
+	read_ev.set_fd(line_fd);
+	read_ev.set(EV_WRITE, std::bind(&backend_device::connectcb, this, std::placeholders::_2));
+
+	struct timeval tv = { 10, 0 };
+	if (read_ev.add(tv))
+		err (1, "event_add");
+}
+
+void
+backend_device::connectcb(short what)
+{
+	int error = ETIMEDOUT;
+	socklen_t len = sizeof(error);
+	int one = 1;
+
+	if (!(what & EV_TIMEOUT) && getsockopt(line_fd, SOL_SOCKET, SO_ERROR, &error, &len))
+		error = errno;
+	if (error) {
+		warnx("%s: %s: %s", name.c_str(), line.c_str(), strerror(error));
+		line_lost();
+		return;
+	}
+
+	setsockopt(line_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	metrics.opens++;
+	recorder.record(CAPTURE_OPEN, NULL, 0);
+	line_up = true;
+	reconnect_delay = 0;
+
+	watch_line(EV_READ);
+
+	/* Flush whatever the device got of a partial command, as open_line does. */
+	resync();
+	arm_reply_timer();
+	if (!write_ev.pending(EV_TIMEOUT))
+		writecb();
+}
+
+/*
+ * A line that was up is opened again through the backend, so it sets the
+ * device up like the first time. A connect that failed is just retried.
+ */
+void
+backend_device::reconnectcb()
+{
+	if (reopen) {
+		reopen = false;
+		/* Left armed if the line was lost while writing. */
+		write_ev.del();
+		reply_ev.del();
+		open();
+	} else
+		connect_line();
+}
+
+/* Only on a tcp:// line, EV_WRITE while a partial write is left. */
+void
+backend_device::watch_line(short what)
+{
+	read_ev.del();
+	read_ev.set(what | EV_PERSIST, std::bind(&backend_device::linecb, this, std::placeholders::_2));
+	if (read_ev.add())
+		err (1, "event_add");
+}
+
+void
+backend_device::linecb(short what)
+{
+	if (what & EV_WRITE) {
+		flushcb();
+		if (!line_up)
+			return;
+	}
+	if (what & EV_READ)
+		readcb(what);
+}
+
+void
+backend_device::line_lost()
+{
+	struct timeval tv = { 0, 0 };
+
+	/* The socket is closed when reconnecting, not from its own callback. */
+	read_ev.del();
+	write_ev.del();
+	reply_ev.del();
+	input.reset();
+	flushing = NULL;
+	output.requeue_unwritten();
+	if (line_up)
+		reopen = true;
+	line_up = false;
+
+	reconnect_delay = reconnect_delay ? std::min(reconnect_delay * 2, 30) : 1;
+	tv.tv_sec = reconnect_delay;
+	reconnect_ev.add(tv);
+}
+
 void
 backend_device::close()
 {
 	read_ev.reset();
 	write_ev.reset();
+	reply_ev.reset();
+	reconnect_ev.reset();
 	input.reset();
 	line_fd.close();
+	line_up = false;
+	reopen = false;
+	reconnect_delay = 0;
+	flushing = NULL;
 
 	output.clear();
+	last_written = NULL;
+	commands_done = commands_queued;
+	run_sync_waiters();
+}
+
+/*
+ * Forget all queued output, written or not, without waiting for replies.
+ * The line stays open.
+ */
+void
+backend_device::discard_output()
+{
+	write_ev.del();
+	reply_ev.del();
+	if (flushing && line_up)
+		watch_line(EV_READ);
+	flushing = NULL;
+
+	output.clear();
+	last_written = NULL;
+	commands_done = commands_queued;
+	run_sync_waiters();
+}
+
+/* True while something queued is still to be written to the line. */
+bool
+backend_device::output_pending()
+{
+	return output.has_unsent() || flushing || write_ev.pending(EV_TIMEOUT);
+}
+
+void
+backend_device::format_metrics(std::string &out, const std::string &prefix) const
+{
+	struct timeval iv = pacer.interval(out_throttle);
+
+	metrics_append(out, prefix, "bytes_in", metrics.bytes_in);
+	metrics_append(out, prefix, "bytes_out", metrics.bytes_out);
+	metrics_append(out, prefix, "packets_in", metrics.packets_in);
+	metrics_append(out, prefix, "packets_out", metrics.packets_out);
+	metrics_append(out, prefix, "packets_dropped", metrics.packets_dropped);
+	metrics_append(out, prefix, "commands_retried", metrics.commands_retried);
+	metrics_append(out, prefix, "commands_dropped", metrics.commands_dropped);
+	metrics_append(out, prefix, "queue_depth", output.size());
+	metrics_append(out, prefix, "queue_in_flight", output.in_flight());
+	metrics_append(out, prefix, "queue_max", metrics.queue_max);
+	metrics_append(out, prefix, "queue_wait_us", metrics.queue_wait_usec);
+	metrics_append(out, prefix, "throttle_stall_us", metrics.throttle_stall_usec);
+	metrics_append(out, prefix, "notifications", metrics.notifications);
+	metrics_append(out, prefix, "reconnects", metrics.opens ? metrics.opens - 1 : 0);
+	metrics_append(out, prefix, "pacer_samples", pacer.samples());
+	metrics_append(out, prefix, "pacer_srtt_us", pacer.srtt_usec());
+	metrics_append(out, prefix, "pacer_rttvar_us", pacer.rttvar_usec());
+	metrics_append(out, prefix, "pacer_interval_us", (uint64_t)iv.tv_sec * 1000000 + iv.tv_usec);
+	metrics.command_to_write.format(out, prefix + "command_to_write");
+	metrics.write_to_reply.format(out, prefix + "write_to_reply");
+}
+
+void
+backend_format_metrics(std::string &out)
+{
+	for (auto &bdev : backends)
+		backend_device::impl(bdev).format_metrics(out, backend_device::impl(bdev).name + ".");
+}
+
+void
+backend_dump_recorders(capture_writer &w)
+{
+	for (auto &bdev : backends) {
+		backend_device &impl = backend_device::impl(bdev);
+
+		w.add(CAPTURE_BACKEND, impl.type, impl.name, impl.recorder);
+	}
 }
 
 void
@@ -303,7 +868,7 @@ backend_close_all(void)
 }
 
 void
-backend_device::send(const struct timeval *throttle, const char *fmt, va_list ap)
+backend_device::send(const struct timeval *throttle, int retries, const char *fmt, va_list ap)
 {
 	backend_output out;
 
@@ -315,10 +880,25 @@ backend_device::send(const struct timeval *throttle, const char *fmt, va_list ap
 		out.throttle = *throttle;
 	else
 		memset(&out.throttle, 0, sizeof (out.throttle));
+	gettimeofday(&out.queued, NULL);
+	timerclear(&out.sent);
+	timerclear(&out.deadline);
+	out.retries = retries;
+	out.tries = 0;
+	out.trace = trace_current;
+	out.resync = 0;
+	commands_queued++;
+	if (out.trace)
+		trace_event(out.trace, "queued", ",\"backend\":%s,\"data\":%s,\"queue_depth\":%zu",
+				trace_quote(name).c_str(), trace_quote(out.data, out.len).c_str(), output.size());
 
 	output.push(out);
+	if (output.size() > metrics.queue_max)
+		metrics.queue_max = output.size();
 	if (!write_ev.pending(EV_TIMEOUT))
 		writecb();
+	if (output.has_unsent() && !timerisset(&metrics.stall_start))
+		metrics.stall_start = out.queued;
 }
 
 void
@@ -326,16 +906,16 @@ backend_device::send(const char *fmt, ...) {
 	va_list ap;
 
 	va_start(ap, fmt);
-	send(NULL, fmt, ap);
+	send(NULL, max_retries, fmt, ap);
 	va_end(ap);
 }
 
 void
-backend_device::send_throttle(const struct timeval *throttle, const char *fmt, ...) {
+backend_device::send_throttle(const struct timeval *throttle, int retries, const char *fmt, ...) {
 	va_list ap;
 
 	va_start(ap, fmt);
-	send(throttle, fmt, ap);
+	send(throttle, retries, fmt, ap);
 	va_end(ap);
 }
 
@@ -350,9 +930,54 @@ backend_device::remove_output(const struct backend_output **inptr)
 		return;
 	}
 
+	if (out == last_written)
+		last_written = NULL;
 	free(out->data);
 	output.pop();
 	*inptr = output.inptr();
+	commands_done++;
+	run_sync_waiters();
+}
+
+backend_sync_token::backend_sync_token(struct backend_sync_waiter &waiter)
+	: waiter(waiter)
+{
+}
+
+backend_sync_token::~backend_sync_token()
+{
+	waiter.bdev.sync_waiters.remove(waiter);
+}
+
+std::unique_ptr<backend_sync_token>
+backend_device::sync(std::function<void()> cb)
+{
+	if (commands_done == commands_queued)
+		return NULL;
+
+	sync_waiters.emplace_back(*this, commands_queued, std::move(cb));
+	return std::unique_ptr<backend_sync_token>(new backend_sync_token(sync_waiters.back()));
+}
+
+/*
+ * Waiters are kept until their token is destroyed, which the callback might
+ * do, so look for the next one from the start each time.
+ */
+void
+backend_device::run_sync_waiters()
+{
+	for (;;) {
+		auto it = std::find_if(sync_waiters.begin(), sync_waiters.end(), [this](const backend_sync_waiter &w) {
+			return w.cb && w.target <= commands_done;
+		});
+
+		if (it == sync_waiters.end())
+			return;
+
+		auto cb = std::move(it->cb);
+		it->cb = nullptr;
+		cb();
+	}
 }
 
 void
@@ -372,6 +997,18 @@ backend_ptr::send_status_request(const std::string &code)
 	bdev->send_status_request(code);
 }
 
+void
+backend_ptr::format_metrics(std::string &out)
+{
+	bdev->format_metrics(out, "");
+}
+
+std::unique_ptr<backend_sync_token>
+backend_ptr::sync(std::function<void()> cb)
+{
+	return bdev->sync(std::move(cb));
+}
+
 bool
 backend_ptr::query_command(const std::string &code)
 {
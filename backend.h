@@ -26,6 +26,7 @@
 #ifndef BACKEND_H
 #define BACKEND_H
 
+#include <stdint.h>
 #include <sys/types.h>
 #include <sys/time.h>
 
@@ -37,6 +38,15 @@ struct backend_output {
 	char *data;
 	ssize_t len;
 	struct timeval throttle;
+	struct timeval queued;
+	struct timeval sent;
+	struct timeval deadline;
+	int retries;
+	int tries;
+	/* Trace ID of the command that queued this, see trace.hh. */
+	uint32_t trace;
+	/* A CR written to resync the device, nothing answers it. */
+	int resync;
 };
 
 void add_backend_device(const char *str);
@@ -53,12 +63,26 @@ void backend_close_all (void);
 
 #include <functional>
 #include <memory>
+#include <string>
 #include <vector>
 
+void backend_format_metrics(std::string &out);
+
 class backend_device;
+class capture_writer;
+
+void backend_dump_recorders(capture_writer &w);
 class status;
 class status_notify_token;
 
+class backend_sync_token
+{
+	struct backend_sync_waiter &waiter;
+public:
+	backend_sync_token(struct backend_sync_waiter &waiter);
+	~backend_sync_token();
+};
+
 class backend_ptr
 {
 	std::unique_ptr<backend_device> bdev;
@@ -76,6 +100,13 @@ public:
 	int query(const std::string &code, std::string &out_buf);
 	void send_command(const std::string &cmd, const std::vector<int32_t> &args);
 	void send_status_request(const std::string &code);
+	void format_metrics(std::string &out);
+
+	/*
+	 * Call cb once every command queued so far has been answered or given
+	 * up on. Returns NULL without calling cb if there are none.
+	 */
+	std::unique_ptr<backend_sync_token> sync(std::function<void()> cb);
 
 	std::unique_ptr<status_notify_token> start_notify(const std::string &code, backend_ptr::notify_cb cb);
 };
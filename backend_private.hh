@@ -23,10 +23,17 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <list>
+#include <memory>
 #include <string>
 
 #include "backend.h"
 #include "event_unhandled_exception.hh"
+#include "flight_recorder.hh"
+#include "line.h"
+#include "metrics.hh"
+#include "pacer.hh"
+#include "packet_view.hh"
 #include "smart_fd.hh"
 #include "smart_event.hh"
 #include "smart_evbuffer.hh"
@@ -37,10 +44,12 @@ class output_list
 	list_type list;
 	list_type::iterator send_iter;
 	list_type::iterator insert_iter;
+	size_t nsent;
+	size_t nqueued;
 
 public:
 	output_list()
-		: send_iter(list.end()), insert_iter(list.before_begin())
+		: send_iter(list.end()), insert_iter(list.before_begin()), nsent(0), nqueued(0)
 	{
 	}
 
@@ -48,9 +57,26 @@ public:
 	{
 		if (send_iter == list.end())
 			return send_iter;
+		nsent++;
 		return send_iter++;
 	}
 
+	/* Number of entries written but not yet removed. */
+	size_t in_flight() const
+	{
+		return nsent;
+	}
+
+	size_t size() const
+	{
+		return nqueued;
+	}
+
+	bool has_unsent() const
+	{
+		return send_iter != list.end();
+	}
+
 	const backend_output *inptr()
 	{
 		if (list.empty() || send_iter == list.begin())
@@ -58,25 +84,71 @@ public:
 		return &list.front();
 	}
 
+	const backend_output *next_sent(const backend_output *out)
+	{
+		for (auto it = list.begin() ; it != send_iter ; ++it) {
+			if (&*it == out) {
+				if (++it == send_iter)
+					return NULL;
+				return &*it;
+			}
+		}
+		return NULL;
+	}
+
+	/* Queues o to be written before anything else not yet written. */
+	void push_next(backend_output o)
+	{
+		auto prev = list.before_begin();
+
+		for (auto it = list.begin() ; it != send_iter ; ++it)
+			prev = it;
+		auto it = list.insert_after(prev, std::move(o));
+		if (insert_iter == prev)
+			insert_iter = it;
+		send_iter = it;
+		nqueued++;
+	}
+
 	void push(backend_output o)
 	{
 		insert_iter = list.insert_after(insert_iter, std::move(o));
+		nqueued++;
 		if (send_iter == list.end())
 			send_iter = insert_iter;
 	}
 
 	void pop()
 	{
+		if (send_iter != list.begin())
+			nsent--;
+		nqueued--;
 		if (insert_iter == list.begin())
 			insert_iter = list.before_begin();
 		list.pop_front();
 	}
 
+	/* Puts back entries taken with to_send but never written to the line. */
+	void requeue_unwritten()
+	{
+		size_t n = 0;
+
+		for (auto it = list.begin() ; it != send_iter ; ++it, ++n) {
+			if (it->tries == 0) {
+				send_iter = it;
+				nsent = n;
+				return;
+			}
+		}
+	}
+
 	void clear()
 	{
 		list.clear();
 		send_iter = list.end();
 		insert_iter = list.before_begin();
+		nsent = 0;
+		nqueued = 0;
 	}
 
 	decltype(list.end()) end()
@@ -85,16 +157,48 @@ public:
 	}
 };
 
+struct backend_sync_waiter
+{
+	class backend_device &bdev;
+	uint64_t target;
+	std::function<void()> cb;
+
+	backend_sync_waiter(class backend_device &bdev, uint64_t target, std::function<void()> cb)
+		: bdev(bdev), target(target), cb(std::move(cb))
+	{
+	}
+
+	bool
+	operator == (const backend_sync_waiter &r)
+	{
+		return this == &r;
+	}
+};
+
 class backend_device {
 public:
 	backend_ptr &ptr;
 
 	std::string name;
+	std::string type;
 
 	std::string line;
+	struct line_profile profile;
 	smart_fd line_fd;
 	smart_event<event_unhandled_exception::handle> read_ev;
 	smart_event<event_unhandled_exception::handle> write_ev;
+	smart_event<event_unhandled_exception::handle> reply_ev;
+
+	/* Nothing is written while false, a tcp:// line is still connecting. */
+	bool line_up;
+	/* Addresses of a tcp:// line, looked up once when the device is added. */
+	std::shared_ptr<struct addrinfo> line_addrs;
+	/* A command the socket only took part of, the rest waits for EV_WRITE. */
+	struct backend_output *flushing;
+	ssize_t flushed;
+	smart_event<event_unhandled_exception::handle> reconnect_ev;
+	int reconnect_delay;
+	bool reopen;
 
 	smart_evbuffer input;
 	output_list output;
@@ -102,6 +206,23 @@ public:
 
 	std::string client;
 
+	adaptive_pacer pacer;
+	const struct backend_output *last_written;
+	struct timeval last_throttle;
+
+	/* Max number of commands waiting for a reply, 0 for no limit. */
+	size_t window;
+	struct timeval reply_timeout;
+	int max_retries;
+
+	backend_metrics metrics;
+	flight_recorder recorder;
+
+	/* Commands ever queued and ever answered or given up on. */
+	uint64_t commands_queued;
+	uint64_t commands_done;
+	std::list<backend_sync_waiter> sync_waiters;
+
 	backend_device(backend_ptr &ptr, std::string name, std::string line, std::string client, int throttle);
 
 	virtual void open();
@@ -110,10 +231,22 @@ public:
 	void listen(int fd);
 	void listen_to_client();
 
-	void send(const struct timeval *throttle, const char *fmt, va_list ap);
+	void format_metrics(std::string &out, const std::string &prefix) const;
+
+	void send(const struct timeval *throttle, int retries, const char *fmt, va_list ap);
 	void send(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
-	void send_throttle(const struct timeval *throttle, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+	void send_throttle(const struct timeval *throttle, int retries, const char *fmt, ...) __attribute__((format(printf, 4, 5)));
+	void output_replied(const struct backend_output **inptr, const struct backend_output *out);
 	void remove_output(const struct backend_output **inptr);
+	void resync();
+	void resolve_line();
+
+	/* For movareplay and bench_codec, which drive the line themselves. */
+	void discard_output();
+	bool output_pending();
+
+	std::unique_ptr<backend_sync_token> sync(std::function<void()> cb);
+	void run_sync_waiters();
 
 	static backend_device &impl(backend_ptr &ptr);
 	static void create(std::string name, const backend_ptr::creator &creator,
@@ -123,14 +256,26 @@ public:
 	virtual void stop_notify(struct status_notify_info &ptr) = 0;
 
 	virtual const char *packet_separators() const = 0;
-	virtual void update_status(const std::string &packet, const struct backend_output *inptr) = 0;
+	virtual void update_status(packet_view packet, const struct backend_output *inptr) = 0;
 	virtual int send_status_request(const std::string &code) = 0;
 	virtual int query_command(const std::string &code) const = 0;
 	virtual int query_status(const std::string &code) const = 0;
 	virtual int query(const std::string &code, std::string &out_buf) = 0;
 	virtual void send_command(const std::string &cmd, const std::vector<int32_t> &args) = 0;
 private:
+	bool tcp_line() const;
+	void connect_line();
+	void connectcb(short what);
+	void reconnectcb();
+	void line_lost();
+	void watch_line(short what);
+	void linecb(short what);
+	void flushcb();
 	void readcb(short what);
 	void writecb();
+	void replycb();
+	bool write_output(struct backend_output &out);
+	void output_written(struct backend_output &out);
+	void arm_reply_timer();
 };
 
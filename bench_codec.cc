@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Microbenchmarks for the per-message code paths: base64 ints, command
+ * completion, parsing of device packets and formatting of device commands.
+ * The device backends are real ones, opened on pseudo terminals.
+ *
+ * Each benchmark is calibrated to run for at least the minimum time, then
+ * repeated. Results are printed one benchmark per line as key=value pairs.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <functional>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "backend.h"
+#include "base64.h"
+#include "complete.h"
+#include "status.hh"
+#include "status_private.hh"
+#include "event_unhandled_exception.hh"
+#include "pty.hh"
+
+std::exception_ptr event_unhandled_exception::exception;
+
+extern std::list<backend_ptr> backends;
+
+static uint64_t
+now_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Runs the benchmark for the given number of iterations, returning the time it took. */
+typedef std::function<uint64_t(long)> bench_func;
+
+static double min_time = 0.2;
+static int runs = 5;
+static const char *filter;
+
+static void
+run_bench(const char *name, const bench_func &func)
+{
+	if (filter && !strstr(name, filter))
+		return;
+
+	long iterations = 1;
+	uint64_t ns;
+
+	while ((ns = func(iterations)) < min_time * 1e9 && iterations < (1L << 40)) {
+		if (ns < min_time * 1e7)
+			iterations *= 10;
+		else
+			iterations = static_cast<long>(iterations * min_time * 1.2e9 / ns) + 1;
+	}
+
+	std::vector<double> per_op;
+	for (int i = 0 ; i < runs ; i++)
+		per_op.push_back(static_cast<double>(func(iterations)) / iterations);
+	std::sort(per_op.begin(), per_op.end());
+
+	printf("name=%s iterations=%ld runs=%d ns_per_op=%.1f min_ns_per_op=%.1f max_ns_per_op=%.1f\n",
+			name, iterations, runs, per_op[per_op.size() / 2], per_op.front(), per_op.back());
+	fflush(stdout);
+}
+
+/* Keeps the compiler from optimising away results. */
+static volatile int sink;
+
+static uint64_t
+bench_base64_int24(long iterations)
+{
+	char buf[4];
+	uint64_t start = now_ns();
+
+	for (long i = 0 ; i < iterations ; i++) {
+		base64_int24(buf, static_cast<int>(i));
+		sink = buf[0];
+	}
+	return now_ns() - start;
+}
+
+static uint64_t
+bench_debase64_int24(long iterations)
+{
+	static char bufs[1024][4];
+
+	for (int i = 0 ; i < 1024 ; i++)
+		base64_int24(bufs[i], i * 7919 - 500000);
+
+	uint64_t start = now_ns();
+	for (long i = 0 ; i < iterations ; i++)
+		sink = debase64_int24(bufs[i & 1023]);
+	return now_ns() - start;
+}
+
+static const char *const command_names[] = {
+#define COMMAND(name, code, nargs) #name,
+#include "all_commands.h"
+#undef COMMAND
+	"status", "listen", "disable", "enable", "metrics"
+};
+static const size_t num_command_names = sizeof(command_names) / sizeof(*command_names);
+
+/* The names in command_trie.h point into this table, like in cli.c. */
+#define COMMAND(x, y, z) {#x, y, z},
+struct command
+{
+	const char *name;
+	const char *code;
+	int nargs;
+} commands[] = {
+#include "all_commands.h"
+	{NULL}
+};
+#undef COMMAND
+
+#include "command_trie.h"
+
+static const char *const complete_inputs[][2] = {
+	{ "volume", "up" },
+	{ "power", "on" },
+	{ "source", "select_dvd" },
+	{ "aspect", "ratio_cinema1" },
+	{ "m", "tun" },
+};
+static const size_t num_complete_inputs = sizeof(complete_inputs) / sizeof(*complete_inputs);
+
+static void
+complete_elim(struct complete_candidate *cand)
+{
+}
+
+/*
+ * The list based complete() the CLI used before command_trie.h, kept as a
+ * baseline for complete_trie below.
+ */
+static uint64_t
+bench_complete(long iterations)
+{
+	std::vector<struct complete_candidate> cands(num_command_names);
+	uint64_t start = now_ns();
+
+	for (long i = 0 ; i < iterations ; i++) {
+		struct complete_candidate *list = NULL;
+
+		/* Rebuilding the list is part of what the CLI does for every invocation too. */
+		for (size_t c = 0 ; c < num_command_names ; c++) {
+			cands[c].name = command_names[c];
+			cands[c].name_off = 0;
+			cands[c].next = list;
+			list = &cands[c];
+		}
+		const char *const *argv = complete_inputs[i % num_complete_inputs];
+		sink = complete(&list, 2, const_cast<const char**>(argv), complete_elim);
+	}
+	return now_ns() - start;
+}
+
+static uint64_t
+bench_complete_trie(long iterations)
+{
+	std::vector<struct complete_candidate> buf(command_trie.nnames);
+	uint64_t start = now_ns();
+
+	for (long i = 0 ; i < iterations ; i++) {
+		struct complete_candidate *list;
+		const char *const *argv = complete_inputs[i % num_complete_inputs];
+
+		sink = complete_trie(&command_trie, 2, const_cast<const char**>(argv), buf.data(), &list);
+	}
+	return now_ns() - start;
+}
+
+struct bench_line
+{
+	std::string slave_path;
+	int slave;
+	int master;
+
+	bench_line()
+	{
+		master = open_sim_pty(slave_path, slave);
+		fcntl(master, F_SETFL, O_NONBLOCK);
+	}
+
+	~bench_line()
+	{
+		close(master);
+		close(slave);
+	}
+
+	/* Throw away whatever the backend wrote. */
+	void drain()
+	{
+		char buf[4096];
+
+		while (read(master, buf, sizeof(buf)) > 0)
+			;
+	}
+};
+
+static backend_device &
+bench_backend(const std::string &type, const bench_line &line)
+{
+	std::string spec = type + ":" + type + ":" + line.slave_path;
+
+	add_backend_device(spec.c_str());
+	return backend_device::impl(backends.back());
+}
+
+/* Let the backend write everything it has queued. */
+static void
+flush_output(backend_device &bdev, bench_line &line)
+{
+	while (bdev.output_pending()) {
+		event_loop(EVLOOP_ONCE | EVLOOP_NONBLOCK);
+		line.drain();
+	}
+	line.drain();
+}
+
+/* Forget the outputs without waiting for replies. */
+static void
+discard_output(backend_device &bdev, bench_line &line)
+{
+	bdev.discard_output();
+	line.drain();
+}
+
+/* Auto status packets as sent by a receiver with all layers enabled. */
+static const char *const marantz_stream[] = {
+	"@VOL:-30",
+	"@PWR:2",
+	"@SRC:22",
+	"@TOB:+02",
+	"@AMT:1",
+	"@SUR:0",
+	"@SIG:1",
+	"@SFQ:2",
+	"@TFQ:08750",
+	"@CHN:Channel 12      ",
+	"@ARN:Artist Name     ",
+	"@MVL:-40",
+	"@LIP:050",
+	"@TPR:03",
+	"@VOL:-29",
+	"@SLP:000",
+};
+static const size_t marantz_stream_len = sizeof(marantz_stream) / sizeof(*marantz_stream);
+
+static uint64_t
+bench_marantz_update_status(backend_device &bdev, long iterations)
+{
+	std::vector<std::string> packets(marantz_stream, marantz_stream + marantz_stream_len);
+	uint64_t start = now_ns();
+
+	for (long i = 0 ; i < iterations ; i++)
+		bdev.update_status(packets[i % marantz_stream_len], bdev.output.inptr());
+	return now_ns() - start;
+}
+
+/* Status requests and the TV's replies to them. */
+static const struct {
+	const char *code;
+	const char *reply;
+} lge_stream[] = {
+	{ "VOL ", "f 01 OK0A" },
+	{ "PWR ", "a 01 OK01" },
+	{ "AMT ", "e 01 OK00" },
+	{ "CTR ", "g 01 OK32" },
+	{ "SRC ", "b 01 OK90" },
+	{ "BRT ", "h 01 OK32" },
+};
+static const size_t lge_stream_len = sizeof(lge_stream) / sizeof(*lge_stream);
+
+/*
+ * Replies are only parsed if they match a command written, so the requests
+ * are written in batches outside the timing and the replies then parsed.
+ */
+static uint64_t
+bench_lge_update_status(backend_device &bdev, bench_line &line, long iterations)
+{
+	const long batch = 128;
+	std::vector<std::string> replies;
+	uint64_t total = 0;
+
+	for (size_t i = 0 ; i < lge_stream_len ; i++)
+		replies.push_back(lge_stream[i].reply);
+
+	for (long done = 0 ; done < iterations ; done += batch) {
+		long n = std::min(batch, iterations - done);
+
+		for (long i = 0 ; i < n ; i++)
+			bdev.send_status_request(lge_stream[(done + i) % lge_stream_len].code);
+		flush_output(bdev, line);
+
+		uint64_t start = now_ns();
+		for (long i = 0 ; i < n ; i++)
+			bdev.update_status(replies[(done + i) % lge_stream_len], bdev.output.inptr());
+		total += now_ns() - start;
+	}
+	return total;
+}
+
+struct bench_command
+{
+	const char *cmd;
+	std::vector<int32_t> args;
+};
+
+static uint64_t
+bench_send_command(backend_device &bdev, bench_line &line, const std::vector<bench_command> &cmds, long iterations)
+{
+	const long batch = 256;
+	uint64_t total = 0;
+
+	for (long done = 0 ; done < iterations ; done += batch) {
+		long n = std::min(batch, iterations - done);
+		uint64_t start = now_ns();
+
+		for (long i = 0 ; i < n ; i++) {
+			const bench_command &c = cmds[(done + i) % cmds.size()];
+
+			bdev.send_command(c.cmd, c.args);
+		}
+		total += now_ns() - start;
+		discard_output(bdev, line);
+	}
+	return total;
+}
+
+extern char *optarg;
+extern int optind;
+extern int optopt;
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, ":t:r:f:")) != -1) {
+		switch (opt) {
+		case 't':
+			min_time = atof(optarg);
+			break;
+		case 'r':
+			runs = atoi(optarg);
+			break;
+		case 'f':
+			filter = optarg;
+			break;
+		case ':':
+			errx(1, "-%c requires an argument.", optopt);
+		case '?':
+			errx(1, "unknown option -%c", optopt);
+		}
+	}
+	if (runs < 1)
+		errx(1, "Invalid number of runs");
+
+	event_init();
+
+	bench_line ma_line, lge_line;
+	backend_device &ma = bench_backend("marantz", ma_line);
+	backend_device &lge = bench_backend("lge", lge_line);
+
+	backend_reopen_devices();
+
+	/* Enable all auto status layers, which also answers the @AST sent on open. */
+	flush_output(ma, ma_line);
+	ma.update_status("@AST:F", ma.output.inptr());
+	discard_output(ma, ma_line);
+
+	/* No limit on outstanding requests, so that a whole batch can be written. */
+	lge.window = 0;
+	flush_output(lge, lge_line);
+
+	std::vector<bench_command> ma_cmds = {
+		{ "PWR2", {} },
+		{ "VOL0", { -30 } },
+		{ "AMT2", {} },
+		{ "SRC2", {} },
+		{ "VOL1", {} },
+		{ "SLP0", { 30 } },
+	};
+	std::vector<bench_command> lge_cmds = {
+		{ "PWR2", {} },
+		{ "VOL0", { 20 } },
+		{ "AMT2", {} },
+		{ "ARTW", {} },
+		{ "BRT0", { 50 } },
+	};
+
+	run_bench("base64_int24", bench_base64_int24);
+	run_bench("debase64_int24", bench_debase64_int24);
+	run_bench("complete", bench_complete);
+	run_bench("complete_trie", bench_complete_trie);
+	run_bench("marantz_update_status", std::bind(bench_marantz_update_status, std::ref(ma), std::placeholders::_1));
+	run_bench("lge_update_status", std::bind(bench_lge_update_status, std::ref(lge), std::ref(lge_line), std::placeholders::_1));
+	run_bench("marantz_send_command", std::bind(bench_send_command, std::ref(ma), std::ref(ma_line), std::cref(ma_cmds), std::placeholders::_1));
+	run_bench("lge_send_command", std::bind(bench_send_command, std::ref(lge), std::ref(lge_line), std::cref(lge_cmds), std::placeholders::_1));
+
+	backend_close_all();
+	return 0;
+}
@@ -0,0 +1,445 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Notification fan-out benchmark. Plays movasim's Marantz receiver on a
+ * pseudo terminal, runs movactld against it and connects clients over Unix
+ * and TCP sockets, each subscribing to the same codes with STRT. The receiver then
+ * changes those codes at a fixed rate, and the time from writing an update
+ * to each client reading the notification is measured.
+ *
+ * Results are printed as a single line of key=value pairs.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <list>
+#include <string>
+#include <vector>
+
+#include "base64.h"
+#include "simulator.hh"
+#include "smart_event.hh"
+#include "pty.hh"
+
+extern char **environ;
+
+/* Integer valued codes, as sent by the receiver and as subscribed to. */
+static const struct {
+	const char *code;
+	const char *notify;
+} bench_codes[] = {
+	{ "VOL", "VOL " },
+	{ "TOB", "TOB " },
+	{ "TOT", "TOT " },
+	{ "SLP", "SLP " },
+	{ "LIP", "LIP " },
+	{ "TPR", "TPR " },
+	{ "MVL", "MVL " },
+	{ "MSL", "MSL " },
+	{ "MSV", "MSV " },
+	{ "MTP", "MTP " },
+};
+static const int max_codes = sizeof(bench_codes) / sizeof(*bench_codes);
+
+/* Update values cycle through this range, indexing the send times. */
+#define VALUE_RANGE 100000
+
+static struct timeval sent_at[VALUE_RANGE];
+static bool measuring;
+static std::vector<long> latencies;
+static long delivered;
+static long stale;
+
+static long
+usec_since(const struct timeval &then)
+{
+	struct timeval now, diff;
+
+	gettimeofday(&now, NULL);
+	timersub(&now, &then, &diff);
+	return diff.tv_sec * 1000000 + diff.tv_usec;
+}
+
+class bench_client
+{
+public:
+	smart_event<> ev;
+	std::string input;
+
+	bench_client(int fd, int ncodes);
+
+private:
+	void readcb(int fd, short what);
+};
+
+bench_client::bench_client(int fd, int ncodes)
+{
+	std::string strt;
+
+	for (int i = 0 ; i < ncodes ; i++)
+		strt += std::string("STRT") + bench_codes[i].notify + "\n";
+	if (write(fd, strt.data(), strt.length()) != static_cast<ssize_t>(strt.length()))
+		err(1, "write");
+
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	ev.set_fd(fd);
+	ev.set(EV_READ | EV_PERSIST, std::bind(&bench_client::readcb, this, std::placeholders::_1, std::placeholders::_2));
+	ev.add();
+}
+
+void
+bench_client::readcb(int fd, short what)
+{
+	char buf[4096];
+	ssize_t len = read(fd, buf, sizeof(buf));
+
+	if (len < 0 && errno == EAGAIN)
+		return;
+	if (len <= 0)
+		errx(1, "Daemon closed a client connection");
+	input.append(buf, len);
+
+	size_t pos, start = 0;
+	while ((pos = input.find('\n', start)) != std::string::npos) {
+		/* STAT<code><int24> */
+		if (pos - start == 12 && input.compare(start, 4, "STAT") == 0) {
+			int val = debase64_int24(input.data() + start + 8);
+
+			/* Zero is the answer to the initial status queries. */
+			if (val == 0) {
+				start = pos + 1;
+				continue;
+			}
+			delivered++;
+			if (val >= 0 && val < VALUE_RANGE && timerisset(&sent_at[val])) {
+				if (measuring)
+					latencies.push_back(usec_since(sent_at[val]));
+			} else {
+				stale++;
+			}
+		}
+		start = pos + 1;
+	}
+	input.erase(0, start);
+}
+
+/*
+ * The receiver side, the simulated Marantz receiver of movasim without any
+ * line delay. The benchmarked codes are changed on it at a fixed rate.
+ */
+class bench_device
+{
+public:
+	int ncodes;
+	long updates;
+	long measured_updates;
+
+	bench_device(int master, int ncodes, double rate);
+
+	void start_updates();
+	void stop_updates();
+
+private:
+	marantz_sim sim;
+	smart_event<> update_ev;
+	double rate;
+	struct timeval tick;
+	struct timeval started;
+
+	void updatecb(int fd, short what);
+};
+
+bench_device::bench_device(int master, int ncodes, double rate)
+	: ncodes(ncodes), updates(0), measured_updates(0), rate(rate)
+{
+	sim.baud = 0;
+	/* Zero is what queries are answered with until the updates start. */
+	for (int i = 0 ; i < ncodes ; i++)
+		sim.set_value(bench_codes[i].code, "0");
+	sim.start(master);
+
+	/*
+	 * Timers can't keep up with high rates, so each tick sends as many
+	 * updates as are due by then.
+	 */
+	long usec = std::max(static_cast<long>(1000000 / rate), 1000L);
+	tick.tv_sec = usec / 1000000;
+	tick.tv_usec = usec % 1000000;
+
+	update_ev.set_fd(-1);
+	update_ev.set(EV_TIMEOUT | EV_PERSIST, std::bind(&bench_device::updatecb, this, std::placeholders::_1, std::placeholders::_2));
+}
+
+void
+bench_device::start_updates()
+{
+	gettimeofday(&started, NULL);
+	update_ev.add(tick);
+}
+
+void
+bench_device::stop_updates()
+{
+	update_ev.del();
+}
+
+void
+bench_device::updatecb(int fd, short what)
+{
+	long due = static_cast<long>(usec_since(started) * rate / 1000000);
+
+	while (updates < due) {
+		/* Zero is what queries are answered with, never use it. */
+		int val = 1 + updates % (VALUE_RANGE - 1);
+		const char *code = bench_codes[updates % ncodes].code;
+
+		sim.set_value(code, std::to_string(val));
+		gettimeofday(&sent_at[val], NULL);
+		sim.send_status(code);
+		updates++;
+		if (measuring)
+			measured_updates++;
+	}
+}
+
+static int
+connect_local(const char *path)
+{
+	struct sockaddr_un unaddr = {0};
+	int fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+
+	if (fd < 0)
+		err(1, "socket");
+
+	unaddr.sun_family = AF_LOCAL;
+	strncpy(unaddr.sun_path, path, sizeof(unaddr.sun_path) - 1);
+
+	if (connect(fd, (struct sockaddr*)&unaddr, sizeof(unaddr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static int
+connect_tcp(const char *port)
+{
+	const struct addrinfo hints = { 0, PF_UNSPEC, SOCK_STREAM };
+	struct addrinfo *res;
+	int fd = -1;
+	int r;
+
+	if ((r = getaddrinfo("localhost", port, &hints, &res)))
+		errx(1, "getaddrinfo(localhost, %s): %s", port, gai_strerror(r));
+
+	for (struct addrinfo *curr = res ; curr && fd < 0 ; curr = curr->ai_next) {
+		fd = socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol);
+		if (fd < 0)
+			continue;
+		if (connect(fd, curr->ai_addr, curr->ai_addrlen)) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	freeaddrinfo(res);
+	return fd;
+}
+
+/* Retry while the daemon is starting up. */
+static int
+connect_retry(int (*connector)(const char *), const char *arg)
+{
+	for (int i = 0 ; i < 100 ; i++) {
+		int fd = connector(arg);
+
+		if (fd >= 0)
+			return fd;
+		usleep(20000);
+	}
+	err(1, "connect(%s)", arg);
+}
+
+static long
+percentile(const std::vector<long> &sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min(sorted.size() - 1, static_cast<size_t>(p * sorted.size()))];
+}
+
+static void
+run_for(double seconds)
+{
+	struct timeval tv;
+
+	tv.tv_sec = static_cast<long>(seconds);
+	tv.tv_usec = static_cast<long>((seconds - tv.tv_sec) * 1000000);
+	event_loopexit(&tv);
+	event_dispatch();
+}
+
+extern char *optarg;
+extern int optind;
+extern int optopt;
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	const char *daemon_path = "./movactld";
+	int nlocal = 10, ntcp = 0, ncodes = 4;
+	const char *port = "41400";
+	double rate = 100, duration = 10, warmup = 1;
+
+	while ((opt = getopt(argc, argv, ":d:n:t:p:m:r:T:w:")) != -1) {
+		switch (opt) {
+		case 'd':
+			daemon_path = optarg;
+			break;
+		case 'n':
+			nlocal = atoi(optarg);
+			break;
+		case 't':
+			ntcp = atoi(optarg);
+			break;
+		case 'p':
+			port = optarg;
+			break;
+		case 'm':
+			ncodes = atoi(optarg);
+			break;
+		case 'r':
+			rate = atof(optarg);
+			break;
+		case 'T':
+			duration = atof(optarg);
+			break;
+		case 'w':
+			warmup = atof(optarg);
+			break;
+		case ':':
+			errx(1, "-%c requires an argument.", optopt);
+		case '?':
+			errx(1, "unknown option -%c", optopt);
+		}
+	}
+
+	if (ncodes < 1 || ncodes > max_codes)
+		errx(1, "Number of codes must be 1 to %d", max_codes);
+	if (rate <= 0)
+		errx(1, "Invalid rate");
+
+	std::string slave_path;
+	int slave;
+	int master = open_sim_pty(slave_path, slave);
+
+	char sock_path[] = "/tmp/bench_fanout.XXXXXX";
+	if (!mkdtemp(sock_path))
+		err(1, "mkdtemp");
+	std::string local_path = std::string(sock_path) + "/sock";
+
+	std::string clients = local_path;
+	if (ntcp)
+		clients += std::string(",") + port;
+	std::string spec = "bench:marantz:" + slave_path + ":" + clients;
+
+	const char *args[] = { daemon_path, spec.c_str(), NULL };
+	pid_t pid;
+	int r = posix_spawn(&pid, daemon_path, NULL, NULL, (char**)args, environ);
+	if (r) {
+		errno = r;
+		err(1, "posix_spawn(%s)", daemon_path);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	event_init();
+
+	bench_device device(master, ncodes, rate);
+	std::list<bench_client> conns;
+
+	for (int i = 0 ; i < nlocal ; i++)
+		conns.emplace_back(connect_retry(connect_local, local_path.c_str()), ncodes);
+	for (int i = 0 ; i < ntcp ; i++)
+		conns.emplace_back(connect_retry(connect_tcp, port), ncodes);
+
+	/* Let the subscriptions and their initial queries settle. */
+	run_for(0.5);
+
+	device.start_updates();
+	run_for(warmup);
+
+	long delivered_before = delivered;
+	measuring = true;
+	run_for(duration);
+	measuring = false;
+	long measured_delivered = delivered - delivered_before;
+
+	device.stop_updates();
+	run_for(0.5);
+
+	conns.clear();
+	kill(pid, SIGTERM);
+
+	int status;
+	struct rusage ru;
+	if (wait4(pid, &status, 0, &ru) < 0)
+		err(1, "wait4");
+
+	std::sort(latencies.begin(), latencies.end());
+
+	long cpu_usec = ru.ru_utime.tv_sec * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_sec * 1000000 + ru.ru_stime.tv_usec;
+	long expected = device.measured_updates * (nlocal + ntcp);
+
+	printf("clients=%d tcp_clients=%d codes=%d rate=%g duration=%g updates=%ld"
+			" expected=%ld delivered=%ld stale=%ld"
+			" p50_us=%ld p99_us=%ld p999_us=%ld max_us=%ld"
+			" daemon_cpu_us=%ld cpu_per_notification_ns=%ld daemon_maxrss=%ld\n",
+			nlocal + ntcp, ntcp, ncodes, rate, duration, device.measured_updates,
+			expected, measured_delivered, stale,
+			percentile(latencies, 0.5), percentile(latencies, 0.99), percentile(latencies, 0.999),
+			latencies.empty() ? 0 : latencies.back(),
+			cpu_usec, delivered ? cpu_usec * 1000 / delivered : 0, ru.ru_maxrss);
+
+	unlink(local_path.c_str());
+	rmdir(sock_path);
+	close(slave);
+	return 0;
+}
@@ -33,6 +33,9 @@
 #include <sys/wait.h>
 #include <unistd.h>
 
+/* The mask from before bos blocked everything, given back to each child. */
+static sigset_t child_sigmask;
+
 static pid_t
 spawn()
 {
@@ -40,6 +43,8 @@ spawn()
 
 	if (child == -1)
 		throw std::system_error(errno, std::system_category(), "fork");
+	if (child == 0)
+		sigprocmask(SIG_SETMASK, &child_sigmask, NULL);
 	return child;
 }
 
@@ -119,6 +124,12 @@ bos()
 {
 	int exit_code = 0;
 	bool exiting = false;
+	sigset_t sigset;
+
+	/* sigwait in the parent needs them blocked to forward SIGHUP and the like. */
+	sigfillset(&sigset);
+	sigprocmask(SIG_BLOCK, &sigset, &child_sigmask);
+
 	do {
 		pid_t child = spawn();
 		if (child == 0)
@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+/*
+ * Capture files written by the flight recorder. A file header is followed by
+ * nstreams stream headers and then the records of all streams ordered by
+ * time, each record header followed by len bytes of data. Everything is in
+ * host byte order. Record times are from the monotonic clock; the file header
+ * has both clocks at the time of the dump to convert them.
+ */
+
+#define CAPTURE_MAGIC "MVCP"
+#define CAPTURE_VERSION 1
+
+struct capture_file_header
+{
+	char magic[4];
+	uint16_t version;
+	uint16_t nstreams;
+	uint32_t reserved;
+	uint64_t mono_usec;
+	uint64_t real_usec;
+};
+
+enum capture_stream_kind
+{
+	CAPTURE_BACKEND,
+	CAPTURE_CONN,
+};
+
+struct capture_stream
+{
+	uint16_t id;
+	uint8_t kind;
+	uint8_t reserved;
+	char type[12];
+	char name[48];
+};
+
+enum capture_dir
+{
+	/* Read by the daemon. */
+	CAPTURE_IN,
+	/* Written by the daemon. */
+	CAPTURE_OUT,
+	/* The line or connection was (re)opened, no data. */
+	CAPTURE_OPEN,
+	/* The connection was closed by the client, no data. */
+	CAPTURE_CLOSE,
+};
+
+struct capture_record
+{
+	uint64_t usec;
+	uint16_t stream;
+	uint16_t len;
+	uint8_t dir;
+	uint8_t reserved[3];
+};
+
+#endif /*CAPTURE_H*/
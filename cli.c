@@ -29,20 +29,18 @@
 #include <err.h>
 #include <stdlib.h>
 #include <string.h>
-#include <fcntl.h>
 #include <unistd.h>
-#include <sys/uio.h>
-#include <sys/un.h>
-#include <sys/socket.h>
 #include <event.h>
+#include <getopt.h>
 #include <glob.h>
 #include <limits.h>
 #include <syslog.h>
 #include <errno.h>
+#include <signal.h>
 
 #include "line.h"
-#include "base64.h"
 #include "complete.h"
+#include "libmovactl.h"
 
 #define COMMAND(x, y, z) {#x, y, z},
 struct command
@@ -55,164 +53,134 @@ struct command
 	{NULL}
 };
 
-int
-open_local (const char *path) {
-	struct sockaddr_un unaddr = {0};
-	int fd = socket (PF_LOCAL, SOCK_STREAM, 0);
+#include "command_trie.h"
 
-	if (fd < 0)
-		return -1;
+/* Trace ID to tag sent commands with, see the -t option of movactld. */
+static const char *trace_id;
 
-	unaddr.sun_family = AF_LOCAL;
-	strncpy (unaddr.sun_path, path, sizeof (unaddr.sun_path) - 1);
-	unaddr.sun_path[sizeof (unaddr.sun_path) - 1] = '\0';
+static int
+send_int_command (fd_set *line_set, int maxfd, struct command *cmd, char **args, int nargs) {
+	struct evbuffer *req = evbuffer_new();
+	int iargs[nargs];
+	int i, res;
 
-	if (connect (fd, (struct sockaddr*)&unaddr, sizeof (unaddr))) {
-		close (fd);
+	if (!req)
 		return -1;
-	}
 
-	return fd;
-}
+	if (trace_id)
+		movactl_encode(req, "TRCE", trace_id, strlen(trace_id));
+	for (i = 0 ; i < nargs ; i++)
+		iargs[i] = atoi(args[i]);
+	movactl_encode_send(req, cmd->code, iargs, nargs);
 
-int
-open_remote (const char *host, const char *port) {
-	const struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
-	struct addrinfo *res, *curr;
-	int r;
-	int fd = -1;
-
-	if ((r = getaddrinfo(host, port, &hints, &res)))
-		errx(1, "getaddrinfo(%s, %s): %s", host, port, gai_strerror(r));
-
-	for (curr = res ; curr ; curr = curr->ai_next) {
-		fd = socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol);
+	res = cli_fanout(line_set, maxfd, NULL, req, NULL, NULL);
+	evbuffer_free(req);
+	return res;
+}
 
-		if (fd < 0)
-			continue;
+static int
+set_server_enabled (fd_set *line_set, int maxfd, int enable, const char *server) {
+	struct evbuffer *req = evbuffer_new();
+	int res;
 
-		if (connect(fd, curr->ai_addr, curr->ai_addrlen)) {
-			close(fd);
-			fd = -1;
-			continue;
-		}
+	if (!req)
+		return -1;
 
-		break;
-	}
-	freeaddrinfo(res);
+	movactl_encode(req, enable ? "SENA" : "SDIS", server, strlen(server));
+	res = cli_fanout(line_set, maxfd, NULL, req, NULL, NULL);
+	evbuffer_free(req);
+	return res;
+}
 
-	return fd;
+static int
+metrics_reply (int fd, const char *reply, void *cbarg) {
+	char **replies = cbarg;
+
+	if (strncmp(reply, "QMET", 4) != 0)
+		errx(1, "Unexpected reply, not QMET: %s", reply);
+	replies[fd] = strdup(reply + 4);
+	if (!replies[fd])
+		err(1, "strdup");
+	return 1;
 }
 
-int
-open_local_or_remote (const char *path) {
-	char linkdst[PATH_MAX + 1];
-	char *cp;
+static int
+print_metrics (fd_set *line_set, int maxfd) {
+	struct evbuffer *req = evbuffer_new();
+	char *replies[maxfd + 1];
+	int fd, res;
 
-	int r = readlink(path, linkdst, PATH_MAX);
-	if (r == -1) {
-		if (errno == EINVAL)
-			return open_local(path);
+	if (!req)
 		return -1;
-	}
-
-	linkdst[r] = '\0';
 
-	if (linkdst[0] == '.' || strchr(linkdst, '/'))
-		return open_local(path);
+	memset(replies, 0, sizeof(replies));
+	movactl_encode(req, "QMET", "", 0);
+	res = cli_fanout(line_set, maxfd, NULL, req, metrics_reply, replies);
+	evbuffer_free(req);
 
-	cp = strchr(linkdst, ':');
-	if (!cp)
-		return open_local(path);
-
-	*cp++ = '\0';
-	return open_remote(linkdst, cp);
+	/* Print in line order, not in the order the replies arrived. */
+	for (fd = 0 ; fd <= maxfd ; fd++) {
+		if (replies[fd])
+			printf("%s\n", replies[fd]);
+		free(replies[fd]);
+	}
+	return res;
 }
 
 static int
-send_int_command (fd_set *line_set, int maxfd, struct command *cmd, char **args, int nargs) {
-	char pargs[nargs][4];
-	struct iovec vecs[nargs + 3];
-	int i;
-	int fd;
-
-	vecs[0].iov_base = (void*)"SEND";
-	vecs[0].iov_len = 4;
-	vecs[1].iov_base = (void*)cmd->code;
-	vecs[1].iov_len = 4;
-	for (i = 0 ; i < nargs ; i++) {
-		int ia = atoi(args[i]);
-
-		base64_int24(pargs[i], ia);
-
-		vecs[i + 2].iov_base = pargs[i];
-		vecs[i + 2].iov_len = 4;
-	}
-	vecs[i + 2].iov_base = (void*)"\n";
-	vecs[i + 2].iov_len = 1;
-
-	for (fd = 0 ; fd <= maxfd ; fd++) {
-		if (FD_ISSET(fd, line_set))
-			writev(fd, vecs, i + 2);
-	}
+sync_reply (int fd, const char *reply, void *cbarg) {
+	if (strncmp(reply, "SYNC", 4) == 0)
+		return 1;
+	if (strncmp(reply, "ECMD", 4) == 0)
+		errx(1, "%s: Daemon does not support SYNC", cli_line_name(fd));
+	if (strncmp(reply, "EDIS", 4) == 0)
+		warnx("%s: Line disabled, command ignored", cli_line_name(fd));
 	return 0;
 }
 
+/* Wait for the lines to answer or give up on everything sent so far. */
 static int
-set_server_enabled (fd_set *line_set, int maxfd, int enable, const char *server) {
-	struct iovec vecs[3];
-	int fd;
+wait_sync (fd_set *line_set, int maxfd) {
+	struct evbuffer *req = evbuffer_new();
+	int res;
 
-	vecs[0].iov_base = (void*)(enable ? "SENA" : "SDIS");
-	vecs[0].iov_len = 4;
-	vecs[1].iov_base = (void*)server;
-	vecs[1].iov_len = strlen(server);
-	vecs[2].iov_base = (void*)"\n";
-	vecs[2].iov_len = 1;
+	if (!req)
+		return -1;
 
-	for (fd = 0 ; fd <= maxfd ; fd++) {
-		if (FD_ISSET(fd, line_set))
-			writev(fd, vecs, 3);
-	}
-	return 0;
+	movactl_encode(req, "SYNC", "", 0);
+	res = cli_fanout(line_set, maxfd, NULL, req, sync_reply, NULL);
+	evbuffer_free(req);
+	return res;
 }
 
 static void
 filter_candidates (fd_set *line_set, int maxfd, struct complete_candidate **cands) {
+	static char all[sizeof(commands) / sizeof(*commands) * 4];
+	static size_t alllen;
 	struct complete_candidate *cand, **pcand;
-	struct evbuffer *buf = evbuffer_new();
-	char *lines[maxfd + 1], *l[maxfd + 1];
+	const char *caps[maxfd + 1];
+	struct command *cmd;
 	int i, nlines = 0;
 
-	evbuffer_add(buf, "QCMD", 4);
-	for (cand = *cands ; cand ; cand = cand->next) {
-		if (cand->aux)
-			evbuffer_add(buf, ((struct command*)cand->aux)->code, 4);
-	}
-	if (EVBUFFER_LENGTH(buf) <= 4) {
-		evbuffer_free(buf);
+	for (cand = *cands ; cand && !cand->aux ; cand = cand->next)
+		;
+	if (!cand)
 		return;
-	}
-	evbuffer_add(buf, "\n", 1);
 
-	for (i = 0 ; i <= maxfd ; i++) {
-		if (FD_ISSET(i, line_set))
-			write (i, EVBUFFER_DATA(buf), EVBUFFER_LENGTH(buf));
+	/* Ask for everything, so the answer can be cached. */
+	if (!alllen) {
+		for (cmd = commands ; cmd->name ; cmd++) {
+			memcpy(all + alllen, cmd->code, 4);
+			alllen += 4;
+		}
 	}
 
+	cli_fetch_capabilities(line_set, maxfd, "QCMD", all, alllen);
 	for (i = 0 ; i <= maxfd ; i++) {
-		if (FD_ISSET(i, line_set)) {
-			evbuffer_drain(buf, EVBUFFER_LENGTH(buf));
-			while (!(lines[nlines] = evbuffer_readline(buf)))
-				evbuffer_read(buf, i, 1024);
-			if (strncmp(lines[nlines], "QCMD", 4) != 0 && strncmp(lines[nlines], "EDIS", 4) != 0)
-				errx(1, "Unexpected reply, not QCMD: %s", lines[nlines]);
-			l[nlines] = lines[nlines] + 4;
-			nlines++;
-		}
+		if (FD_ISSET(i, line_set))
+			caps[nlines++] = cli_capabilities(i, "QCMD", all, alllen);
 	}
 
-	/* Reply should be in same order as query. */
 	pcand = cands;
 	while ((cand = *pcand)) {
 		int match = 0;
@@ -220,30 +188,158 @@ filter_candidates (fd_set *line_set, int maxfd, struct complete_candidate **cand
 		if (!cand->aux) {
 			match = 1; /* cli command */
 		} else {
-			for (i = 0 ; i < nlines ; i++) {
-				if (strncmp(((struct command*)cand->aux)->code, l[i], 4) == 0) {
-					match = 1;
-					l[i] += 4;
-				}
-			}
+			for (i = 0 ; i < nlines && !match ; i++)
+				match = movactl_has_capability(caps[i], ((struct command*)cand->aux)->code);
 		}
 		if (match) {
 			pcand = &cand->next;
 		} else {
 			*pcand = cand->next;
-			free(cand);
 		}
 	}
 }
 
+#define BATCH_MAX_WORDS 16
+
+struct batch_entry
+{
+	enum { BATCH_SEND, BATCH_ENABLE, BATCH_DISABLE, BATCH_WAIT } type;
+	struct command *cmd;
+	char *line;
+	char *args[BATCH_MAX_WORDS];
+	int nargs;
+};
+
+/*
+ * Resolve a script line. The capabilities of the lines are only queried
+ * once, for the first line. Returns 0 for blank lines and comments.
+ */
+static int
+batch_resolve (fd_set *line_set, int maxfd, char *line, struct batch_entry *entry,
+		const char *path, int lineno) {
+	struct complete_candidate candbuf[command_trie.nnames];
+	struct complete_candidate *cands;
+	char *words[BATCH_MAX_WORDS];
+	char *cp, *word;
+	int nwords = 0;
+	int argi;
+
+	if ((cp = strchr(line, '#')))
+		*cp = '\0';
+	for (word = strtok(line, " \t\r\n") ; word ; word = strtok(NULL, " \t\r\n")) {
+		if (nwords == BATCH_MAX_WORDS)
+			errx (1, "%s:%d: Too many words", path, lineno);
+		words[nwords++] = word;
+	}
+	if (nwords == 0)
+		return 0;
+
+	if (nwords == 1 && strcmp(words[0], "wait") == 0) {
+		entry->type = BATCH_WAIT;
+		return 1;
+	}
+
+	argi = complete_trie(&command_trie, nwords, (const char**)words, candbuf, &cands);
+	if (cands)
+		filter_candidates(line_set, maxfd, &cands);
+	if (!cands)
+		errx (1, "%s:%d: No matching command", path, lineno);
+	if (cands->next)
+		errx (1, "%s:%d: Ambiguous command: %s or %s...", path, lineno, cands->name, cands->next->name);
+
+	entry->cmd = cands->aux;
+	if (strcmp(cands->name, "disable") == 0 || strcmp(cands->name, "enable") == 0) {
+		if (nwords != argi + 1)
+			errx (1, "%s:%d: %s: Needs an argument", path, lineno, cands->name);
+		entry->type = strcmp(cands->name, "enable") == 0 ? BATCH_ENABLE : BATCH_DISABLE;
+	} else if (!entry->cmd) {
+		errx (1, "%s:%d: %s: Not available in batch mode", path, lineno, cands->name);
+	} else {
+		if (nwords - argi != entry->cmd->nargs)
+			errx (1, "%s:%d: %s: Needs %d arguments", path, lineno, cands->name, entry->cmd->nargs);
+		entry->type = BATCH_SEND;
+	}
+
+	entry->nargs = nwords - argi;
+	memcpy(entry->args, words + argi, entry->nargs * sizeof(*words));
+	return 1;
+}
+
+/*
+ * Run the commands of a script over the already open lines. All lines are
+ * resolved before anything is sent, so a typo doesn't leave the script half
+ * done. Commands are sent without waiting for the devices, except where the
+ * script says wait, and at the end if dowait is set.
+ */
+static int
+run_batch (fd_set *line_set, int maxfd, FILE *in,
+		const char *path, int dowait) {
+	struct batch_entry *entries = NULL;
+	int nentries = 0, aentries = 0;
+	char *line = NULL;
+	size_t linecap = 0;
+	int lineno = 0;
+	int i, res = 0;
+
+	while (getline(&line, &linecap, in) != -1) {
+		lineno++;
+		if (nentries == aentries) {
+			aentries = aentries ? aentries * 2 : 16;
+			entries = realloc(entries, aentries * sizeof(*entries));
+			if (!entries)
+				err (1, "realloc");
+		}
+		entries[nentries].line = strdup(line);
+		if (!entries[nentries].line)
+			err (1, "strdup");
+		if (batch_resolve(line_set, maxfd, entries[nentries].line, &entries[nentries], path, lineno))
+			nentries++;
+		else
+			free(entries[nentries].line);
+	}
+	if (ferror(in))
+		err (1, "%s", path);
+	free(line);
+
+	for (i = 0 ; i < nentries && res >= 0 ; i++) {
+		switch (entries[i].type) {
+		case BATCH_SEND:
+			res = send_int_command(line_set, maxfd, entries[i].cmd, entries[i].args, entries[i].nargs);
+			break;
+		case BATCH_ENABLE:
+		case BATCH_DISABLE:
+			res = set_server_enabled(line_set, maxfd, entries[i].type == BATCH_ENABLE, entries[i].args[0]);
+			break;
+		case BATCH_WAIT:
+			res = wait_sync(line_set, maxfd);
+			break;
+		}
+	}
+	if (res >= 0 && dowait)
+		res = wait_sync(line_set, maxfd);
+
+	for (i = 0 ; i < nentries ; i++)
+		free(entries[i].line);
+	free(entries);
+	return res;
+}
+
 extern char *optarg;
 extern int optind;
 extern int optopt;
 
+static const struct option longopts[] = {
+	{ "format", required_argument, NULL, 'f' },
+	{ "flush", required_argument, NULL, 'F' },
+	{ "timestamps", no_argument, NULL, 'S' },
+	{ NULL, 0, NULL, 0 }
+};
+
 int
 main (int argc, char *argv[]) {
 	struct command *cmd;
-	struct complete_candidate *cand, *candidates = NULL;
+	struct complete_candidate candbuf[command_trie.nnames];
+	struct complete_candidate *cand, *candidates;
 	int argi = 1;
 	int res;
 	int fd = -1;
@@ -255,16 +351,51 @@ main (int argc, char *argv[]) {
 	char pattern[PATH_MAX];
 	int logmask = ~LOG_DEBUG;
 	int logopt = 0;
+	int batch = 0, dowait = 0;
+	double timeout;
+	const char *format = NULL, *flush = NULL;
+	int stamps = 0;
+	char *cp;
 
 	FD_ZERO(&line_set);
+	event_init();
+	/* A line going away is handled per line, see cli_fanout. */
+	signal(SIGPIPE, SIG_IGN);
 
-	while ((opt = getopt(argc, argv, ":Ds:")) != -1) {
+	while ((opt = getopt_long(argc, argv, ":bDf:F:s:St:T:w", longopts, NULL)) != -1) {
 		switch (opt) {
 		case 's':
-			fd = open_local (optarg);
+			fd = movactl_open_local (optarg);
 			if (fd < 0)
-				err (1, "open_local");
+				err (1, "%s", optarg);
 			FD_SET(fd, &line_set);
+			cli_cache_line(fd, optarg);
+			break;
+		case 't':
+			if (strlen(optarg) > 10 || optarg[strspn(optarg, "0123456789")] != '\0')
+				errx (1, "-t: Trace ID must be a number");
+			trace_id = optarg;
+			break;
+		case 'T':
+			timeout = strtod(optarg, &cp);
+			if (*cp != '\0' || timeout <= 0)
+				errx (1, "-T: Timeout must be a positive number of seconds");
+			cli_set_timeout(timeout);
+			break;
+		case 'f':
+			format = optarg;
+			break;
+		case 'F':
+			flush = optarg;
+			break;
+		case 'S':
+			stamps = 1;
+			break;
+		case 'b':
+			batch = 1;
+			break;
+		case 'w':
+			dowait = 1;
 			break;
 		case 'D':
 			logmask |= LOG_DEBUG;
@@ -279,28 +410,30 @@ main (int argc, char *argv[]) {
 	argc -= optind - 1;
 	argv += optind - 1;
 
+	cli_set_output(format, flush, stamps);
+
 	openlog(GETPROGNAME, logopt, LOG_USER | LOG_DEBUG);
 	setlogmask(logmask);
 
 	for (i = 1 ; i < argc ; i++) {
 		if (argv[i][0] == ':') {
-			char *cp;
-
 			if ((cp = strchr(argv[i] + 1, ':'))) {
 				*cp = '\0';
-				fd = open_remote(argv[i] + 1, cp + 1);
+				fd = movactl_open_remote(argv[i] + 1, cp + 1);
 				if (fd < 0)
-					err(1, "open_remote");
+					err(1, "%s:%s", argv[i] + 1, cp + 1);
 				FD_SET(fd, &line_set);
 				*cp = ':';
+				cli_cache_line(fd, argv[i] + 1);
 			} else {
 				snprintf(pattern, sizeof(pattern), "/var/run/movactl.%s*.sock", argv[i] + 1);
 				glob(pattern, GLOB_NOSORT, NULL, &g);
 				for (gidx = 0 ; gidx < g.gl_pathc ; gidx++) {
-					fd = open_local_or_remote(g.gl_pathv[gidx]);
+					fd = movactl_open(g.gl_pathv[gidx]);
 					if (fd < 0)
-						err(1, "open_local_or_remote");
+						err(1, "%s", g.gl_pathv[gidx]);
 					FD_SET(fd, &line_set);
+					cli_cache_line(fd, g.gl_pathv[gidx]);
 				}
 				globfree(&g);
 				if (gidx == 0)
@@ -316,40 +449,36 @@ main (int argc, char *argv[]) {
 		snprintf(pattern, sizeof(pattern), "/var/run/movactl.*.sock");
 		glob(pattern, GLOB_NOSORT, NULL, &g);
 		for (gidx = 0 ; gidx < g.gl_pathc ; gidx++) {
-			fd = open_local_or_remote(g.gl_pathv[gidx]);
+			fd = movactl_open(g.gl_pathv[gidx]);
 			if (fd < 0)
-				err(1, "open_local_or_remote");
+				err(1, "%s", g.gl_pathv[gidx]);
 			FD_SET(fd, &line_set);
+			cli_cache_line(fd, g.gl_pathv[gidx]);
 		}
 		globfree(&g);
 		if (gidx == 0)
 			errx(1, "No lines found");
 	}
 
-	const char **builtin;
-	for (builtin = (const char *[]){"status", "listen", "disable", "enable", NULL} ; *builtin ; builtin++) {
-		cand = malloc (sizeof (*cand));
-		if (!cand)
-			err (1, "malloc");
-		cand->name = *builtin;
-		cand->name_off = 0;
-		cand->next = candidates;
-		cand->aux = NULL;
-		candidates = cand;
-	}
-	for (cmd = commands; cmd->name; cmd++) {
-		cand = malloc (sizeof (*cand));
-		if (!cand)
-			err (1, "malloc");
-
-		cand->name = cmd->name;
-		cand->name_off = 0;
-		cand->next = candidates;
-		cand->aux = cmd;
-		candidates = cand;
+	if (batch) {
+		FILE *in = stdin;
+		const char *path = "stdin";
+
+		if (argc > 2)
+			errx (1, "-b: Commands are read from stdin or a single file");
+		if (argc == 2) {
+			path = argv[1];
+			in = fopen(path, "r");
+			if (!in)
+				err (1, "%s", path);
+		}
+		res = run_batch(&line_set, fd, in, path, dowait);
+		if (res < 0)
+			err (1, "run_batch");
+		return cli_lines_failed() > 0;
 	}
 
-	argi = 1 + complete(&candidates, argc - 1, (const char**)argv + 1, (void(*)(struct complete_candidate*))free);
+	argi = 1 + complete_trie(&command_trie, argc - 1, (const char**)argv + 1, candbuf, &candidates);
 
 	if (candidates)
 		filter_candidates(&line_set, fd, &candidates);
@@ -364,24 +493,24 @@ main (int argc, char *argv[]) {
 			res = set_server_enabled(&line_set, fd, strcmp(candidates->name, "enable") == 0, argv[argi]);
 			if (res < 0)
 				err (1, "set_server_enabled");
-			return 0;
+			return cli_lines_failed() > 0;
+		} else if (strcmp(candidates->name, "metrics") == 0) {
+			res = print_metrics(&line_set, fd);
+			if (res < 0)
+				err (1, "print_metrics");
+			return cli_lines_failed() > 0;
 		} else if (!candidates->aux) {
-			j = -1;
-			for (i = 0 ; i <= fd ; i++) {
-				if (FD_ISSET(i, &line_set)) {
-					if (j != -1)
-						errx(1, "Can only listen/status on a single line currently");
-					j = i;
-				}
-			}
-			return cli_notify(j, argc - argi, argv + argi, strcmp(candidates->name, "status") == 0);
+			res = cli_notify(&line_set, fd, argc - argi, argv + argi, strcmp(candidates->name, "status") == 0);
+			return res || cli_lines_failed() > 0;
 		}
 
  		if (argi == argc - ((struct command*)candidates->aux)->nargs) {
 			res = send_int_command(&line_set, fd, candidates->aux, argv + argi, argc - argi);
 			if (res < 0)
 				err (1, "send_int_command");
-			return 0;
+			if (dowait && wait_sync(&line_set, fd) < 0)
+				err (1, "wait_sync");
+			return cli_lines_failed() > 0;
 		}
 		errx (1, "Command requires an argument.");
 	}
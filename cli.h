@@ -26,6 +26,45 @@
 #ifndef CLI_H
 #define CLI_H
 
-int cli_notify (int fd, int argc, char *argv[], int once);
+#include <stddef.h>
+#include <sys/select.h>
+
+/* Seconds each line has to answer a request. */
+#define CLI_DEFAULT_TIMEOUT 10
+
+struct evbuffer;
+
+int cli_notify (fd_set *line_set, int maxfd, int argc, char *argv[], int once);
+/*
+ * How listen and status print, format is text, tsv or jsonl and flush is
+ * event, batch or a number of milliseconds. NULL selects the default.
+ */
+void cli_set_output (const char *format, const char *flush, int timestamps);
+
+void cli_cache_line (int fd, const char *path);
+const char *cli_line_name (int fd);
+const char *cli_line_tag (int fd);
+void cli_fetch_capabilities (fd_set *line_set, int maxfd, const char *query, const char *all, size_t alllen);
+const char *cli_capabilities (int fd, const char *query, const char *all, size_t alllen);
+
+/*
+ * Called with each reply line from fd, return non-zero once the line has
+ * answered the request.
+ */
+typedef int (*cli_reply_cb)(int fd, const char *reply, void *cbarg);
+
+/* Zero means no deadline. */
+void cli_set_timeout (double seconds);
+/*
+ * Write req to the lines in line_set, or the ones also in subset if not
+ * NULL, and pass the replies to cb until each line is done. Without req
+ * nothing is written, the replies to something already sent are gathered.
+ * Without cb the lines are done once written. Lines that fail are removed
+ * from line_set. Returns the number of lines that failed.
+ */
+int cli_fanout (fd_set *line_set, int maxfd, const fd_set *subset, struct evbuffer *req,
+		cli_reply_cb cb, void *cbarg);
+/* Number of lines that have failed so far. */
+int cli_lines_failed (void);
 
 #endif /*CLI_H*/
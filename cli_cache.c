@@ -0,0 +1,367 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Cache of what the lines answer to QCMD and QSTS, kept in ~/.cache/movactl
+ * with one file per line. Each file is tied to the daemon's capability
+ * generation (QGEN) and, for local sockets, to the socket file itself. As
+ * long as the socket is the same one and was checked within the last hour,
+ * the cache is used without asking the daemon anything. Otherwise QGEN is
+ * asked, and only if the generation changed are the capabilities queried
+ * again. Lines are asked in parallel, see cli_fanout.
+ */
+
+#include "cli.h"
+
+#include <err.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/select.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <event.h>
+
+#include "libmovactl.h"
+
+#define CACHE_CHECK_INTERVAL 3600
+
+enum { CAPS_QCMD, CAPS_QSTS, NCAPS };
+
+struct line_cache
+{
+	char *path;
+	char *file;
+	int loaded;
+	int valid;
+	int dirty;
+	int uncacheable;
+
+	char generation[32];
+	/* The socket the capabilities were last checked on. */
+	unsigned long long dev, ino;
+	long long mtime;
+	long long checked;
+
+	char *caps[NCAPS];
+	/* Asked this run, even if the line didn't answer with capabilities. */
+	int asked[NCAPS];
+};
+
+static struct line_cache *lines[FD_SETSIZE];
+static char *cache_dir;
+
+void
+cli_cache_line (int fd, const char *path) {
+	struct line_cache *lc;
+	const char *home = getenv("HOME");
+	char buf[PATH_MAX];
+	char *cp;
+
+	if (fd < 0 || fd >= FD_SETSIZE || lines[fd])
+		return;
+
+	if (!cache_dir && home) {
+		snprintf(buf, sizeof(buf), "%s/.cache/movactl", home);
+		cache_dir = strdup(buf);
+	}
+
+	lc = calloc(1, sizeof(*lc));
+	if (!lc)
+		err(1, "calloc");
+	lc->path = strdup(path);
+	if (!lc->path)
+		err(1, "strdup");
+	if (cache_dir) {
+		snprintf(buf, sizeof(buf), "%s/%s", cache_dir, path);
+		/* Flatten the line path into a single file name. */
+		for (cp = buf + strlen(cache_dir) + 1 ; *cp ; cp++) {
+			if (*cp == '/')
+				*cp = '_';
+		}
+		lc->file = strdup(buf);
+	}
+	lines[fd] = lc;
+}
+
+static void
+load_cache (struct line_cache *lc) {
+	FILE *f;
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t len;
+	int i;
+
+	lc->loaded = 1;
+	if (!lc->file || !(f = fopen(lc->file, "r")))
+		return;
+
+	while ((len = getline(&line, &linecap, f)) > 0) {
+		if (line[len - 1] == '\n')
+			line[--len] = '\0';
+		if (strncmp(line, "generation ", 11) == 0) {
+			snprintf(lc->generation, sizeof(lc->generation), "%s", line + 11);
+		} else if (strncmp(line, "socket ", 7) == 0) {
+			if (sscanf(line + 7, "%llu %llu %lld %lld", &lc->dev, &lc->ino, &lc->mtime, &lc->checked) != 4)
+				lc->checked = 0;
+		} else if (strncmp(line, "QCMD ", 5) == 0 || strncmp(line, "QSTS ", 5) == 0) {
+			i = line[1] == 'C' ? CAPS_QCMD : CAPS_QSTS;
+			free(lc->caps[i]);
+			lc->caps[i] = strdup(line + 5);
+		}
+	}
+	free(line);
+	fclose(f);
+}
+
+static void
+save_cache (struct line_cache *lc) {
+	char tmp[PATH_MAX];
+	char *cp;
+	FILE *f;
+
+	lc->dirty = 0;
+	if (!lc->file)
+		return;
+	snprintf(tmp, sizeof(tmp), "%s.%d", lc->file, (int)getpid());
+
+	f = fopen(tmp, "w");
+	if (!f && errno == ENOENT) {
+		/* Create ~/.cache and ~/.cache/movactl. */
+		cp = strrchr(cache_dir, '/');
+		*cp = '\0';
+		mkdir(cache_dir, 0755);
+		*cp = '/';
+		mkdir(cache_dir, 0755);
+		f = fopen(tmp, "w");
+	}
+	if (!f)
+		return;
+
+	fprintf(f, "generation %s\n", lc->generation);
+	fprintf(f, "socket %llu %llu %lld %lld\n", lc->dev, lc->ino, lc->mtime, lc->checked);
+	if (lc->caps[CAPS_QCMD])
+		fprintf(f, "QCMD %s\n", lc->caps[CAPS_QCMD]);
+	if (lc->caps[CAPS_QSTS])
+		fprintf(f, "QSTS %s\n", lc->caps[CAPS_QSTS]);
+
+	if (fclose(f) || rename(tmp, lc->file))
+		unlink(tmp);
+}
+
+/* Build a request for cli_fanout. */
+static struct evbuffer *
+request (const char *query, const char *arg, size_t arglen) {
+	struct evbuffer *buf = evbuffer_new();
+
+	if (!buf)
+		err(1, "evbuffer_new");
+
+	movactl_encode(buf, query, arg, arglen);
+	return buf;
+}
+
+static void
+drop_caps (struct line_cache *lc) {
+	int i;
+
+	for (i = 0 ; i < NCAPS ; i++) {
+		free(lc->caps[i]);
+		lc->caps[i] = NULL;
+	}
+}
+
+static struct line_cache *
+line_cache (int fd) {
+	if (fd < 0 || fd >= FD_SETSIZE)
+		errx(1, "line_cache: Bad fd %d", fd);
+	if (!lines[fd]) {
+		/* Not a known path, just keep the answers for this run. */
+		cli_cache_line(fd, "");
+		free(lines[fd]->file);
+		lines[fd]->file = NULL;
+	}
+	if (!lines[fd]->loaded)
+		load_cache(lines[fd]);
+	return lines[fd];
+}
+
+/* Check if the cache can be used without asking the daemon. */
+static int
+socket_unchanged (struct line_cache *lc) {
+	struct stat st;
+	long long now = time(NULL);
+
+	if (stat(lc->path, &st) == 0 && S_ISSOCK(st.st_mode) && lc->checked
+			&& lc->dev == (unsigned long long)st.st_dev
+			&& lc->ino == (unsigned long long)st.st_ino && lc->mtime == (long long)st.st_mtime
+			&& now - lc->checked < CACHE_CHECK_INTERVAL) {
+		lc->valid = 1;
+		return 1;
+	}
+	return 0;
+}
+
+/* Check that the cache still matches the daemon, dropping it if not. */
+static int
+qgen_reply (int fd, const char *reply, void *cbarg) {
+	struct line_cache *lc = lines[fd];
+	struct stat st;
+
+	if (strncmp(reply, "QGEN", 4) != 0) {
+		/* Older daemon, or a disabled line which might answer later. */
+		lc->uncacheable = 1;
+		drop_caps(lc);
+		return 1;
+	}
+
+	if (strcmp(reply + 4, lc->generation) != 0) {
+		snprintf(lc->generation, sizeof(lc->generation), "%s", reply + 4);
+		drop_caps(lc);
+	}
+
+	if (stat(lc->path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+		lc->dev = st.st_dev;
+		lc->ino = st.st_ino;
+		lc->mtime = st.st_mtime;
+	} else {
+		lc->dev = lc->ino = lc->mtime = 0;
+	}
+	lc->checked = time(NULL);
+	lc->valid = 1;
+	lc->dirty = 1;
+	return 1;
+}
+
+struct caps_query
+{
+	const char *query;
+	int idx;
+};
+
+static int
+caps_reply (int fd, const char *reply, void *cbarg) {
+	struct caps_query *cq = cbarg;
+	struct line_cache *lc = lines[fd];
+
+	lc->asked[cq->idx] = 1;
+	if (strncmp(reply, "EDIS", 4) == 0)
+		return 1;
+	if (strncmp(reply, cq->query, 4) != 0)
+		errx(1, "Unexpected reply, not %s: %s", cq->query, reply);
+
+	lc->caps[cq->idx] = strdup(reply + 4);
+	if (!lc->caps[cq->idx])
+		err(1, "strdup");
+	if (lc->valid)
+		lc->dirty = 1;
+	return 1;
+}
+
+void
+cli_fetch_capabilities (fd_set *line_set, int maxfd, const char *query, const char *all, size_t alllen) {
+	struct caps_query cq = { query, strcmp(query, "QCMD") == 0 ? CAPS_QCMD : CAPS_QSTS };
+	struct line_cache *lc;
+	struct evbuffer *req;
+	fd_set need;
+	int fd, nneed = 0;
+
+	FD_ZERO(&need);
+	for (fd = 0 ; fd <= maxfd ; fd++) {
+		if (!FD_ISSET(fd, line_set))
+			continue;
+		lc = line_cache(fd);
+		if (!lc->valid && !lc->uncacheable && !socket_unchanged(lc)) {
+			FD_SET(fd, &need);
+			nneed++;
+		}
+	}
+	if (nneed) {
+		req = request("QGEN", "", 0);
+		cli_fanout(line_set, maxfd, &need, req, qgen_reply, NULL);
+		evbuffer_free(req);
+	}
+
+	FD_ZERO(&need);
+	nneed = 0;
+	for (fd = 0 ; fd <= maxfd ; fd++) {
+		if (FD_ISSET(fd, line_set) && !lines[fd]->caps[cq.idx] && !lines[fd]->asked[cq.idx]) {
+			FD_SET(fd, &need);
+			nneed++;
+		}
+	}
+	if (nneed) {
+		req = request(query, all, alllen);
+		cli_fanout(line_set, maxfd, &need, req, caps_reply, &cq);
+		evbuffer_free(req);
+	}
+
+	for (fd = 0 ; fd <= maxfd ; fd++) {
+		if (FD_ISSET(fd, line_set) && lines[fd]->dirty)
+			save_cache(lines[fd]);
+	}
+}
+
+const char *
+cli_capabilities (int fd, const char *query, const char *all, size_t alllen) {
+	fd_set line_set;
+
+	FD_ZERO(&line_set);
+	FD_SET(fd, &line_set);
+	cli_fetch_capabilities(&line_set, fd, query, all, alllen);
+	return lines[fd]->caps[strcmp(query, "QCMD") == 0 ? CAPS_QCMD : CAPS_QSTS];
+}
+
+const char *
+cli_line_name (int fd) {
+	if (fd >= 0 && fd < FD_SETSIZE && lines[fd] && *lines[fd]->path)
+		return lines[fd]->path;
+	return "line";
+}
+
+/*
+ * Short name of the line for output, the part of /var/run/movactl.<tag>.sock
+ * that varies, or host:port for remote lines.
+ */
+const char *
+cli_line_tag (int fd) {
+	static char tag[PATH_MAX];
+	const char *name = cli_line_name(fd);
+	const char *cp;
+	size_t len;
+
+	if ((cp = strrchr(name, '/')))
+		name = cp + 1;
+	if (strncmp(name, "movactl.", 8) == 0)
+		name += 8;
+	len = strlen(name);
+	if (len > 5 && strcmp(name + len - 5, ".sock") == 0)
+		len -= 5;
+	snprintf(tag, sizeof(tag), "%.*s", (int)len, name);
+	return tag;
+}
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Sends a request to several lines at once and gathers the replies as they
+ * arrive, so a command on many lines takes as long as the slowest of them
+ * rather than the sum. Every line has its own deadline. A line that misses
+ * it, or drops the connection, is warned about, closed and removed from the
+ * line set, so later requests in the same run don't wait for it again.
+ */
+
+#include "cli.h"
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <event.h>
+
+struct fanout_line
+{
+	struct event ev;
+	int fd;
+	int flags;
+	size_t written;
+	struct timeval deadline;
+	struct fanout *fanout;
+};
+
+struct fanout
+{
+	fd_set *line_set;
+	struct evbuffer *req;
+	cli_reply_cb cb;
+	void *cbarg;
+	int failed;
+};
+
+/* Input read past the reply a callback was waiting for is kept here. */
+static struct evbuffer *inbufs[FD_SETSIZE];
+static struct timeval timeout = { CLI_DEFAULT_TIMEOUT, 0 };
+static int lines_failed;
+
+void
+cli_set_timeout (double seconds) {
+	timeout.tv_sec = (time_t)seconds;
+	timeout.tv_usec = (suseconds_t)((seconds - timeout.tv_sec) * 1000000);
+}
+
+int
+cli_lines_failed (void) {
+	return lines_failed;
+}
+
+static void
+line_failed (struct fanout_line *fl, const char *why) {
+	warnx("%s: %s", cli_line_name(fl->fd), why);
+	fcntl(fl->fd, F_SETFL, fl->flags);
+	close(fl->fd);
+	FD_CLR(fl->fd, fl->fanout->line_set);
+	fl->fanout->failed++;
+	lines_failed++;
+}
+
+static void
+line_done (struct fanout_line *fl) {
+	fcntl(fl->fd, F_SETFL, fl->flags);
+}
+
+static void fanout_cb (int fd, short what, void *arg);
+
+/* Wait for the line to become ready for what, or fail it at its deadline. */
+static void
+line_wait (struct fanout_line *fl, short what) {
+	struct timeval now, left;
+
+	event_set(&fl->ev, fl->fd, what, fanout_cb, fl);
+	if (!timerisset(&timeout)) {
+		if (event_add(&fl->ev, NULL))
+			err(1, "event_add");
+		return;
+	}
+
+	gettimeofday(&now, NULL);
+	if (!timercmp(&now, &fl->deadline, <)) {
+		line_failed(fl, "Timed out");
+		return;
+	}
+	timersub(&fl->deadline, &now, &left);
+
+	if (event_add(&fl->ev, &left))
+		err(1, "event_add");
+}
+
+static void
+fanout_cb (int fd, short what, void *arg) {
+	struct fanout_line *fl = arg;
+	struct fanout *fo = fl->fanout;
+	struct evbuffer *in = inbufs[fd];
+	char *line;
+	ssize_t res;
+	int done;
+
+	if (what & EV_TIMEOUT) {
+		line_failed(fl, "Timed out");
+		return;
+	}
+
+	if (what & EV_WRITE) {
+		res = write(fd, EVBUFFER_DATA(fo->req) + fl->written, EVBUFFER_LENGTH(fo->req) - fl->written);
+		if (res < 0 && errno != EAGAIN && errno != EINTR) {
+			line_failed(fl, strerror(errno));
+			return;
+		}
+		if (res > 0)
+			fl->written += res;
+		if (fl->written < EVBUFFER_LENGTH(fo->req)) {
+			line_wait(fl, EV_WRITE);
+			return;
+		}
+		if (!fo->cb) {
+			line_done(fl);
+			return;
+		}
+	} else {
+		res = evbuffer_read(in, fd, 1024);
+		if (res < 0 && errno != EAGAIN && errno != EINTR) {
+			line_failed(fl, strerror(errno));
+			return;
+		}
+		if (res == 0) {
+			line_failed(fl, "Connection closed");
+			return;
+		}
+	}
+
+	while ((line = evbuffer_readline(in))) {
+		done = fo->cb(fd, line, fo->cbarg);
+		free(line);
+		if (done) {
+			line_done(fl);
+			return;
+		}
+	}
+	line_wait(fl, EV_READ);
+}
+
+int
+cli_fanout (fd_set *line_set, int maxfd, const fd_set *subset, struct evbuffer *req,
+		cli_reply_cb cb, void *cbarg) {
+	struct fanout fo = { line_set, req, cb, cbarg, 0 };
+	struct fanout_line lines[maxfd + 1];
+	struct timeval now;
+	int fd, nlines = 0;
+
+	gettimeofday(&now, NULL);
+	for (fd = 0 ; fd <= maxfd ; fd++) {
+		struct fanout_line *fl = &lines[fd];
+
+		if (!FD_ISSET(fd, line_set) || (subset && !FD_ISSET(fd, subset)))
+			continue;
+
+		if (!inbufs[fd] && !(inbufs[fd] = evbuffer_new()))
+			err(1, "evbuffer_new");
+
+		fl->fd = fd;
+		fl->written = 0;
+		fl->fanout = &fo;
+		timeradd(&now, &timeout, &fl->deadline);
+		fl->flags = fcntl(fd, F_GETFL);
+		if (fl->flags == -1 || fcntl(fd, F_SETFL, fl->flags | O_NONBLOCK) == -1)
+			err(1, "fcntl");
+		line_wait(fl, req ? EV_WRITE : EV_READ);
+		nlines++;
+	}
+	if (nlines == 0)
+		return 0;
+
+	event_dispatch();
+
+	for (fd = 0 ; fd <= maxfd ; fd++) {
+		if (FD_ISSET(fd, line_set))
+			return fo.failed;
+	}
+	errx(1, "No lines left");
+}
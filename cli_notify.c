@@ -28,6 +28,7 @@
 #include <err.h>
 #include <string.h>
 #include <sys/queue.h>
+#include <sys/time.h>
 #include <sys/uio.h>
 #include <unistd.h>
 #include <event.h>
@@ -36,12 +37,14 @@
 #include "cli.h"
 #include "base64.h"
 #include "complete.h"
+#include "libmovactl.h"
 
 typedef void (*notify_cb_t)(int fd, const char *name, const char *code, const char *arg, size_t len);
 
 struct notify_data
 {
 	TAILQ_ENTRY(notify_data) link;
+	int fd;
 	const char *name;
 	const char *code;
 	notify_cb_t cb;
@@ -50,6 +53,143 @@ struct notify_data
 
 TAILQ_HEAD(, notify_data) notifies = TAILQ_HEAD_INITIALIZER(notifies);
 
+/* Prefix the output with the line tag, set when given several lines. */
+static int tag_output;
+
+static enum { FORMAT_TEXT, FORMAT_TSV, FORMAT_JSONL } format;
+static int timestamps;
+
+/*
+ * Flushing after every notification is one write each. Otherwise a timer
+ * flushes, with no delay it fires once the pending reads of all lines are
+ * handled.
+ */
+static int flush_each = 1;
+static struct timeval flush_delay;
+static struct event flush_ev;
+static int flush_pending;
+
+void
+cli_set_output (const char *fmt, const char *flush, int stamps) {
+	char *cp;
+	long ms;
+
+	if (!fmt || strcmp(fmt, "text") == 0)
+		format = FORMAT_TEXT;
+	else if (strcmp(fmt, "tsv") == 0)
+		format = FORMAT_TSV;
+	else if (strcmp(fmt, "jsonl") == 0)
+		format = FORMAT_JSONL;
+	else
+		errx(1, "Unknown format %s, expected text, tsv or jsonl", fmt);
+
+	if (!flush || strcmp(flush, "event") == 0) {
+		flush_each = 1;
+	} else if (strcmp(flush, "batch") == 0) {
+		flush_each = 0;
+		timerclear(&flush_delay);
+	} else {
+		ms = strtol(flush, &cp, 10);
+		if (*cp != '\0' || ms < 0)
+			errx(1, "Unknown flush policy %s, expected event, batch or milliseconds", flush);
+		flush_each = 0;
+		flush_delay.tv_sec = ms / 1000;
+		flush_delay.tv_usec = ms % 1000 * 1000;
+	}
+	if (!flush_each)
+		setvbuf(stdout, NULL, _IOFBF, 0);
+
+	timestamps = stamps;
+}
+
+static void
+flush_cb (int fd, short what, void *arg) {
+	flush_pending = 0;
+	fflush(stdout);
+}
+
+static void
+output_done (void) {
+	if (flush_each) {
+		fflush(stdout);
+		return;
+	}
+	if (!flush_pending) {
+		evtimer_set(&flush_ev, flush_cb, NULL);
+		evtimer_add(&flush_ev, &flush_delay);
+		flush_pending = 1;
+	}
+}
+
+static void
+print_json_string (const char *str, size_t len) {
+	size_t i;
+
+	putchar('"');
+	for (i = 0 ; i < len ; i++) {
+		unsigned char c = str[i];
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04x", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+static void
+print_tsv_field (const char *str, size_t len) {
+	size_t i;
+
+	for (i = 0 ; i < len ; i++)
+		putchar(str[i] == '\t' ? ' ' : str[i]);
+}
+
+enum value_type { VALUE_NUMBER, VALUE_STRING };
+
+static void
+print_notify (int fd, const char *name, enum value_type type, const char *value, size_t len) {
+	const char *tag = cli_line_tag(fd);
+	struct timeval now;
+
+	if (timestamps)
+		gettimeofday(&now, NULL);
+
+	switch (format) {
+	case FORMAT_TEXT:
+		if (timestamps)
+			printf("%ld.%06ld ", (long)now.tv_sec, (long)now.tv_usec);
+		if (tag_output)
+			printf("%s ", tag);
+		printf("%s %.*s\n", name, (int)len, value);
+		break;
+	case FORMAT_TSV:
+		if (timestamps)
+			printf("%ld.%06ld\t", (long)now.tv_sec, (long)now.tv_usec);
+		print_tsv_field(tag, strlen(tag));
+		printf("\t%s\t", name);
+		print_tsv_field(value, len);
+		putchar('\n');
+		break;
+	case FORMAT_JSONL:
+		putchar('{');
+		if (timestamps)
+			printf("\"time\":%ld.%06ld,", (long)now.tv_sec, (long)now.tv_usec);
+		printf("\"line\":");
+		print_json_string(tag, strlen(tag));
+		printf(",\"name\":\"%s\",\"value\":", name);
+		if (type == VALUE_NUMBER)
+			printf("%.*s", (int)len, value);
+		else
+			print_json_string(value, len);
+		printf("}\n");
+		break;
+	}
+	output_done();
+}
+
 static void
 start_notify(int fd, const char *name, const char *code, notify_cb_t cb, int once) {
 	struct notify_data *data = malloc(sizeof (*data));
@@ -58,6 +198,7 @@ start_notify(int fd, const char *name, const char *code, notify_cb_t cb, int onc
 	if (!data)
 		err(1, "malloc");
 
+	data->fd = fd;
 	data->name = name;
 	data->code = code;
 	data->cb = cb;
@@ -82,7 +223,7 @@ stop_notify(int fd, struct notify_data *data) {
 	TAILQ_REMOVE(&notifies, data, link);
 
 	TAILQ_FOREACH(d, &notifies, link) {
-		if (strcmp(d->code, data->code) == 0)
+		if (d->fd == fd && strcmp(d->code, data->code) == 0)
 			break;
 	}
 	if (!d) {
@@ -110,13 +251,14 @@ stop_notify(int fd, struct notify_data *data) {
 		switch (v) {
 #define EV(type, name, val) \
 		case val: \
-			printf("%s " #name "\n", n); \
-			fflush(stdout); \
+			print_notify(fd, n, VALUE_STRING, #name, sizeof(#name) - 1); \
 			break;
 #define EEND(type) \
-		default: \
-			printf("%s unknown:0x%x\n", n, v); \
-			fflush(stdout); \
+		default: { \
+			char buf[32]; \
+			snprintf(buf, sizeof(buf), "unknown:0x%x", v); \
+			print_notify(fd, n, VALUE_STRING, buf, strlen(buf)); \
+		} \
 		} \
 	}
 #include "status_enums.h"
@@ -126,17 +268,18 @@ stop_notify(int fd, struct notify_data *data) {
 
 void
 notify_int_cb (int fd, const char *n, const char *code, const char *val, size_t len) {
+	char buf[16];
+
 	if (len != 4)
 		return;
 
-	printf ("%s %d\n", n, debase64_int24(val));
-	fflush(stdout);
+	snprintf(buf, sizeof(buf), "%d", debase64_int24(val));
+	print_notify(fd, n, VALUE_NUMBER, buf, strlen(buf));
 }
 
 void
 notify_string_cb (int fd, const char *n, const char *code, const char *val, size_t len) {
-	printf ("%s %.*s\n", n, (int)len, val);
-	fflush(stdout);
+	print_notify(fd, n, VALUE_STRING, val, len);
 }
 
 struct notify_code {
@@ -152,72 +295,109 @@ struct notify_code {
 	{ NULL }
 };
 
-static int
-filter_notifies (int fd, struct complete_candidate **cands) {
-	struct complete_candidate *cand, **pcand;
-	struct evbuffer *buf = evbuffer_new();
-	char *line;
+#include "notify_trie.h"
 
-	evbuffer_add(buf, "QSTS", 4);
-	for (cand = *cands ; cand ; cand = cand->next)
-		evbuffer_add(buf, ((struct notify_code*)cand->aux)->code, 4);
-	//syslog(LOG_DEBUG, "QSTS fd: %d query: %.*s", fd, (int)EVBUFFER_LENGTH(buf), EVBUFFER_DATA(buf));
-	evbuffer_add(buf, "\n", 1);
+static char all_codes[sizeof(notify_codes) / sizeof(*notify_codes) * 4];
+static size_t all_codes_len;
 
-	write (fd, EVBUFFER_DATA(buf), EVBUFFER_LENGTH(buf));
+/*
+ * Keep the candidates supported by any of the lines. Returns the number of
+ * lines that answered with their capabilities, disabled lines don't.
+ */
+static int
+filter_notifies (fd_set *line_set, int maxfd, struct complete_candidate **cands) {
+	struct complete_candidate *cand, **pcand;
+	struct notify_code *nc;
+	const char *caps[maxfd + 1];
+	int fd, match, nlines = 0;
 
-	evbuffer_drain(buf, EVBUFFER_LENGTH(buf));
-	while (!(line = evbuffer_readline(buf)))
-		evbuffer_read(buf, fd, 1024);
-	if (strncmp(line, "EDIS", 4) == 0)
-		return 1;
-	if (strncmp(line, "QSTS", 4) != 0)
-		errx(1, "Unexpected reply, not QSTS: %s", line);
+	/* Ask for everything, so the answer can be cached. */
+	if (!all_codes_len) {
+		for (nc = notify_codes ; nc->name ; nc++) {
+			memcpy(all_codes + all_codes_len, nc->code, 4);
+			all_codes_len += 4;
+		}
+	}
 
-	line += 4;
+	cli_fetch_capabilities(line_set, maxfd, "QSTS", all_codes, all_codes_len);
+	for (fd = 0 ; fd <= maxfd ; fd++) {
+		caps[fd] = NULL;
+		if (FD_ISSET(fd, line_set))
+			caps[fd] = cli_capabilities(fd, "QSTS", all_codes, all_codes_len);
+		if (caps[fd])
+			nlines++;
+	}
 
-	/* Reply should be in same order as query. */
 	pcand = cands;
 	while ((cand = *pcand)) {
-		if (strncmp(((struct notify_code*)cand->aux)->code, line, 4) == 0) {
+		match = 0;
+		for (fd = 0 ; fd <= maxfd && !match ; fd++)
+			match = movactl_has_capability(caps[fd], ((struct notify_code*)cand->aux)->code);
+		if (match) {
 			pcand = &cand->next;
-			line += 4;
 		} else {
 			*pcand = cand->next;
-			free(cand);
 		}
 	}
-	return 0;
+	return nlines;
+}
+
+static int
+notify_reply (int fd, const char *line, void *cbarg) {
+	int len = strlen(line);
+	struct notify_data *d;
+
+	if (len >= 8 && strncmp(line, "STAT", 4) == 0) {
+		const char *l = line + 4;
+		const char *v = line + 8;
+
+		TAILQ_FOREACH(d, &notifies, link) {
+			if (d->fd == fd && strncmp(l, d->code, 4) == 0) {
+				d->cb(fd, d->name, d->code, v, len - 8);
+				if (d->once) {
+					stop_notify(fd, d);
+					break; /* XXX multiple with same code? */
+				}
+			}
+		}
+	}
+
+	TAILQ_FOREACH(d, &notifies, link) {
+		if (d->fd == fd)
+			return 0;
+	}
+	return 1;
 }
 
+/*
+ * Subscribe to the notifications on all lines supporting them and print
+ * them as they come, from a single event loop. Once is set for status, it's
+ * done when every line has answered, and each line has the usual deadline.
+ * Listening goes on until the lines go away.
+ */
 int
-cli_notify (int fd, int argc, char *argv[], int once) {
-	int num = 0;
-	struct evbuffer *data;
-	struct complete_candidate *candidates = NULL, *cand;
+cli_notify (fd_set *line_set, int maxfd, int argc, char *argv[], int once) {
+	struct complete_candidate candbuf[notify_trie.nnames];
+	struct complete_candidate *candidates, *cand;
 	struct notify_code *nc;
+	fd_set subscribed;
 	int argi = 0;
+	int fd, nlines = 0;
 
-	do {
-		candidates = NULL;
-		for (nc = notify_codes ; nc->name ; nc++) {
-			cand = malloc (sizeof (*cand));
-			if (!cand)
-				err (1, "malloc");
-
-			cand->name = nc->name;
-			cand->name_off = 0;
-			cand->next = candidates;
-			cand->aux = nc;
-			candidates = cand;
-		}
+	for (fd = 0 ; fd <= maxfd ; fd++) {
+		if (FD_ISSET(fd, line_set))
+			nlines++;
+	}
+	tag_output = nlines > 1;
 
+	FD_ZERO(&subscribed);
+	do {
 		//syslog(LOG_DEBUG, "complete at %d '%s'", argi, argv[argi]);
-		argi += complete(&candidates, argc - argi, (const char**)argv + argi, (void(*)(struct complete_candidate*))free); 
+		argi += complete_trie(&notify_trie, argc - argi, (const char**)argv + argi, candbuf, &candidates);
 		//syslog(LOG_DEBUG, "after complete at %d '%s'", argi, argv[argi]);
 
 		if (candidates) {
-			if (filter_notifies(fd, &candidates))
+			if (!filter_notifies(line_set, maxfd, &candidates))
 				errx(1, "server disabled");
 		}
 
@@ -233,41 +413,18 @@ cli_notify (int fd, int argc, char *argv[], int once) {
 		}
 
 		nc = candidates->aux;
-		start_notify(fd, nc->name, nc->code, nc->cb, once);
-		num++;
-
-		free(candidates);
+		for (fd = 0 ; fd <= maxfd ; fd++) {
+			if (!FD_ISSET(fd, line_set)
+					|| !movactl_has_capability(cli_capabilities(fd, "QSTS", all_codes, all_codes_len), nc->code))
+				continue;
+			start_notify(fd, nc->name, nc->code, nc->cb, once);
+			FD_SET(fd, &subscribed);
+		}
 	} while (argi < argc);
 
-	data = evbuffer_new();
-	while (!TAILQ_EMPTY(&notifies)) {
-		int res = evbuffer_read(data, fd, 1024);
-		char *line;
-
-		if (res < 0)
-			err (1, "evbuffer_read");
-		if (res == 0)
-			errx (1, "EOF");
-
-		while ((line = evbuffer_readline(data))) {
-			int len = strlen(line);
-
-			if (len >= 8 && strncmp(line, "STAT", 4) == 0) {
-				const char *l = line + 4;
-				const char *v = line + 8;
-				struct notify_data *d;
-				
-				TAILQ_FOREACH(d, &notifies, link) {
-					if (strncmp(l, d->code, 4) == 0) {
-						d->cb(fd, d->name, d->code, v, len - 8);
-						if (d->once) {
-							stop_notify(fd, d);
-							break; /* XXX multiple with same code? */
-						}
-					}
-				}
-			}
-		}
-	}
+	if (!once)
+		cli_set_timeout(0);
+	cli_fanout(line_set, maxfd, &subscribed, NULL, notify_reply, NULL);
+	fflush(stdout);
 	return 0;
 }
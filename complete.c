@@ -133,3 +133,131 @@ complete(struct complete_candidate **cands, int argc, const char **argv,
 	}
 	return argi;
 }
+
+/*
+ * Frontier entries are trie nodes, or a node's own name only, encoded as
+ * -1 - node, for names used up by an empty word.
+ */
+static int
+frontier_names(const struct complete_trie *trie, const int *frontier, int nf) {
+	int i, n = 0;
+
+	for (i = 0 ; i < nf ; i++)
+		n += frontier[i] < 0 ? 1 : trie->nodes[frontier[i]].nnames;
+	return n;
+}
+
+static struct complete_candidate *
+trie_candidates(const struct complete_trie *trie, const int *frontier, int nf, int only_terminal,
+		struct complete_candidate *buf) {
+	struct complete_candidate *res = NULL, **pcand = &res;
+	int i, j, first, n;
+
+	for (i = 0 ; i < nf ; i++) {
+		const struct complete_trie_node *node = &trie->nodes[frontier[i] < 0 ? -1 - frontier[i] : frontier[i]];
+
+		first = node->first_name;
+		n = frontier[i] < 0 || only_terminal ? node->terminal : node->nnames;
+		for (j = first ; j < first + n ; j++) {
+			buf->name = trie->names[j].name;
+			buf->name_off = strlen(buf->name);
+			buf->is_exact = 1;
+			buf->aux = trie->names[j].aux;
+			*pcand = buf++;
+			pcand = &(*pcand)->next;
+		}
+	}
+	*pcand = NULL;
+	return res;
+}
+
+int
+complete_trie(const struct complete_trie *trie, int argc, const char **argv,
+		struct complete_candidate *buf, struct complete_candidate **cands) {
+	int fa[trie->nnodes], fb[trie->nnodes];
+	int *frontier = fa, *next = fb, *tmp;
+	int nf = 1, nn, i;
+	int argi = 0;
+	int argo = 0;
+
+	frontier[0] = 0;
+	while (argi < argc) {
+		const char *arg = argv[argi] + argo;
+		const char *ea;
+		int al;
+		int have_exact = 0;
+
+		ea = strpbrk (arg, "_- ");
+		if (ea) {
+			argo += ea - arg + 1;
+			al = ea - arg;
+		} else {
+			argi++;
+			argo = 0;
+			al = strlen (arg);
+		}
+
+		nn = 0;
+		for (i = 0 ; i < nf ; i++) {
+			const struct complete_trie_node *node;
+			int lo, hi, mid, end;
+
+			if (frontier[i] < 0 || al == 0) {
+				/* An empty word matches the end of a name exactly. */
+				node = &trie->nodes[frontier[i] < 0 ? -1 - frontier[i] : frontier[i]];
+				if (al == 0 && node->terminal) {
+					if (!have_exact)
+						nn = 0;
+					have_exact = 1;
+					next[nn++] = frontier[i] < 0 ? frontier[i] : -1 - frontier[i];
+				}
+				if (frontier[i] < 0 || have_exact)
+					continue;
+			}
+
+			node = &trie->nodes[frontier[i]];
+			lo = node->first_child;
+			hi = end = node->first_child + node->nchildren;
+			while (lo < hi) {
+				mid = (lo + hi) / 2;
+				if (strncmp (trie->nodes[mid].component, arg, al) < 0)
+					lo = mid + 1;
+				else
+					hi = mid;
+			}
+			for ( ; lo < end && strncmp (trie->nodes[lo].component, arg, al) == 0 ; lo++) {
+				int exact = (int)strlen (trie->nodes[lo].component) == al;
+
+				if (have_exact && !exact)
+					continue;
+				if (exact && !have_exact) {
+					nn = 0;
+					have_exact = 1;
+				}
+				next[nn++] = lo;
+			}
+		}
+
+		tmp = frontier;
+		frontier = next;
+		next = tmp;
+		nf = nn;
+
+		if (nf == 0) {
+			*cands = NULL;
+			return argi;
+		}
+		if (frontier_names(trie, frontier, nf) == 1 && !argo) {
+			*cands = trie_candidates(trie, frontier, nf, 0, buf);
+			return argi;
+		}
+	}
+
+	/* Prefer names that are complete over those continuing. */
+	for (i = 0 ; i < nf ; i++) {
+		if (frontier[i] < 0 || trie->nodes[frontier[i]].terminal)
+			break;
+	}
+	*cands = trie_candidates(trie, frontier, nf, i < nf, buf);
+	return argi;
+}
@@ -26,6 +26,10 @@
 #ifndef COMPLETE_H
 #define COMPLETE_H
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 struct complete_candidate
 {
 	const char *name;
@@ -38,4 +42,41 @@ struct complete_candidate
 int complete(struct complete_candidate **cands, int argc, const char **argv,
 		void (*elim_cb)(struct complete_candidate *cand));
 
+/* Generated by complete_trie.awk. Children and names below a node are ranges. */
+struct complete_trie_node
+{
+	const char *component;
+	unsigned short first_child;
+	unsigned short nchildren;
+	unsigned short first_name;
+	unsigned short nnames;
+	unsigned char terminal;
+};
+
+struct complete_trie_name
+{
+	const char *name;
+	void *aux;
+};
+
+struct complete_trie
+{
+	const struct complete_trie_node *nodes;
+	const struct complete_trie_name *names;
+	int nnodes;
+	int nnames;
+};
+
+/*
+ * Same matching as complete, but walking a prebuilt trie. The matches are
+ * linked from *cands using buf, which must have room for trie->nnames
+ * candidates. Nothing is allocated.
+ */
+int complete_trie(const struct complete_trie *trie, int argc, const char **argv,
+		struct complete_candidate *buf, struct complete_candidate **cands);
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif /*COMPLETE_H*/
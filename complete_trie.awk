@@ -0,0 +1,134 @@
+# Copyright (c) 2013 Pelle Johansson
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+# IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+# OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+# IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+# INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+# NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+# DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+# THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+# (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+# THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Generates a completion trie, see struct complete_trie in complete.h, from
+# all_commands.h or all_notify.h. Each name is split into its _ separated
+# words. Children of a node are kept together and sorted, and the names
+# below a node make up a single range of the names table.
+#
+# Variables:
+#	prefix	  name of the generated struct complete_trie
+#	array	  table in the including file with one entry per input line,
+#		  used for the aux pointers
+#	builtins  space separated extra names, with NULL aux
+
+function add_name(name, aux,    n, w, words, node, key) {
+	n = split(name, words, "_")
+	node = 0
+	for (w = 1 ; w <= n ; w++) {
+		key = node SUBSEP words[w]
+		if (!(key in child)) {
+			child[key] = nnodes
+			component[nnodes] = words[w]
+			children[node] = children[node] " " nnodes
+			nnodes++
+		}
+		node = child[key]
+	}
+	terminal[node] = name
+	terminal_aux[node] = aux
+}
+
+# Sort the children of node by component, byte order.
+function sort_children(node,    n, i, j, c, tmp) {
+	n = split(children[node], c, " ")
+	for (i = 2 ; i <= n ; i++) {
+		tmp = c[i]
+		for (j = i - 1 ; j >= 1 && component[c[j]] > component[tmp] ; j--)
+			c[j + 1] = c[j]
+		c[j + 1] = tmp
+	}
+	nsorted[node] = n
+	for (i = 1 ; i <= n ; i++)
+		sorted[node, i] = c[i]
+}
+
+# Number the names below node in order, terminal first.
+function number_names(node,    i) {
+	first_name[node] = nnames
+	if (node in terminal) {
+		names[nnames] = terminal[node]
+		names_aux[nnames] = terminal_aux[node]
+		nnames++
+	}
+	for (i = 1 ; i <= nsorted[node] ; i++)
+		number_names(sorted[node, i])
+	count_names[node] = nnames - first_name[node]
+}
+
+BEGIN {
+	nnodes = 1
+	component[0] = ""
+	nin = 0
+}
+
+/^(COMMAND|NOTIFY)/ {
+	name = $0
+	sub(/^[A-Z]+ *\( */, "", name)
+	sub(/ *,.*/, "", name)
+	add_name(name, "&" array "[" nin "]")
+	nin++
+}
+
+END {
+	n = split(builtins, b, " ")
+	for (i = 1 ; i <= n ; i++)
+		add_name(b[i], "NULL")
+
+	for (node = 0 ; node < nnodes ; node++)
+		sort_children(node)
+
+	# Lay the nodes out breadth first so siblings are adjacent.
+	order[0] = 0
+	index_of[0] = 0
+	nout = 1
+	for (i = 0 ; i < nout ; i++) {
+		node = order[i]
+		first_child[node] = nout
+		for (j = 1 ; j <= nsorted[node] ; j++) {
+			order[nout] = sorted[node, j]
+			index_of[sorted[node, j]] = nout
+			nout++
+		}
+	}
+
+	nnames = 0
+	number_names(0)
+
+	print "/* Generated by complete_trie.awk, do not edit. */"
+	print ""
+	print "static const struct complete_trie_node " prefix "_nodes[] = {"
+	for (i = 0 ; i < nout ; i++) {
+		node = order[i]
+		printf "\t{ \"%s\", %d, %d, %d, %d, %d },\n", component[node], first_child[node], nsorted[node], \
+				first_name[node], count_names[node], (node in terminal) ? 1 : 0
+	}
+	print "};"
+	print ""
+	print "static const struct complete_trie_name " prefix "_names[] = {"
+	for (i = 0 ; i < nnames ; i++)
+		printf "\t{ \"%s\", %s },\n", names[i], names_aux[i]
+	print "};"
+	print ""
+	printf "static const struct complete_trie %s = { %s_nodes, %s_names, %d, %d };\n", prefix, prefix, prefix, nout, nnames
+}
@@ -41,6 +41,8 @@
 #include "api_serverside.h"
 #include "smart_event.hh"
 #include "event_unhandled_exception.hh"
+#include "flight_recorder.hh"
+#include "trace.hh"
 #include "bos.hh"
 
 int running;
@@ -53,6 +55,15 @@ quit_event(int signum, short what)
 	event_loopexit (NULL);
 }
 
+void
+dump_event(int signum, short what)
+{
+	std::string path = flight_recorder_dump();
+
+	if (!path.empty())
+		warnx ("Flight recorder dumped to %s", path.c_str());
+}
+
 extern char *optarg;
 extern int optind;
 extern int optopt;
@@ -63,12 +74,22 @@ int
 main (int argc, char *argv[]) {
 	char opt;
 	bool dobos = false;
+	const char *stats_path = NULL;
 
-	while ((opt = getopt(argc, argv, ":lb")) != -1) {
+	while ((opt = getopt(argc, argv, ":lbm:r:t:")) != -1) {
 		switch (opt) {
 		case 'b':
 			dobos = true;
 			break;
+		case 'm':
+			stats_path = optarg;
+			break;
+		case 'r':
+			flight_recorder_set_dir(optarg);
+			break;
+		case 't':
+			trace_open(optarg);
+			break;
 		case 'l':
 			launchd_flag = 1;
 			break;
@@ -106,9 +127,15 @@ main (int argc, char *argv[]) {
 	term_ev.set_signal(SIGTERM, quit_event);
 	term_ev.add();
 
+	smart_event<> dump_ev;
+	dump_ev.set_signal(SIGUSR1, dump_event);
+	dump_ev.add();
+
 	if (launchd_flag)
 		launchd_init();
 	backend_listen_all();
+	if (stats_path)
+		serverside_listen_stats(stats_path);
 
 	running = 1;
 	while (running) {
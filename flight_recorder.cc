@@ -0,0 +1,128 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "flight_recorder.hh"
+
+#include <err.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "backend.h"
+#include "api_serverside.h"
+
+void
+capture_writer::add(enum capture_stream_kind kind, const std::string &type, const std::string &name, const flight_recorder &fr)
+{
+	struct capture_stream st;
+	uint16_t id = streams.size();
+
+	memset(&st, 0, sizeof(st));
+	st.id = id;
+	st.kind = kind;
+	strncpy(st.type, type.c_str(), sizeof(st.type) - 1);
+	strncpy(st.name, name.c_str(), sizeof(st.name) - 1);
+	streams.push_back(st);
+
+	fr.for_each([&](uint64_t usec, enum capture_dir dir, const std::string &data) {
+		records.push_back(record{usec, id, static_cast<uint8_t>(dir), data});
+	});
+}
+
+int
+capture_writer::write(const std::string &path)
+{
+	struct capture_file_header hdr;
+	struct timeval now;
+
+	std::stable_sort(records.begin(), records.end(), [](const record &a, const record &b) {
+		return a.usec < b.usec;
+	});
+
+	gettimeofday(&now, NULL);
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic));
+	hdr.version = CAPTURE_VERSION;
+	hdr.nstreams = streams.size();
+	hdr.mono_usec = flight_recorder::now_usec();
+	hdr.real_usec = (uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+
+	FILE *f = fopen(path.c_str(), "wx");
+	if (!f)
+		return -1;
+
+	fwrite(&hdr, sizeof(hdr), 1, f);
+	fwrite(streams.data(), sizeof(struct capture_stream), streams.size(), f);
+	for (auto &r : records) {
+		struct capture_record cr;
+
+		memset(&cr, 0, sizeof(cr));
+		cr.usec = r.usec;
+		cr.stream = r.stream;
+		cr.len = r.data.length();
+		cr.dir = r.dir;
+		fwrite(&cr, sizeof(cr), 1, f);
+		fwrite(r.data.data(), 1, r.data.length(), f);
+	}
+
+	if (ferror(f)) {
+		fclose(f);
+		unlink(path.c_str());
+		return -1;
+	}
+	return fclose(f);
+}
+
+static std::string dump_dir;
+
+void
+flight_recorder_set_dir(const std::string &dir)
+{
+	dump_dir = dir;
+}
+
+std::string
+flight_recorder_dump()
+{
+	static int seq;
+	capture_writer w;
+	char path[1024];
+
+	if (dump_dir.empty())
+		return std::string();
+
+	backend_dump_recorders(w);
+	serverside_dump_recorders(w);
+
+	snprintf(path, sizeof(path), "%s/movactld.%ld.%d.%d.cap", dump_dir.c_str(), (long)time(NULL), (int)getpid(), seq++);
+	if (w.write(path)) {
+		warn("%s", path);
+		return std::string();
+	}
+	return path;
+}
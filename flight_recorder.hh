@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef FLIGHT_RECORDER_HH
+#define FLIGHT_RECORDER_HH
+
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "capture.h"
+
+/*
+ * Fixed size ring of the latest traffic on a line or connection, kept so
+ * that it can be dumped after something has gone wrong. Recording copies the
+ * data into the ring, overwriting the oldest records, and never allocates.
+ */
+class flight_recorder
+{
+	struct entry
+	{
+		uint64_t usec;
+		uint16_t len;
+		uint8_t dir;
+		/* More data may be appended to this record. */
+		uint8_t more;
+	};
+
+	std::unique_ptr<unsigned char[]> buf;
+	size_t size;
+	size_t head;
+	size_t used;
+	size_t last;
+	bool have_last;
+
+	void put(size_t pos, const void *data, size_t len)
+	{
+		size_t first = size - pos < len ? size - pos : len;
+
+		memcpy(&buf[pos], data, first);
+		if (first < len)
+			memcpy(&buf[0], (const unsigned char*)data + first, len - first);
+	}
+
+	void get(size_t pos, void *data, size_t len) const
+	{
+		size_t first = size - pos < len ? size - pos : len;
+
+		memcpy(data, &buf[pos], first);
+		if (first < len)
+			memcpy((unsigned char*)data + first, &buf[0], len - first);
+	}
+
+	size_t tail() const
+	{
+		return (head + size - used) % size;
+	}
+
+	/* Make room for len more bytes by dropping the oldest records. */
+	void evict(size_t len)
+	{
+		while (used + len > size) {
+			struct entry e;
+			size_t t = tail();
+
+			if (have_last && t == last)
+				have_last = false;
+			get(t, &e, sizeof(e));
+			used -= sizeof(e) + e.len;
+		}
+	}
+
+public:
+	static uint64_t now_usec()
+	{
+		struct timespec ts;
+
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+
+	flight_recorder(size_t size)
+		: buf(new unsigned char[size]), size(size), head(0), used(0), last(0), have_last(false)
+	{
+	}
+
+	/*
+	 * Record len bytes in direction dir. With more set, the next record in
+	 * the same direction is appended to this one instead, so that a line
+	 * written in pieces ends up as a single record.
+	 */
+	void record(enum capture_dir dir, const void *data, size_t len, bool more = false)
+	{
+		struct entry e;
+		size_t max = size / 4 < UINT16_MAX ? size / 4 : UINT16_MAX;
+
+		if (have_last) {
+			get(last, &e, sizeof(e));
+			if (e.more && e.dir == dir && e.len + len <= max) {
+				evict(len);
+				if (have_last) {
+					put(head, data, len);
+					head = (head + len) % size;
+					used += len;
+					e.len += len;
+					e.more = more;
+					put(last, &e, sizeof(e));
+					return;
+				}
+			}
+		}
+
+		if (len > max)
+			len = max;
+		evict(sizeof(e) + len);
+
+		e.usec = now_usec();
+		e.len = len;
+		e.dir = dir;
+		e.more = more;
+		last = head;
+		have_last = true;
+		put(head, &e, sizeof(e));
+		put((head + sizeof(e)) % size, data, len);
+		head = (head + sizeof(e) + len) % size;
+		used += sizeof(e) + len;
+	}
+
+	/* Call func(usec, dir, data) for each record, oldest first. */
+	template <class F>
+	void for_each(F func) const
+	{
+		size_t pos = tail();
+		size_t left = used;
+		std::string data;
+
+		while (left > 0) {
+			struct entry e;
+
+			get(pos, &e, sizeof(e));
+			data.resize(e.len);
+			if (e.len)
+				get((pos + sizeof(e)) % size, &data[0], e.len);
+			func(e.usec, static_cast<enum capture_dir>(e.dir), data);
+			pos = (pos + sizeof(e) + e.len) % size;
+			left -= sizeof(e) + e.len;
+		}
+	}
+};
+
+/* Collects the records of several recorders and writes them as a capture file. */
+class capture_writer
+{
+	struct record
+	{
+		uint64_t usec;
+		uint16_t stream;
+		uint8_t dir;
+		std::string data;
+	};
+
+	std::vector<struct capture_stream> streams;
+	std::vector<record> records;
+
+public:
+	void add(enum capture_stream_kind kind, const std::string &type, const std::string &name, const flight_recorder &fr);
+	int write(const std::string &path);
+};
+
+/* Where flight_recorder_dump writes, no dumps if empty. */
+void flight_recorder_set_dir(const std::string &dir);
+
+/* Dump all backends and connections to a new file, returning its path or empty on failure. */
+std::string flight_recorder_dump();
+
+#endif /*FLIGHT_RECORDER_HH*/
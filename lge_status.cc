@@ -38,7 +38,7 @@ public:
 	lge_status(backend_ptr &ptr, std::string name, std::string line, std::string client, int throttle);
 
 	virtual const char *packet_separators() const;
-	virtual void update_status(const std::string &packet, const struct backend_output *inptr);
+	virtual void update_status(packet_view packet, const struct backend_output *inptr);
 	virtual int send_status_request(const std::string &code);
 	virtual int query_command(const std::string &code) const;
 	virtual int query_status(const std::string &code) const;
@@ -53,6 +53,8 @@ public:
 lge_status::lge_status(backend_ptr &ptr, std::string name, std::string line, std::string client, int throttle)
 	: status(ptr, std::move(name), std::move(line), std::move(client), throttle)
 {
+	/* The TV answers every command, but mixes up replies if given several at once. */
+	window = 1;
 }
 
 const char *
@@ -131,9 +133,9 @@ lge_status::update_tv_channel(const struct lge_notify *lgenot, int ok, const std
 			if (arg[i] >= '0' && arg[i] <= '9')
 				val += arg[i] - '0';
 			else if (arg[i] >= 'A' && arg[i] <= 'F')
-				val += arg[i] - 'A';
+				val += arg[i] - 'A' + 10;
 			else if (arg[i] >= 'a' && arg[i] <= 'f')
-				val += arg[i] - 'a';
+				val += arg[i] - 'a' + 10;
 		}
 		notify(lgenot->code, val);
 	} else
@@ -166,42 +168,49 @@ const struct lge_notify lge_notifies[] = {
 };
 
 void
-lge_status::update_status(const std::string &line, const struct backend_output *inptr)
+lge_status::update_status(packet_view line, const struct backend_output *inptr)
 {
 	const struct lge_notify *lgenot;
+	const struct backend_output *out;
 	char cmd[3];
 	int ok;
 
-	while (inptr && (inptr->len < 2 || inptr->data[1] != line[0]))
-		remove_output(&inptr);
-	if (!inptr) {
-		warnx("No output match for %s", line.c_str());
+	for (out = inptr ; out ; out = output.next_sent(out)) {
+		if (out->len >= 2 && out->data[1] == line[0])
+			break;
+	}
+	if (!out) {
+		/* Most likely a late reply to a command that timed out. */
+		warnx("No output match for %.*s", (int)line.length(), line.data());
+		metrics.packets_dropped++;
 		return;
 	}
 
-	cmd[0] = inptr->data[0];
-	remove_output(&inptr);
+	cmd[0] = out->data[0];
+	output_replied(&inptr, out);
 
-	//warnx("Read packet %c%s", cmd[0], line.c_str());
+	//warnx("Read packet %c%.*s", cmd[0], (int)line.length(), line.data());
 
 	cmd[1] = line[0];
 	cmd[2] = '\0';
 
 	if (line.length() < sizeof ("x 01 ")) {
 		warnx("Invalid packet");
+		metrics.packets_dropped++;
 		return;
 	}
 
-	std::string ack = line.substr(sizeof("x 01 ") - 1, 2);
+	packet_view ack = line.substr(sizeof("x 01 ") - 1, 2);
 	if (ack == "OK")
 		ok = 1;
 	else if (ack == "NG")
 		ok = 0;
 	else {
 		warnx("Invalid OK/NG");
+		metrics.packets_dropped++;
 		return;
 	}
-	std::string arg = line.substr(sizeof("x 01 ") + 1);
+	std::string arg = line.substr(sizeof("x 01 ") + 1).str();
 
 	for (lgenot = lge_notifies ; lgenot->code ; lgenot++) {
 		if (strncmp(cmd, lgenot->cmd, 2) == 0) {
@@ -293,12 +302,15 @@ lge_status::send_command(const std::string &cmd, const std::vector<int32_t> &arg
 		warnx("Mismatch number of arguments %zd <> %zd", args.size(), lgecmd->narg);
 		return;
 	}
+	/* Everything but key presses sets an absolute value and is safe to repeat. */
+	int retries = strncmp(lgecmd->fmt, "mc", 2) == 0 ? 0 : max_retries;
+
 	if (args.size() == 0)
-		send_throttle(&lgecmd->throttle, lgecmd->fmt, "" /* Suppress warning */);
+		send_throttle(&lgecmd->throttle, retries, lgecmd->fmt, "" /* Suppress warning */);
 	else if (lgecmd->split)
-		send_throttle(&lgecmd->throttle, lgecmd->fmt, (int)args[0] / 256, (int)args[0] & 255);
+		send_throttle(&lgecmd->throttle, retries, lgecmd->fmt, (int)args[0] / 256, (int)args[0] & 255);
 	else
-		send_throttle(&lgecmd->throttle, lgecmd->fmt, (int)args[0]);
+		send_throttle(&lgecmd->throttle, retries, lgecmd->fmt, (int)args[0]);
 }
 
 class status *lge_creator(backend_ptr &ptr, std::string name, std::string line, std::string client, int throttle)
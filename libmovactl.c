@@ -0,0 +1,485 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "libmovactl.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <event.h>
+
+#include "base64.h"
+
+struct movactl_request
+{
+	TAILQ_ENTRY(movactl_request) link;
+	char code[4];
+	movactl_reply_cb cb;
+	void *cbarg;
+};
+
+struct movactl_subscription
+{
+	TAILQ_ENTRY(movactl_subscription) link;
+	char code[4];
+	int once;
+	/* Unsubscribed while calling back, freed afterwards. */
+	int dead;
+	movactl_notify_cb cb;
+	void *cbarg;
+};
+
+struct movactl
+{
+	int fd;
+	struct evbuffer *in;
+	struct evbuffer *out;
+
+	TAILQ_HEAD(, movactl_request) requests;
+	TAILQ_HEAD(, movactl_subscription) subscriptions;
+
+	movactl_error_cb error_cb;
+	void *cbarg;
+
+	int attached;
+	struct event rev;
+	struct event wev;
+
+	/* Set while calling back, movactl_free then leaves it to movactl_read. */
+	int dispatching;
+	int freed;
+};
+
+int
+movactl_open_local (const char *path) {
+	struct sockaddr_un unaddr = {0};
+	int fd = socket (PF_LOCAL, SOCK_STREAM, 0);
+
+	if (fd < 0)
+		return -1;
+
+	unaddr.sun_family = AF_LOCAL;
+	strncpy (unaddr.sun_path, path, sizeof (unaddr.sun_path) - 1);
+	unaddr.sun_path[sizeof (unaddr.sun_path) - 1] = '\0';
+
+	if (connect (fd, (struct sockaddr*)&unaddr, sizeof (unaddr))) {
+		close (fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int
+movactl_open_remote (const char *host, const char *port) {
+	const struct addrinfo hints = { .ai_socktype = SOCK_STREAM };
+	struct addrinfo *res, *curr;
+	int fd = -1;
+
+	if (getaddrinfo(host, port, &hints, &res)) {
+		errno = EADDRNOTAVAIL;
+		return -1;
+	}
+
+	for (curr = res ; curr ; curr = curr->ai_next) {
+		fd = socket(curr->ai_family, curr->ai_socktype, curr->ai_protocol);
+
+		if (fd < 0)
+			continue;
+
+		if (connect(fd, curr->ai_addr, curr->ai_addrlen)) {
+			close(fd);
+			fd = -1;
+			continue;
+		}
+
+		break;
+	}
+	freeaddrinfo(res);
+
+	return fd;
+}
+
+int
+movactl_open (const char *path) {
+	char linkdst[PATH_MAX + 1];
+	char *cp;
+
+	int r = readlink(path, linkdst, PATH_MAX);
+	if (r == -1) {
+		if (errno == EINVAL)
+			return movactl_open_local(path);
+		return -1;
+	}
+
+	linkdst[r] = '\0';
+
+	if (linkdst[0] == '.' || strchr(linkdst, '/'))
+		return movactl_open_local(path);
+
+	cp = strchr(linkdst, ':');
+	if (!cp)
+		return movactl_open_local(path);
+
+	*cp++ = '\0';
+	return movactl_open_remote(linkdst, cp);
+}
+
+void
+movactl_encode (struct evbuffer *buf, const char *cmd, const char *arg, size_t arglen) {
+	evbuffer_add(buf, cmd, 4);
+	evbuffer_add(buf, arg, arglen);
+	evbuffer_add(buf, "\n", 1);
+}
+
+void
+movactl_encode_send (struct evbuffer *buf, const char *code, const int *args, int nargs) {
+	char parg[4];
+	int i;
+
+	evbuffer_add(buf, "SEND", 4);
+	evbuffer_add(buf, code, 4);
+	for (i = 0 ; i < nargs ; i++) {
+		base64_int24(parg, args[i]);
+		evbuffer_add(buf, parg, 4);
+	}
+	evbuffer_add(buf, "\n", 1);
+}
+
+int
+movactl_has_capability (const char *caps, const char *code) {
+	size_t i, len;
+
+	if (!caps)
+		return 0;
+	len = strlen(caps);
+	for (i = 0 ; i + 4 <= len ; i += 4) {
+		if (strncmp(caps + i, code, 4) == 0)
+			return 1;
+	}
+	return 0;
+}
+
+struct movactl *
+movactl_new (int fd, movactl_error_cb error_cb, void *cbarg) {
+	struct movactl *m = calloc(1, sizeof (*m));
+
+	if (!m)
+		return NULL;
+
+	m->in = evbuffer_new();
+	m->out = evbuffer_new();
+	if (!m->in || !m->out) {
+		if (m->in)
+			evbuffer_free(m->in);
+		if (m->out)
+			evbuffer_free(m->out);
+		free(m);
+		return NULL;
+	}
+
+	m->fd = fd;
+	m->error_cb = error_cb;
+	m->cbarg = cbarg;
+	TAILQ_INIT(&m->requests);
+	TAILQ_INIT(&m->subscriptions);
+	return m;
+}
+
+void
+movactl_free (struct movactl *m) {
+	struct movactl_request *req;
+	struct movactl_subscription *sub;
+
+	if (m->dispatching) {
+		m->freed = 1;
+		return;
+	}
+
+	if (m->attached) {
+		event_del(&m->rev);
+		event_del(&m->wev);
+	}
+	while ((req = TAILQ_FIRST(&m->requests))) {
+		TAILQ_REMOVE(&m->requests, req, link);
+		free(req);
+	}
+	while ((sub = TAILQ_FIRST(&m->subscriptions))) {
+		TAILQ_REMOVE(&m->subscriptions, sub, link);
+		free(sub);
+	}
+	evbuffer_free(m->in);
+	evbuffer_free(m->out);
+	close(m->fd);
+	free(m);
+}
+
+int
+movactl_fd (struct movactl *m) {
+	return m->fd;
+}
+
+int
+movactl_want_write (struct movactl *m) {
+	return EVBUFFER_LENGTH(m->out) > 0;
+}
+
+int
+movactl_write (struct movactl *m) {
+	int res;
+
+	if (!EVBUFFER_LENGTH(m->out))
+		return 0;
+	res = evbuffer_write(m->out, m->fd);
+	if (res < 0 && (errno == EAGAIN || errno == EINTR))
+		return 0;
+	return res;
+}
+
+/* Queue the output, with libevent also wait for the fd to be writable. */
+static int
+queued (struct movactl *m) {
+	if (m->attached && !event_pending(&m->wev, EV_WRITE, NULL))
+		return event_add(&m->wev, NULL);
+	return 0;
+}
+
+static void
+report_error (struct movactl *m, const char *what) {
+	if (m->error_cb)
+		m->error_cb(m, what, m->cbarg);
+}
+
+static void
+notify (struct movactl *m, const char *line, size_t len) {
+	struct movactl_subscription *sub, *next;
+
+	for (sub = TAILQ_FIRST(&m->subscriptions) ; sub && !m->freed ; sub = next) {
+		next = TAILQ_NEXT(sub, link);
+		if (sub->dead || memcmp(sub->code, line + 4, 4) != 0)
+			continue;
+		sub->cb(m, sub->code, line + 8, len - 8, sub->cbarg);
+		if (sub->once && !m->freed)
+			movactl_unsubscribe(m, line + 4, sub->cb, sub->cbarg);
+	}
+}
+
+/*
+ * Match a reply to the oldest request for it. SYNC is only answered once
+ * the commands before it are done, other requests right away, so EDIS and
+ * ECMD, which take the place of any reply, go to the oldest request that
+ * isn't SYNC. With nothing waiting they belong to a command without reply.
+ */
+static void
+dispatch (struct movactl *m, const char *line, size_t len) {
+	struct movactl_request *req;
+	int failed;
+
+	if (len < 4)
+		return;
+
+	if (len >= 8 && strncmp(line, "STAT", 4) == 0) {
+		notify(m, line, len);
+		return;
+	}
+
+	failed = strncmp(line, "EDIS", 4) == 0 || strncmp(line, "ECMD", 4) == 0;
+	TAILQ_FOREACH(req, &m->requests, link) {
+		if (failed ? memcmp(req->code, "SYNC", 4) != 0 : memcmp(req->code, line, 4) == 0)
+			break;
+	}
+	if (!req && failed && line[1] == 'C')
+		req = TAILQ_FIRST(&m->requests); /* Old daemon without SYNC. */
+	if (!req) {
+		report_error(m, failed ? (line[1] == 'D' ? "Line disabled" : "Unknown command") : "Unexpected reply");
+		return;
+	}
+
+	TAILQ_REMOVE(&m->requests, req, link);
+	if (req->cb)
+		req->cb(m, line, len, req->cbarg);
+	free(req);
+}
+
+int
+movactl_read (struct movactl *m) {
+	struct movactl_subscription *sub, *next;
+	char *line;
+	int res = evbuffer_read(m->in, m->fd, 4096);
+
+	if (res < 0 && (errno == EAGAIN || errno == EINTR))
+		return 1;
+	if (res <= 0)
+		return res;
+
+	m->dispatching = 1;
+	while (!m->freed && (line = evbuffer_readline(m->in))) {
+		dispatch(m, line, strlen(line));
+		free(line);
+	}
+	m->dispatching = 0;
+
+	for (sub = TAILQ_FIRST(&m->subscriptions) ; sub ; sub = next) {
+		next = TAILQ_NEXT(sub, link);
+		if (sub->dead) {
+			TAILQ_REMOVE(&m->subscriptions, sub, link);
+			free(sub);
+		}
+	}
+
+	if (m->freed) {
+		m->freed = 0;
+		movactl_free(m);
+	}
+	return 1;
+}
+
+static void
+event_read_cb (int fd, short what, void *arg) {
+	struct movactl *m = arg;
+	int res = movactl_read(m);
+
+	if (res <= 0) {
+		event_del(&m->rev);
+		event_del(&m->wev);
+		report_error(m, res == 0 ? "Connection closed" : strerror(errno));
+	}
+}
+
+static void
+event_write_cb (int fd, short what, void *arg) {
+	struct movactl *m = arg;
+
+	if (movactl_write(m) < 0) {
+		event_del(&m->rev);
+		report_error(m, strerror(errno));
+		return;
+	}
+	if (movactl_want_write(m))
+		event_add(&m->wev, NULL);
+}
+
+int
+movactl_event_attach (struct movactl *m) {
+	int flags = fcntl(m->fd, F_GETFL);
+
+	if (flags == -1 || fcntl(m->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+		return -1;
+
+	event_set(&m->rev, m->fd, EV_READ | EV_PERSIST, event_read_cb, m);
+	event_set(&m->wev, m->fd, EV_WRITE, event_write_cb, m);
+	m->attached = 1;
+	if (event_add(&m->rev, NULL))
+		return -1;
+	if (movactl_want_write(m))
+		return event_add(&m->wev, NULL);
+	return 0;
+}
+
+int
+movactl_send (struct movactl *m, const char *code, const int *args, int nargs) {
+	movactl_encode_send(m->out, code, args, nargs);
+	return queued(m);
+}
+
+int
+movactl_set_enabled (struct movactl *m, int enable, const char *server) {
+	movactl_encode(m->out, enable ? "SENA" : "SDIS", server, strlen(server));
+	return queued(m);
+}
+
+int
+movactl_trace (struct movactl *m, const char *id) {
+	movactl_encode(m->out, "TRCE", id, strlen(id));
+	return queued(m);
+}
+
+int
+movactl_query (struct movactl *m, const char *query, const char *arg, size_t arglen,
+		movactl_reply_cb cb, void *cbarg) {
+	struct movactl_request *req = malloc(sizeof (*req));
+
+	if (!req)
+		return -1;
+	memcpy(req->code, query, 4);
+	req->cb = cb;
+	req->cbarg = cbarg;
+	TAILQ_INSERT_TAIL(&m->requests, req, link);
+
+	movactl_encode(m->out, query, arg, arglen);
+	return queued(m);
+}
+
+int
+movactl_subscribe (struct movactl *m, const char *code, int once, movactl_notify_cb cb, void *cbarg) {
+	struct movactl_subscription *sub = malloc(sizeof (*sub));
+
+	if (!sub)
+		return -1;
+	memcpy(sub->code, code, 4);
+	sub->once = once;
+	sub->dead = 0;
+	sub->cb = cb;
+	sub->cbarg = cbarg;
+	TAILQ_INSERT_TAIL(&m->subscriptions, sub, link);
+
+	movactl_encode(m->out, "STRT", code, 4);
+	return queued(m);
+}
+
+int
+movactl_unsubscribe (struct movactl *m, const char *code, movactl_notify_cb cb, void *cbarg) {
+	struct movactl_subscription *sub;
+	char c[4];
+
+	memcpy(c, code, 4);
+	TAILQ_FOREACH(sub, &m->subscriptions, link) {
+		if (!sub->dead && memcmp(sub->code, c, 4) == 0 && sub->cb == cb && sub->cbarg == cbarg)
+			break;
+	}
+	if (!sub)
+		return 0;
+	if (m->dispatching) {
+		sub->dead = 1;
+	} else {
+		TAILQ_REMOVE(&m->subscriptions, sub, link);
+		free(sub);
+	}
+
+	/* The daemon keeps a single subscription per code. */
+	TAILQ_FOREACH(sub, &m->subscriptions, link) {
+		if (!sub->dead && memcmp(sub->code, c, 4) == 0)
+			return 0;
+	}
+	movactl_encode(m->out, "STOP", c, 4);
+	return queued(m);
+}
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBMOVACTL_H
+#define LIBMOVACTL_H
+
+/*
+ * Client side of the movactld protocol, for programs that want to talk to
+ * the daemon directly instead of running movactl. The connection is driven
+ * by the caller's event loop: watch movactl_fd() for reading, and for
+ * writing while movactl_want_write() is set, and call movactl_read() and
+ * movactl_write() when it's ready. With libevent, movactl_event_attach()
+ * does that.
+ *
+ * Replies are matched to requests in the order they were sent, except SYNC
+ * which is answered once the commands before it are done. A request on a
+ * disabled line is answered with EDIS, and one the daemon doesn't know with
+ * ECMD, instead of the expected reply. The reply callback gets the whole
+ * line, so the first four characters tell which.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct movactl;
+struct evbuffer;
+
+typedef void (*movactl_reply_cb)(struct movactl *m, const char *reply, size_t len, void *cbarg);
+typedef void (*movactl_notify_cb)(struct movactl *m, const char *code, const char *val, size_t len, void *cbarg);
+/* Called when the connection fails or with replies no request was waiting for. */
+typedef void (*movactl_error_cb)(struct movactl *m, const char *error, void *cbarg);
+
+/*
+ * Connect to a line socket. A symlink to host:port connects to a remote
+ * daemon instead. Returns the fd or -1 with errno set.
+ */
+int movactl_open (const char *path);
+int movactl_open_local (const char *path);
+int movactl_open_remote (const char *host, const char *port);
+
+/* Takes over fd, it's closed by movactl_free. */
+struct movactl *movactl_new (int fd, movactl_error_cb error_cb, void *cbarg);
+/* Safe to call from the callbacks. */
+void movactl_free (struct movactl *m);
+
+int movactl_fd (struct movactl *m);
+int movactl_want_write (struct movactl *m);
+/* Both return -1 on errors, movactl_read 0 on EOF. */
+int movactl_write (struct movactl *m);
+int movactl_read (struct movactl *m);
+
+/* Register with the current libevent base, errors go to the error callback. */
+int movactl_event_attach (struct movactl *m);
+
+/* Send a command to the device, args are encoded as for the code. */
+int movactl_send (struct movactl *m, const char *code, const int *args, int nargs);
+int movactl_set_enabled (struct movactl *m, int enable, const char *server);
+/* Tag the following commands with a trace ID, see movactld -t. */
+int movactl_trace (struct movactl *m, const char *id);
+
+/*
+ * Requests answered with a single reply: QCMD and QSTS with the codes to
+ * check, QMET, QGEN and SYNC.
+ */
+int movactl_query (struct movactl *m, const char *query, const char *arg, size_t arglen,
+		movactl_reply_cb cb, void *cbarg);
+
+/*
+ * Get the status notifications for code. With once only the next one,
+ * which is the current value if known. The daemon sends the current value
+ * on each subscribe, to all subscriptions for the code. Callbacks may
+ * unsubscribe.
+ */
+int movactl_subscribe (struct movactl *m, const char *code, int once, movactl_notify_cb cb, void *cbarg);
+int movactl_unsubscribe (struct movactl *m, const char *code, movactl_notify_cb cb, void *cbarg);
+
+/* Check a QCMD or QSTS reply for code. */
+int movactl_has_capability (const char *caps, const char *code);
+
+/* Encode a request into buf, for callers doing their own I/O. */
+void movactl_encode (struct evbuffer *buf, const char *cmd, const char *arg, size_t arglen);
+void movactl_encode_send (struct evbuffer *buf, const char *code, const int *args, int nargs);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /*LIBMOVACTL_H*/
@@ -0,0 +1,164 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LIBMOVACTL_ASIO_HH
+#define LIBMOVACTL_ASIO_HH
+
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <boost/asio.hpp>
+
+#include <unistd.h>
+
+#include "libmovactl.h"
+
+/*
+ * A libmovactl connection driven by a Boost.Asio io_service. The fd is
+ * watched for readiness only, libmovactl does the reading and writing.
+ * Connection errors go to the error function, which may destroy the
+ * object.
+ */
+class asio_movactl
+{
+public:
+	typedef std::function<void(const std::string &error)> error_fn;
+	typedef std::function<void(const std::string &code, const char *val, size_t len)> notify_fn;
+
+	asio_movactl(boost::asio::io_service &io, int fd, error_fn on_error)
+		: sd(io), m(movactl_new(fd, protocol_error, this)), on_error(std::move(on_error)), alive(new bool(true)),
+		writing(false)
+	{
+		if (!m)
+		{
+			::close(fd);
+			throw std::bad_alloc();
+		}
+		sd.assign(fd);
+		sd.non_blocking(true);
+		start_read();
+	}
+
+	asio_movactl(const asio_movactl &) = delete;
+	asio_movactl &operator = (const asio_movactl &) = delete;
+
+	~asio_movactl()
+	{
+		boost::system::error_code ec;
+
+		sd.cancel(ec);
+		sd.release();
+		movactl_free(m);
+	}
+
+	void send(const std::string &code, const std::vector<int> &args)
+	{
+		movactl_send(m, code.c_str(), args.data(), args.size());
+		flush();
+	}
+
+	void subscribe(const std::string &code, notify_fn fn)
+	{
+		subscriptions.push_back(std::move(fn));
+		movactl_subscribe(m, code.c_str(), 0, notify, &subscriptions.back());
+		flush();
+	}
+
+private:
+	boost::asio::posix::stream_descriptor sd;
+	struct movactl *m;
+	error_fn on_error;
+	std::list<notify_fn> subscriptions;
+	/* Handlers can run after the object is gone, with operation_aborted. */
+	std::shared_ptr<bool> alive;
+	bool writing;
+
+	static void protocol_error(struct movactl *m, const char *error, void *cbarg)
+	{
+		std::cerr << "warn: movactl: " << error << "\n";
+	}
+
+	static void notify(struct movactl *m, const char *code, const char *val, size_t len, void *cbarg)
+	{
+		(*static_cast<notify_fn*>(cbarg))(std::string(code, 4), val, len);
+	}
+
+	void start_read()
+	{
+		std::weak_ptr<bool> token = alive;
+
+		sd.async_read_some(boost::asio::null_buffers(), [this, token](const boost::system::error_code &error, size_t)
+		{
+			if (token.expired())
+				return;
+			if (error)
+			{
+				on_error(error.message());
+				return;
+			}
+
+			int res = movactl_read(m);
+			if (token.expired())
+				return;
+			if (res <= 0)
+			{
+				on_error(res == 0 ? "Connection closed" : strerror(errno));
+				return;
+			}
+			flush();
+			start_read();
+		});
+	}
+
+	void flush()
+	{
+		std::weak_ptr<bool> token = alive;
+
+		if (writing || !movactl_want_write(m))
+			return;
+		writing = true;
+		sd.async_write_some(boost::asio::null_buffers(), [this, token](const boost::system::error_code &error, size_t)
+		{
+			if (token.expired())
+				return;
+			writing = false;
+			if (error || movactl_write(m) < 0)
+			{
+				on_error(error ? error.message() : strerror(errno));
+				return;
+			}
+			flush();
+		});
+	}
+};
+
+#endif /*LIBMOVACTL_ASIO_HH*/
@@ -29,45 +29,190 @@
 #include <unistd.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/ioctl.h>
 #include <sys/uio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 #define TTYDEFCHARS
 #include <sys/ttydefaults.h>
 
-#define MA_SPEED B9600
-#define MA_DATABITS CS8
-#define MA_STOPBITS 1 
-#define MA_PARITY   0
-
-#if MA_STOPBITS == 2
-#define MA_STOPFLAG CSTOPB
-#else
-#define MA_STOPFLAG 0
+#ifdef __linux__
+#include <linux/serial.h>
 #endif
 
 #ifndef O_NOCTTY
 #define O_NOCCTY 0
 #endif
 
+static const struct {
+	int speed;
+	speed_t code;
+} speeds[] = {
+	{ 1200, B1200 },
+	{ 2400, B2400 },
+	{ 4800, B4800 },
+	{ 9600, B9600 },
+	{ 19200, B19200 },
+	{ 38400, B38400 },
+#ifdef B57600
+	{ 57600, B57600 },
+#endif
+#ifdef B115200
+	{ 115200, B115200 },
+#endif
+#ifdef B230400
+	{ 230400, B230400 },
+#endif
+#ifdef B460800
+	{ 460800, B460800 },
+#endif
+#ifdef B921600
+	{ 921600, B921600 },
+#endif
+};
+
+void
+line_profile_default (struct line_profile *profile) {
+	memset (profile, 0, sizeof (*profile));
+	profile->speed = 9600;
+	profile->databits = 8;
+	profile->parity = 'n';
+	profile->stopbits = 1;
+	profile->vmin = 1;
+	profile->vtime = 0;
+	profile->flush = 1;
+}
+
+static int
+speed_code (int speed, speed_t *code) {
+	size_t i;
+
+	for (i = 0 ; i < sizeof (speeds) / sizeof (*speeds) ; i++) {
+		if (speeds[i].speed == speed) {
+			*code = speeds[i].code;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/*
+ * Options are comma separated: a speed, the framing as e.g. 8n1 or 7e2,
+ * rtscts, vmin=n, vtime=n, lowlatency and noflush. Returns -1 with errno
+ * set to EINVAL on a bad option, leaving the profile partly updated.
+ */
 int
-open_line (const char *path, int mode) {
-	int fd = open (path, mode | O_NONBLOCK | O_NOCTTY);
+line_profile_parse (struct line_profile *profile, const char *options) {
+	while (*options) {
+		size_t len = strcspn (options, ",");
+		char opt[32];
+		char *end;
+		speed_t code;
+		long v;
+
+		if (len >= sizeof (opt))
+			goto bad;
+		memcpy (opt, options, len);
+		opt[len] = '\0';
+		options += len;
+		if (*options == ',')
+			options++;
+
+		if (opt[0] >= '0' && opt[0] <= '9' && strlen (opt) > 3) {
+			v = strtol (opt, &end, 10);
+			if (*end || speed_code (v, &code))
+				goto bad;
+			profile->speed = v;
+		} else if (strlen (opt) == 3 && opt[0] >= '5' && opt[0] <= '8'
+				&& strchr ("neoNEO", opt[1]) && (opt[2] == '1' || opt[2] == '2')) {
+			profile->databits = opt[0] - '0';
+			profile->parity = opt[1] | 0x20;
+			profile->stopbits = opt[2] - '0';
+		} else if (strcmp (opt, "rtscts") == 0) {
+			profile->rtscts = 1;
+		} else if (strncmp (opt, "vmin=", 5) == 0 || strncmp (opt, "vtime=", 6) == 0) {
+			v = strtol (strchr (opt, '=') + 1, &end, 10);
+			if (*end || end == strchr (opt, '=') + 1 || v < 0 || v > 255)
+				goto bad;
+			if (opt[1] == 'm')
+				profile->vmin = v;
+			else
+				profile->vtime = v;
+		} else if (strcmp (opt, "lowlatency") == 0) {
+			profile->low_latency = 1;
+		} else if (strcmp (opt, "noflush") == 0) {
+			profile->flush = 0;
+		} else if (opt[0]) {
+			goto bad;
+		}
+	}
+	return 0;
+
+bad:
+	errno = EINVAL;
+	return -1;
+}
+
+/* Best effort, many USB adapters don't have it. */
+static void
+set_low_latency (int fd) {
+#if defined(__linux__) && defined(TIOCSSERIAL)
+	struct serial_struct ss;
+
+	if (ioctl (fd, TIOCGSERIAL, &ss) == 0) {
+		ss.flags |= ASYNC_LOW_LATENCY;
+		ioctl (fd, TIOCSSERIAL, &ss);
+	}
+#endif
+}
+
+int
+open_line (const char *path, int mode, const struct line_profile *profile) {
+	struct line_profile defprofile;
+	int fd;
 	struct termios tattr = {0};
 	struct termios curattr;
+	speed_t speed;
+
+	if (!profile) {
+		line_profile_default (&defprofile);
+		profile = &defprofile;
+	}
+	if (speed_code (profile->speed, &speed)) {
+		errno = EINVAL;
+		return -1;
+	}
 
+	fd = open (path, mode | O_NONBLOCK | O_NOCTTY);
 	if (fd < 0)
 		return -1;
 
 	tattr.c_iflag = IGNBRK;
 	tattr.c_oflag = 0;
-	tattr.c_cflag = MA_DATABITS | MA_STOPFLAG | CREAD | MA_PARITY | CLOCAL;
+	tattr.c_cflag = CREAD | CLOCAL;
+	switch (profile->databits) {
+	case 5: tattr.c_cflag |= CS5; break;
+	case 6: tattr.c_cflag |= CS6; break;
+	case 7: tattr.c_cflag |= CS7; break;
+	default: tattr.c_cflag |= CS8; break;
+	}
+	if (profile->parity == 'e')
+		tattr.c_cflag |= PARENB;
+	else if (profile->parity == 'o')
+		tattr.c_cflag |= PARENB | PARODD;
+	if (profile->stopbits == 2)
+		tattr.c_cflag |= CSTOPB;
+	if (profile->rtscts)
+		tattr.c_cflag |= CRTSCTS;
 	tattr.c_lflag = 0;
 
 	memcpy (tattr.c_cc, ttydefchars, sizeof (ttydefchars));
+	tattr.c_cc[VMIN] = profile->vmin;
+	tattr.c_cc[VTIME] = profile->vtime;
 
-	cfsetispeed(&tattr, MA_SPEED);
-	cfsetospeed(&tattr, MA_SPEED);
+	cfsetispeed(&tattr, speed);
+	cfsetospeed(&tattr, speed);
 
 	if (tcgetattr (fd, &curattr)) {
 		close (fd);
@@ -90,8 +235,12 @@ open_line (const char *path, int mode) {
 		return -1;
 	}
 
+	if (profile->low_latency)
+		set_low_latency (fd);
+
 	/* Write a CR for flushing */
-	write (fd, "\r", 1);
+	if (profile->flush)
+		write (fd, "\r", 1);
 
 	return fd;
 }
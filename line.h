@@ -30,7 +30,26 @@
 extern "C" {
 #endif
 
-int open_line (const char *path, int mode);
+struct line_profile {
+	int speed;
+	int databits;
+	/* 'n', 'e' or 'o'. */
+	char parity;
+	int stopbits;
+	int rtscts;
+	int vmin;
+	/* Tenths of a second. */
+	int vtime;
+	int low_latency;
+	/* Write a CR on open, ending any partial command the device has. */
+	int flush;
+};
+
+void line_profile_default (struct line_profile *profile);
+int line_profile_parse (struct line_profile *profile, const char *options);
+
+/* profile may be NULL for the default, 9600 8N1. */
+int open_line (const char *path, int mode, const struct line_profile *profile);
 
 #ifdef __cplusplus
 }
@@ -23,320 +23,707 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <deque>
 #include <string>
 
 #include <boost/asio.hpp>
 
+#include <glob.h>
+#include <limits.h>
 #include <signal.h>
-#include <sys/wait.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <net/if.h>
+
+#ifdef __linux__
+#include <linux/mii.h>
+#include <linux/sockios.h>
+#endif
 
-#include "spawn.hh"
 #include "smart_fd.hh"
 #include "bos.hh"
+#include "base64.h"
+#include "libmovactl_asio.hh"
+#include "listener_rules.hh"
 
-#include "osx_system_idle.h"
-
-#define STEREO_LINE ":stereo"
-#define TV_LINE ":tv"
+#define DEFAULT_RULES "/usr/local/etc/listener.rules"
 
 using boost::asio::io_service;
 using boost::asio::posix::stream_descriptor;
 using boost::asio::ip::tcp;
 
-void reap(pid_t pid)
+/*
+ * Measures how late a periodic timer runs, which is how long any handler
+ * kept the loop from other events. A warning is printed for each stall,
+ * and SIGUSR1 prints the totals.
+ */
+class loop_lag
 {
-	pid_t r;
-	int status;
+public:
+	static const int interval_ms = 100;
+	static const int stall_ms = 50;
 
-	do
-		r = waitpid(pid, &status, 0);
-	while (r == -1 && errno == EINTR);
+	boost::asio::deadline_timer timer;
+	boost::asio::signal_set usr1;
+	unsigned long ticks;
+	unsigned long stalls;
+	long total_us;
+	long max_us;
+
+	loop_lag(io_service &io)
+		: timer(io), usr1(io, SIGUSR1), ticks(0), stalls(0), total_us(0), max_us(0)
+	{
+		timer.expires_from_now(boost::posix_time::milliseconds(interval_ms));
+		timer.async_wait(std::bind(&loop_lag::tick, this, std::placeholders::_1));
+		usr1.async_wait(std::bind(&loop_lag::report, this, std::placeholders::_1));
+	}
 
-	if (r == -1)
-		throw std::system_error(errno, std::system_category(), "waitpid");
-}
+	void tick(const boost::system::error_code &error)
+	{
+		if (error)
+			return;
 
-smart_fd spawn_movactl(pid_t *pid = NULL)
-{
-	smart_pipe iopipe;
-	extern char **environ;
-        static const char *const args[] = { "movactl", STEREO_LINE, "listen", "volume", "power", "audio_source", NULL};
+		long lag = (boost::asio::deadline_timer::traits_type::now() - timer.expires_at()).total_microseconds();
+		ticks++;
+		total_us += lag;
+		if (lag > max_us)
+			max_us = lag;
+		if (lag > stall_ms * 1000)
+		{
+			stalls++;
+			std::cerr << "warn: loop_lag: Loop stalled for " << lag / 1000 << " ms\n";
+		}
 
-	spawn::file_actions actions;
+		/* From the previous expiry, to not add up the lag. */
+		timer.expires_at(timer.expires_at() + boost::posix_time::milliseconds(interval_ms));
+		if (timer.expires_at() < boost::asio::deadline_timer::traits_type::now())
+			timer.expires_from_now(boost::posix_time::milliseconds(interval_ms));
+		timer.async_wait(std::bind(&loop_lag::tick, this, std::placeholders::_1));
+	}
 
-	actions.add_stdout(iopipe.write);
-	actions.addclose(iopipe.write);
+	void report(const boost::system::error_code &error)
+	{
+		if (error)
+			return;
 
-	int err = posix_spawn(pid, "/usr/local/bin/movactl", actions, NULL, (char**)args, environ);
+		std::cout << "loop_lag: " << ticks << " ticks, mean " << (ticks ? total_us / (long)ticks : 0) << " us, max "
+			<< max_us << " us, " << stalls << " over " << stall_ms << " ms\n";
+		usr1.async_wait(std::bind(&loop_lag::report, this, std::placeholders::_1));
+	}
+};
 
-	if (err)
-		throw std::system_error(err, std::system_category(), "posix_spawn");
+std::string itos(int v)
+{
+	std::ostringstream ss;
 
-	return std::move(iopipe.read);
+	ss << v;
+	return ss.str();
 }
 
-smart_fd spawn_phystatus(const char *idx, pid_t *pid = NULL)
+struct command_info
 {
-	smart_pipe iopipe;
-	extern char **environ;
-	const char *const args[] = { "mii-tool", "-w", "-p", idx, "eth1", NULL };
-	spawn::file_actions actions;
-
-	actions.add_stdout(iopipe.write);
-	actions.addclose(iopipe.write);
-
-	int err = posix_spawn(pid, "/usr/sbin/mii-tool", actions, NULL, (char**)args, environ);
-
-	if (err)
-		throw std::system_error(err, std::system_category(), "posix_spawn");
-
-	return std::move(iopipe.read);
-}
+	const char *code;
+	int nargs;
+};
 
-void movactl_send(const std::vector<std::string> &args)
+/* Command names to codes, the same table movactl completes from. */
+static const std::map<std::string, command_info> &
+command_table()
 {
-	std::vector<const char *> argv;
-	pid_t pid;
+	static std::map<std::string, command_info> table;
 
-	std::cout << "--movactl";
-	argv.push_back("movactl");
-	argv.push_back("--");
-	for (auto &a : args) {
-		std::cout << " " << a;
-		argv.push_back(a.c_str());
+	if (table.empty())
+	{
+#define COMMAND(name, code, nargs) table[#name] = command_info{code, nargs};
+#include "all_commands.h"
+#undef COMMAND
 	}
-	argv.push_back(NULL);
-	std::cout << "\n";
-
-	int err = posix_spawn(&pid, "/usr/local/bin/movactl", NULL, NULL, (char**)&argv[0], NULL);
+	return table;
+}
 
-	if (err)
-		throw std::system_error(err, std::system_category(), "posix_spawn");
+#define ESTART(type) \
+	static std::string notify_ ## type (const char *val, size_t len) \
+	{ \
+		if (len != 4) \
+			return ""; \
+ \
+		int v = debase64_int24(val); \
+		switch (v) {
+#define EV(type, name, val) \
+		case val: \
+			return #name;
+#define EEND(type) \
+		} \
+		std::ostringstream ss; \
+		ss << "unknown:0x" << std::hex << v; \
+		return ss.str(); \
+	}
+#include "status_enums.h"
+#undef ESTART
+#undef EV
+#undef EEND
 
-	reap(pid);
+static std::string
+notify_int(const char *val, size_t len)
+{
+	if (len != 4)
+		return "";
+	return itos(debase64_int24(val));
 }
 
-constexpr unsigned int fnv1a_hash(const char *str)
+static std::string
+notify_string(const char *val, size_t len)
 {
-	return *str ? (fnv1a_hash(str + 1) ^ *str) * 16777619U : 2166136261U;
+	return std::string(val, len);
 }
 
-std::string itos(int v)
+struct notify_info
 {
-	std::ostringstream ss;
+	const char *name;
+	const char *code;
+	std::string (*decode)(const char *val, size_t len);
+};
 
-	ss << v;
-	return ss.str();
+static const notify_info notify_table[] = {
+#define NOTIFY(name, code, type) { #name, code, notify_ ## type },
+#define STATUS(name, code, type) { #name, code, notify_ ## type },
+#include "all_notify.h"
+#undef NOTIFY
+#undef STATUS
+};
+
+/*
+ * Remote daemons are symlinks to host:port, as for movactl_open. Those are
+ * connected from the io_service, movactl_open_remote would block it.
+ */
+static bool
+remote_daemon(const char *path, std::string &host, std::string &port)
+{
+	char dst[PATH_MAX + 1];
+	ssize_t r = readlink(path, dst, PATH_MAX);
+
+	if (r < 0)
+		return false;
+	dst[r] = '\0';
+	if (dst[0] == '.' || strchr(dst, '/'))
+		return false;
+
+	char *cp = strchr(dst, ':');
+	if (!cp)
+		return false;
+	*cp++ = '\0';
+	host = dst;
+	port = cp;
+	return true;
 }
 
-void power_on(const std::string &stereo, const std::string &tv)
+/*
+ * Long lived connection to the daemon of a line, the same lines as the
+ * :tag arguments of movactl. Reconnects when the daemon goes away, and
+ * then subscribes again to the notifications, which are passed to
+ * update_fn like movactl listen prints them, with the name as tag.name.
+ * Local daemons are tried first, then the first remote one.
+ */
+class movactl_line
 {
-	time_t now = time(NULL);
-	struct tm tm = {0};
+public:
+	io_service &io;
+	std::string tag;
+	std::vector<std::string> notifies;
+	std::function<void(io_service&, const std::string&)> update_fn;
+	std::unique_ptr<asio_movactl> conn;
+	boost::asio::deadline_timer timer;
+	tcp::resolver resolver;
+	tcp::resolver::iterator iterator;
+	tcp::socket sock;
 
-	localtime_r(&now, &tm);
+	static std::map<std::string, movactl_line*> lines;
 
-	if (tm.tm_hour >= 1 && tm.tm_hour < 7)
-		return;
+	movactl_line(io_service &io, std::string tag, std::vector<std::string> notifies = {},
+			std::function<void(io_service&, const std::string&)> update_fn = nullptr)
+		: io(io), tag(std::move(tag)), notifies(std::move(notifies)), update_fn(std::move(update_fn)), timer(io),
+		resolver(io), sock(io)
+	{
+		lines[this->tag] = this;
+		connect();
+	}
 
-	movactl_send({STEREO_LINE, "power", "on"});
-	movactl_send({TV_LINE, "power", "on"});
-	movactl_send({STEREO_LINE, "source", "select", stereo});
-	movactl_send({TV_LINE, "source", "select", tv});
-}
+	~movactl_line()
+	{
+		lines.erase(tag);
+	}
 
-static std::string
-default_volume()
-{
-	time_t now = time(NULL);
-	struct tm tm = {0};
+	void connect()
+	{
+		std::string pattern = "/var/run/movactl." + tag + "*.sock";
+		std::string host, port;
+		glob_t g;
+		int fd = -1;
 
-	localtime_r(&now, &tm);
+		if (glob(pattern.c_str(), 0, NULL, &g) == 0)
+		{
+			for (size_t i = 0 ; i < g.gl_pathc && fd < 0 ; i++)
+			{
+				std::string h, p;
 
-	if (tm.tm_hour >= 7 && tm.tm_hour < 20)
-		return "-37";
-	return "-47";
-}
+				if (remote_daemon(g.gl_pathv[i], h, p))
+				{
+					if (host.empty())
+					{
+						host = h;
+						port = p;
+					}
+					continue;
+				}
+				fd = movactl_open_local(g.gl_pathv[i]);
+			}
+			globfree(&g);
+		}
+		if (fd >= 0)
+		{
+			attach(fd);
+			return;
+		}
+		if (!host.empty())
+		{
+			resolver.async_resolve(tcp::resolver::query(host, port),
+					std::bind(&movactl_line::resolved, this, std::placeholders::_1, std::placeholders::_2));
+			return;
+		}
+		std::cerr << "warn: movactl_line(" << tag << "): No daemon\n";
+		retry();
+	}
 
-void switch_from(const std::string &from, const std::map<std::string, std::string> &values)
-{
-	auto it = values.find("audio_source");
-	if (it == values.end())
+	void resolved(const boost::system::error_code &error, tcp::resolver::iterator it)
 	{
-		std::cerr << "switch_from(" << from << "): No audio source\n";
-		return;
+		if (error)
+		{
+			failed(error.message());
+			return;
+		}
+		iterator = it;
+		connect_next();
 	}
-	if (it->second != from)
+
+	void connect_next()
 	{
-		std::cerr << "switch_from(" << from << "): audio_source == " << it->second << "\n";
-		return;
+		if (iterator == tcp::resolver::iterator())
+		{
+			failed("No remote daemon");
+			return;
+		}
+		sock.async_connect(*iterator++, std::bind(&movactl_line::connected, this, std::placeholders::_1));
 	}
 
-	it = values.find("playstation");
-	if (it != values.end() && it->second == "really_up")
+	void connected(const boost::system::error_code &error)
 	{
-		movactl_send({STEREO_LINE, "source", "select", "vcr1"});
-		movactl_send({TV_LINE, "source", "select", "hdmi3"});
-		return;
+		boost::system::error_code ec;
+
+		if (error)
+		{
+			sock.close(ec);
+			connect_next();
+			return;
+		}
+
+		/* asio_movactl takes a plain descriptor. */
+		int fd = dup(sock.native_handle());
+		sock.close(ec);
+		if (fd < 0)
+		{
+			failed(strerror(errno));
+			return;
+		}
+		attach(fd);
 	}
 
-	it = values.find("old_psx");
-	if (it != values.end() && it->second == "up")
+	void attach(int fd)
 	{
-		movactl_send({STEREO_LINE, "source", "select", "aux1"});
-		movactl_send({TV_LINE, "source", "select", "hdmi1"});
-		return;
+		std::cout << "movactl_line(" << tag << "): Connected\n";
+		conn.reset(new asio_movactl(io, fd, std::bind(&movactl_line::failed, this, std::placeholders::_1)));
+		for (auto &n : notifies)
+		{
+			for (auto &nt : notify_table)
+			{
+				if (n != nt.name)
+					continue;
+				const notify_info *info = &nt;
+				conn->subscribe(nt.code, [this, info](const std::string &code, const char *val, size_t len)
+				{
+					update_fn(io, tag + "." + info->name + " " + info->decode(val, len));
+				});
+			}
+		}
 	}
 
-	it = values.find("wii");
-	if (it != values.end() && it->second == "on")
+	void failed(const std::string &error)
 	{
-		movactl_send({STEREO_LINE, "source", "select", "dss"});
-		movactl_send({TV_LINE, "source", "select", "hdmi1"});
-		return;
+		std::cerr << "warn: movactl_line(" << tag << "): " << error << "\n";
+		conn.reset();
+		retry();
 	}
 
-	it = values.find("tv");
-	if (it != values.end() && it->second == "on")
+	void retry()
 	{
-		movactl_send({STEREO_LINE, "source", "select", "tv"});
-		movactl_send({TV_LINE, "source", "select", "hdmi1"});
-		return;
+		timer.expires_from_now(boost::posix_time::seconds(3));
+		timer.async_wait([this](const boost::system::error_code &error)
+		{
+			if (!error)
+				connect();
+		});
 	}
 
-#ifdef IDLE
-	struct timespec idle;
-	if (IDLE(&idle) == 0 && idle.tv_sec <= 600)
+	/* Words as given to movactl, except that names are not completed. */
+	bool send(const std::vector<std::string> &words)
 	{
-		movactl_send({STEREO_LINE, "source", "select", "dvd"});
-		movactl_send({TV_LINE, "source", "select", "hdmi1"});
-		return;
+		auto &table = command_table();
+		std::string name;
+
+		for (size_t n = words.size() ; n > 0 ; n--)
+		{
+			name = words[0];
+			for (size_t i = 1 ; i < n ; i++)
+				name += "_" + words[i];
+
+			auto it = table.find(name);
+			if (it == table.end() || words.size() - n != (size_t)it->second.nargs)
+				continue;
+
+			std::vector<int> args;
+			for (size_t i = n ; i < words.size() ; i++)
+				args.push_back(atoi(words[i].c_str()));
+
+			if (!conn)
+			{
+				std::cerr << "warn: movactl_line(" << tag << "): Not connected, dropping " << name << "\n";
+				return false;
+			}
+			conn->send(it->second.code, args);
+			return true;
+		}
+		std::cerr << "warn: movactl_line(" << tag << "): No such command: " << name << "\n";
+		return false;
 	}
-#endif
+};
+
+std::map<std::string, movactl_line*> movactl_line::lines;
 
-	movactl_send({STEREO_LINE, "power", "off"});
+bool line_send(const std::string &tag, const std::vector<std::string> &words)
+{
+	std::cout << "--movactl :" << tag;
+	for (auto &w : words)
+		std::cout << " " << w;
+	std::cout << "\n";
+
+	auto it = movactl_line::lines.find(tag);
+	if (it == movactl_line::lines.end())
+	{
+		std::cerr << "warn: line_send: Unknown line " << tag << "\n";
+		return false;
+	}
+	return it->second->send(words);
 }
 
-/* Ugly to use global, but will have to do for now. */
-static std::unique_ptr<tcp::socket> playstation_check_socket;
-static void check_playstation_really_up(io_service &io);
+static listener_rules rules;
 
 void update(io_service &io, const std::string &line)
 {
 	std::string stat, value;
-	static std::map<std::string, std::string> values;
 
 	std::cout << "update: " << line << "\n";
 
 	std::istringstream(line) >> stat >> value;
+	rules.event(stat, value);
+}
 
-	if (value == "negotiating")
-		return;
+/*
+ * Runs the commands sent for an event as a scene. Each line runs its steps
+ * in order, and a step with a confirmation waits for the value, or for
+ * step_timeout, before the next one is sent. The lines run side by side.
+ * Scenes with confirmations or failed sends are reported with the time of
+ * each step.
+ */
+class scene_runner
+{
+public:
+	static const int step_timeout = 10;
+	static const long unconfirmed = -1;
+	static const long send_failed = -2;
 
-	auto elem = values.insert(make_pair(stat, value));
-	if (!elem.second && elem.first->second == value)
+	struct scene
+	{
+		std::string name;
+		boost::posix_time::ptime start;
+		std::vector<listener_rules::step> steps;
+		std::vector<boost::posix_time::ptime> sent;
+		/* unconfirmed or send_failed when not confirmed. */
+		std::vector<long> ms;
+		size_t left;
+		/* Reported when done. */
+		bool confirmed;
+	};
+
+	struct line_queue
+	{
+		std::deque<std::pair<std::shared_ptr<scene>, size_t>> steps;
+		boost::asio::deadline_timer timer;
+		bool waiting;
+
+		line_queue(io_service &io)
+			: timer(io), waiting(false)
+		{
+		}
+	};
+
+	io_service &io;
+	std::map<std::string, std::unique_ptr<line_queue>> lines;
+
+	scene_runner(io_service &io)
+		: io(io)
 	{
-		std::cerr << "Not updating " << elem.first->first << ", " << value << " == " << elem.first->second << "\n";
-		return;
 	}
-	elem.first->second = value;
 
-	switch(fnv1a_hash(stat.c_str()))
+	static boost::posix_time::ptime now()
 	{
-	case fnv1a_hash("volume"):
-		movactl_send({TV_LINE, "volume", "value", itos(atoi(value.c_str()) + 72)});
-		break;
-	case fnv1a_hash("power"):
-		if (value == "off")
-			movactl_send({TV_LINE, "power", value});
-		break;
-	case fnv1a_hash("audio_source"):
-		switch(fnv1a_hash(value.c_str()))
+		return boost::asio::deadline_timer::traits_type::now();
+	}
+
+	void run(const std::string &name, std::vector<listener_rules::step> &&steps)
+	{
+		std::shared_ptr<scene> sc = std::make_shared<scene>();
+
+		sc->name = name;
+		sc->start = now();
+		sc->steps = std::move(steps);
+		sc->sent.resize(sc->steps.size());
+		sc->ms.assign(sc->steps.size(), unconfirmed);
+		sc->left = sc->steps.size();
+		sc->confirmed = false;
+
+		for (size_t i = 0 ; i < sc->steps.size() ; i++)
 		{
-		case fnv1a_hash("tv"):
-			movactl_send({STEREO_LINE, "volume", "value", default_volume()});
-			break;
-		case fnv1a_hash("dvd"):
-		case fnv1a_hash("vcr1"):
-			movactl_send({STEREO_LINE, "volume", "value", default_volume()});
-			break;
-		case fnv1a_hash("dss"):
-			movactl_send({STEREO_LINE, "volume", "value", default_volume()});
-			break;
+			auto &q = lines[sc->steps[i].line];
+			if (!q)
+				q.reset(new line_queue(io));
+			q->steps.push_back(std::make_pair(sc, i));
+			if (sc->steps[i].input >= 0)
+				sc->confirmed = true;
 		}
-		break;
-	case fnv1a_hash("playstation"):
-		if (value == "up")
-			check_playstation_really_up(io);
-		else if (value == "really_up")
-			power_on("vcr1", "hdmi3");
-		else
+		for (auto &q : lines)
+			next(*q.second);
+	}
+
+	/* Sends from the front of the queue up to a step to wait for. */
+	void next(line_queue &q)
+	{
+		while (!q.waiting && !q.steps.empty())
+		{
+			scene &sc = *q.steps.front().first;
+			size_t i = q.steps.front().second;
+			const listener_rules::step &st = sc.steps[i];
+
+			sc.sent[i] = now();
+			if (!line_send(st.line, st.words))
+			{
+				sc.ms[i] = send_failed;
+				sc.confirmed = true;
+				done(q, false);
+				continue;
+			}
+			if (st.input >= 0 && rules.value(st.input) != st.value)
+			{
+				q.waiting = true;
+				q.timer.expires_from_now(boost::posix_time::seconds(step_timeout));
+				q.timer.async_wait(std::bind(&scene_runner::timeout, this, std::ref(q), q.steps.front().first, i,
+							std::placeholders::_1));
+				return;
+			}
+			done(q, st.input >= 0 && rules.value(st.input) == st.value);
+		}
+	}
+
+	void done(line_queue &q, bool ok)
+	{
+		std::shared_ptr<scene> sc = q.steps.front().first;
+		size_t i = q.steps.front().second;
+
+		q.steps.pop_front();
+		q.waiting = false;
+		if (ok)
+			sc->ms[i] = (now() - sc->sent[i]).total_milliseconds();
+		if (--sc->left == 0 && sc->confirmed)
+			report(*sc);
+	}
+
+	void timeout(line_queue &q, const std::shared_ptr<scene> &sc, size_t i, const boost::system::error_code &error)
+	{
+		if (error || !q.waiting || q.steps.front().first != sc || q.steps.front().second != i)
+			return;
+
+		done(q, false);
+		next(q);
+	}
+
+	void changed(int input)
+	{
+		for (auto &l : lines)
 		{
-			playstation_check_socket.reset();
-			switch_from("vcr1", values);
+			line_queue &q = *l.second;
+
+			if (!q.waiting)
+				continue;
+
+			const listener_rules::step &st = q.steps.front().first->steps[q.steps.front().second];
+			if (st.input != input || rules.value(input) != st.value)
+				continue;
+
+			q.timer.cancel();
+			done(q, true);
+			next(q);
 		}
-		break;
-	case fnv1a_hash("old_psx"):
-		if (value == "up")
+	}
+
+	void report(const scene &sc)
+	{
+		std::cout << "scene(" << sc.name << "): " << (now() - sc.start).total_milliseconds() << " ms";
+		for (size_t i = 0 ; i < sc.steps.size() ; i++)
 		{
-			power_on("aux1", "hdmi1");
-			movactl_send({STEREO_LINE, "source", "select", "dss"});
-			movactl_send({STEREO_LINE, "source", "select", "aux1"});
+			std::cout << (i ? ", " : ": ") << sc.steps[i].line;
+			for (auto &w : sc.steps[i].words)
+				std::cout << " " << w;
+			if (sc.ms[i] == send_failed)
+				std::cout << " failed";
+			else if (sc.steps[i].input < 0)
+				continue;
+			else if (sc.ms[i] == unconfirmed)
+				std::cout << " unconfirmed";
+			else
+				std::cout << " " << sc.ms[i] << " ms";
 		}
-		else
-			switch_from("aux1", values);
-		break;
-	case fnv1a_hash("tv"):
-		if (value == "on")
-			power_on("tv", "hdmi1");
-		else
-			switch_from("tv", values);
-		break;
-	case fnv1a_hash("wii"):
-		if (value == "on")
-			power_on("dss", "hdmi1");
-		else
-			switch_from("dss", values);
-		break;
-	case fnv1a_hash("airplay"):
-		if (value == "on")
-			power_on("dvd", "hdmi2");
-		else
-			switch_from("dvd", values);
-		break;
+		std::cout << "\n";
 	}
-}
+};
 
-static void
-check_playstation_really_up_handler(int cntr, const boost::system::error_code& error)
+const int scene_runner::step_timeout;
+const long scene_runner::unconfirmed;
+const long scene_runner::send_failed;
+
+/*
+ * Connection attempts for the probe rule action, by the input they set.
+ * Retried every 2 seconds, 15 times, while refused or unreachable. The
+ * connection is kept until the probe is replaced or cancelled.
+ */
+class tcp_probes
 {
-	std::cout << "check_playstation_really_up_handler: " << error << "\n";
+public:
+	struct probe_state
+	{
+		tcp::socket sock;
+		boost::asio::deadline_timer timer;
+		tcp::endpoint endpoint;
+		std::string value;
+		int cntr;
+
+		probe_state(io_service &io, tcp::endpoint endpoint, std::string value)
+			: sock(io), timer(io), endpoint(std::move(endpoint)), value(std::move(value)), cntr(0)
+		{
+		}
+	};
 
-	if (!error) {
-		update(playstation_check_socket->get_io_service(), "playstation really_up");
-		return;
+	io_service &io;
+	std::map<std::string, std::unique_ptr<probe_state>> probes;
+
+	tcp_probes(io_service &io)
+		: io(io)
+	{
 	}
 
-	static const boost::system::error_code econnrefused(ECONNREFUSED, boost::system::system_category());
-	static const boost::system::error_code ehostunreach(EHOSTUNREACH, boost::system::system_category());
-	static const boost::system::error_code ehostdown(EHOSTDOWN, boost::system::system_category());
-	if (error != econnrefused && error != ehostunreach && error != ehostdown)
-		return;
+	void probe(const std::string &address, const std::string &port, const std::string &input, const std::string &value)
+	{
+		boost::system::error_code ec;
+		tcp::endpoint endpoint(boost::asio::ip::address::from_string(address, ec), atoi(port.c_str()));
+
+		if (ec)
+		{
+			std::cerr << "warn: tcp_probes(" << input << "): " << address << ": " << ec.message() << "\n";
+			return;
+		}
 
-	if (cntr < 15) {
-		sleep(2); /* Blocking ftw */
-		playstation_check_socket->close();
-		tcp::endpoint endpoint(boost::asio::ip::address::from_string("192.168.2.185"), 9295);
-		playstation_check_socket->async_connect(endpoint, std::bind(check_playstation_really_up_handler, cntr + 1, std::placeholders::_1));
+		auto &p = probes[input];
+		p.reset(new probe_state(io, endpoint, value));
+		attempt(p.get(), input);
 	}
-}
+
+	void unprobe(const std::string &input)
+	{
+		probes.erase(input);
+	}
+
+	/* Handlers can still be queued for a probe that was replaced or cancelled. */
+	bool current(probe_state *p, const std::string &input)
+	{
+		auto it = probes.find(input);
+
+		return it != probes.end() && it->second.get() == p;
+	}
+
+	void attempt(probe_state *p, const std::string &input)
+	{
+		p->sock.async_connect(p->endpoint, std::bind(&tcp_probes::connected, this, p, input, std::placeholders::_1));
+	}
+
+	void retry(probe_state *p, const std::string &input, const boost::system::error_code &error)
+	{
+		if (error || !current(p, input))
+			return;
+
+		p->sock.close();
+		attempt(p, input);
+	}
+
+	void connected(probe_state *p, const std::string &input, const boost::system::error_code &error)
+	{
+		if (!current(p, input))
+			return;
+
+		std::cout << "tcp_probes(" << input << "): " << error << "\n";
+
+		if (!error) {
+			rules.event(input, p->value);
+			return;
+		}
+
+		static const boost::system::error_code econnrefused(ECONNREFUSED, boost::system::system_category());
+		static const boost::system::error_code ehostunreach(EHOSTUNREACH, boost::system::system_category());
+		static const boost::system::error_code ehostdown(EHOSTDOWN, boost::system::system_category());
+		if (error != econnrefused && error != ehostunreach && error != ehostdown)
+			return;
+
+		if (p->cntr++ < 15) {
+			p->timer.expires_from_now(boost::posix_time::seconds(2));
+			p->timer.async_wait(std::bind(&tcp_probes::retry, this, p, input, std::placeholders::_1));
+		}
+	}
+};
 
 static void
-check_playstation_really_up(io_service &io)
+reload_rules(boost::asio::signal_set &hup, const std::string &path, const boost::system::error_code &error)
 {
-	playstation_check_socket.reset(new tcp::socket(io));
-	tcp::endpoint endpoint(boost::asio::ip::address::from_string("192.168.2.185"), 9295);
-	playstation_check_socket->async_connect(endpoint, std::bind(check_playstation_really_up_handler, 0, std::placeholders::_1));
+	if (error)
+		return;
+
+	try
+	{
+		rules.load(path);
+		std::cout << "Reloaded " << path << "\n";
+	}
+	catch (std::runtime_error &e)
+	{
+		std::cerr << "warn: " << e.what() << ", keeping the old rules\n";
+	}
+	hup.async_wait(std::bind(reload_rules, std::ref(hup), path, std::placeholders::_1));
 }
 
 template <typename T>
@@ -437,13 +824,18 @@ public:
 		object.async_connect(*iterator++, std::bind(&tcp_input::connect_done, this, std::placeholders::_1));
 	}
 
+	void resolved(const boost::system::error_code &error, tcp::resolver::iterator it)
+	{
+		iterator = it;
+		connect_next(error);
+	}
+
 	void connect()
 	{
 		boost::system::error_code ec;
 		object.cancel(ec);
-		iterator = resolver.resolve(query, ec);
-
-		connect_next(ec);
+		iterator = tcp::resolver::iterator();
+		resolver.async_resolve(query, std::bind(&tcp_input::resolved, this, std::placeholders::_1, std::placeholders::_2));
 	}
 
 	virtual void handle(const boost::system::error_code &error, std::size_t bytes)
@@ -461,64 +853,117 @@ public:
 	}
 };
 
+/*
+ * Link state of a PHY on the MDIO bus of an interface, read with the MII
+ * ioctls like mii-tool -p does. Polled every 100 ms, since the kernel has
+ * no link events for a single PHY, and update_fn gets "ewhat up" or
+ * "ewhat down" for the first reading and then for each change. A change
+ * is only reported once settle_polls readings in a row agree, so a PHY
+ * bouncing while it renegotiates doesn't run the rules for each bounce.
+ * A PHY that can't be read counts as down.
+ */
 class phy_input
 {
 public:
-	std::string phy_idx;
+	static const int poll_ms = 100;
+	static const int settle_polls = 3;
+
+	std::string ewhat;
+	std::string ifname;
+	int phy_id;
 	boost::asio::deadline_timer timer;
-	std::function<void(io_service&, const std::string&)> real_update_fn;
-	pid_t pid;
-	smart_fd fd;
-	input<stream_descriptor> sinput;
+	std::function<void(io_service&, const std::string&)> update_fn;
+	smart_fd sock;
+	int state;
+	/* Consecutive readings that differ from state. */
+	int changed_polls;
+	int last_errno;
 
 	phy_input(std::string ewhat, std::function<void(io_service&, const std::string&)> update_fn, io_service &io,
-			std::string idx)
-		: phy_idx(std::move(idx)),
+			int phy_id, std::string ifname = "eth1")
+		: ewhat(std::move(ewhat)),
+		ifname(std::move(ifname)),
+		phy_id(phy_id),
 		timer(io),
-		real_update_fn(std::move(update_fn)),
-		fd(spawn_phystatus(phy_idx.c_str(), &pid)),
-		sinput(std::move(ewhat), std::bind(&phy_input::phy_update, this, std::placeholders::_1, std::placeholders::_2), io, fd)
+		update_fn(std::move(update_fn)),
+		sock(socket(AF_INET, SOCK_DGRAM, 0)),
+		state(-1),
+		changed_polls(0),
+		last_errno(0)
 	{
-		fd.release();
+		if (!sock)
+			throw std::system_error(errno, std::system_category(), "socket");
+		poll(boost::system::error_code());
 	}
 
-	~phy_input()
+	/* 1 if up, 0 if down, -1 with errno set on error. */
+	int link_up()
 	{
-		kill(pid, SIGTERM);
-		reap(pid);
+#ifdef __linux__
+		struct ifreq ifr;
+		struct mii_ioctl_data *mii = (struct mii_ioctl_data*)&ifr.ifr_data;
+
+		memset(&ifr, 0, sizeof(ifr));
+		strncpy(ifr.ifr_name, ifname.c_str(), IFNAMSIZ - 1);
+		mii->phy_id = phy_id;
+		mii->reg_num = MII_BMSR;
+
+		/* The link status bit latches low, the second read is the current state. */
+		if (ioctl(sock, SIOCGMIIREG, &ifr) || ioctl(sock, SIOCGMIIREG, &ifr))
+			return -1;
+		return (mii->val_out & BMSR_LSTATUS) != 0;
+#else
+		errno = ENOTSUP;
+		return -1;
+#endif
 	}
 
-	void phy_update_timeout(const std::string &line, const boost::system::error_code &error)
+	void poll(const boost::system::error_code &error)
 	{
 		if (error)
-		{
-			std::cerr << "phy_update_timeout: skipping " << line << " (" << error << ")\n";
 			return;
-		}
-		std::string v;
 
-		if (line.find("no link") == std::string::npos)
-			v = "up";
+		int up = link_up();
+		if (up < 0)
+		{
+			if (errno != last_errno)
+				std::cerr << "warn: phy_input(" << ewhat << "): " << ifname << ": " << strerror(errno) << "\n";
+			last_errno = errno;
+			up = 0;
+		}
 		else
-			v = "down";
-		real_update_fn(timer.get_io_service(), sinput.ewhat + " " + v);
-	}
+			last_errno = 0;
 
-	void phy_update(io_service &io, const std::string &line)
-	{
-		timer.expires_from_now(boost::posix_time::seconds(3));
-		timer.async_wait(std::bind(&phy_input::phy_update_timeout, this, std::string(line), std::placeholders::_1));
-	}
+		if (up == state)
+			changed_polls = 0;
+		else if (state < 0 || ++changed_polls >= settle_polls)
+		{
+			state = up;
+			changed_polls = 0;
+			update_fn(timer.get_io_service(), ewhat + (up ? " up" : " down"));
+		}
 
-	void activate(void)
-	{
-		sinput.activate();
+		timer.expires_from_now(boost::posix_time::milliseconds(poll_ms));
+		timer.async_wait(std::bind(&phy_input::poll, this, std::placeholders::_1));
 	}
 };
 
 int
-main()
+main(int argc, char *argv[])
 {
+	std::string rules_path = argc > 1 ? argv[1] : DEFAULT_RULES;
+
+	/* Fail before bos so that bad rules don't respawn. */
+	try
+	{
+		rules.load(rules_path);
+	}
+	catch (std::runtime_error &e)
+	{
+		std::cerr << "err: " << e.what() << "\n";
+		return 1;
+	}
+
 	bos();
 
 	tcp::resolver::query apquery("vardagsrum", "7120");
@@ -526,15 +971,27 @@ main()
 	{
 		while (1)
 		{
-			pid_t movapid;
-			smart_fd movafd = spawn_movactl(&movapid);
-
 			io_service io;
-			input<stream_descriptor> movainput("movactl", update, io, movafd);
-			movafd.release();
+			movactl_line stereo(io, "stereo", {"volume", "power", "audio_source"}, update);
+			movactl_line tv(io, "tv", {"power", "source"}, update);
+
+			scene_runner scenes(io);
+			rules.scene = std::bind(&scene_runner::run, &scenes, std::placeholders::_1, std::placeholders::_2);
+			rules.changed = std::bind(&scene_runner::changed, &scenes, std::placeholders::_1);
 
-			phy_input psxinput("playstation", update, io, "1");
-			phy_input psx_old_input("old_psx", update, io, "2");
+			tcp_probes probes(io);
+			rules.probe = std::bind(&tcp_probes::probe, &probes, std::placeholders::_1, std::placeholders::_2,
+					std::placeholders::_3, std::placeholders::_4);
+			rules.unprobe = std::bind(&tcp_probes::unprobe, &probes, std::placeholders::_1);
+
+			loop_lag lag(io);
+
+			/* Rules are reloaded without touching the lines and inputs. */
+			boost::asio::signal_set hup(io, SIGHUP);
+			hup.async_wait(std::bind(reload_rules, std::ref(hup), rules_path, std::placeholders::_1));
+
+			phy_input psxinput("playstation", update, io, 1);
+			phy_input psx_old_input("old_psx", update, io, 2);
 
 			input<boost::asio::serial_port> wiitvinput("wii/tv", update, io, "/dev/ttyACM0");
 			wiitvinput.object.set_option(boost::asio::serial_port_base::baud_rate(9600));
@@ -546,9 +1003,6 @@ main()
 			{
 				while (1)
 				{
-					movainput.activate();
-					psxinput.activate();
-					psx_old_input.activate();
 					wiitvinput.activate();
 					apinput.activate();
 
@@ -560,9 +1014,6 @@ main()
 			{
 				std::cerr << "err: " << e.what() << "\n";
 			}
-
-			kill(movapid, SIGTERM);
-			reap(movapid);
 		}
 	}
 	catch (std::exception &e)
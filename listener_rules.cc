@@ -0,0 +1,620 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "listener_rules.hh"
+
+#include <cstdlib>
+#include <ctime>
+#include <fstream>
+#include <iostream>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <utility>
+
+#include "osx_system_idle.h"
+
+namespace
+{
+	/* Call arguments and the event value are only known when run. */
+	struct operand
+	{
+		enum kind_t { LITERAL, VALUE, ARG } kind;
+		std::string text;
+		int sym;
+		int arg;
+		bool arith;
+		int add;
+	};
+
+	struct condition
+	{
+		enum op_t { EQ, NE, HOUR, IDLE_LE, IDLE_GT } op;
+		int input;
+		operand value;
+		int from, to;
+	};
+
+	struct action
+	{
+		enum op_t { SEND, SET, CALL, PROBE, UNPROBE, LOG, STOP } op;
+		std::vector<operand> words;
+		/* SEND until, input -1 if none. */
+		condition until;
+	};
+
+	struct rule
+	{
+		int input;
+		/* -1 for any value. */
+		int value;
+		bool negate;
+		std::vector<condition> conditions;
+		std::vector<action> actions;
+	};
+
+	const int max_depth = 8;
+}
+
+struct listener_rules::ruleset
+{
+	struct input_table
+	{
+		std::unordered_map<int, std::vector<const rule*>> by_value;
+		/* Values not in by_value. */
+		std::vector<const rule*> any;
+	};
+
+	std::vector<rule> rules;
+	/* By input symbol. */
+	std::vector<input_table> inputs;
+	/* Input symbol or -1, and value symbol. */
+	std::set<std::pair<int, int>> ignored;
+
+	void compile(size_t nsymbols);
+};
+
+struct listener_rules::frame
+{
+	int value;
+	const std::string &value_text;
+	std::vector<std::string> args;
+};
+
+/*
+ * Each rule goes to the lists of all values it matches, so the lists keep
+ * the file order and running an event is a single lookup.
+ */
+void
+listener_rules::ruleset::compile(size_t nsymbols)
+{
+	inputs.assign(nsymbols, input_table());
+
+	for (auto &r : rules)
+	{
+		if (r.value >= 0)
+			inputs[r.input].by_value[r.value];
+	}
+
+	for (auto &r : rules)
+	{
+		input_table &t = inputs[r.input];
+
+		if (r.value >= 0 && !r.negate)
+		{
+			t.by_value[r.value].push_back(&r);
+			continue;
+		}
+		t.any.push_back(&r);
+		for (auto &v : t.by_value)
+		{
+			if (!r.negate || v.first != r.value)
+				v.second.push_back(&r);
+		}
+	}
+}
+
+class rules_parser
+{
+public:
+	listener_rules &lr;
+	const std::string &path;
+	int lineno;
+
+	rules_parser(listener_rules &lr, const std::string &path)
+		: lr(lr), path(path), lineno(0)
+	{
+	}
+
+	[[noreturn]] void fail(const std::string &msg)
+	{
+		std::ostringstream ss;
+
+		ss << path << ":" << lineno << ": " << msg;
+		throw std::runtime_error(ss.str());
+	}
+
+	operand parse_operand(const std::string &word)
+	{
+		operand o = { operand::LITERAL, word, -1, 0, false, 0 };
+		size_t pos;
+
+		if (word.empty() || word[0] != '$')
+		{
+			o.sym = lr.intern(word);
+			return o;
+		}
+
+		if (word.compare(1, 5, "value") == 0)
+		{
+			o.kind = operand::VALUE;
+			pos = 6;
+		}
+		else if (word.size() >= 2 && word[1] >= '1' && word[1] <= '9')
+		{
+			o.kind = operand::ARG;
+			o.arg = word[1] - '0';
+			pos = 2;
+		}
+		else
+			fail("Unknown variable " + word);
+
+		if (pos < word.size())
+		{
+			char *end;
+
+			if (word[pos] != '+' && word[pos] != '-')
+				fail("Bad arithmetic in " + word);
+			o.arith = true;
+			o.add = strtol(word.c_str() + pos, &end, 10);
+			if (*end || end == word.c_str() + pos + 1)
+				fail("Bad arithmetic in " + word);
+		}
+		return o;
+	}
+
+	int parse_number(const std::string &word)
+	{
+		char *end;
+		long v = strtol(word.c_str(), &end, 10);
+
+		if (word.empty() || *end || v < 0)
+			fail("Bad number " + word);
+		return v;
+	}
+
+	condition parse_condition(const std::string &word)
+	{
+		condition c = { condition::EQ, -1, operand(), 0, 0 };
+		size_t pos;
+		size_t oplen = 1;
+
+		if ((pos = word.find("!=")) != std::string::npos)
+		{
+			c.op = condition::NE;
+			oplen = 2;
+		}
+		else if ((pos = word.find("<=")) != std::string::npos)
+		{
+			c.op = condition::IDLE_LE;
+			oplen = 2;
+		}
+		else if ((pos = word.find('>')) != std::string::npos)
+			c.op = condition::IDLE_GT;
+		else if ((pos = word.find('=')) == std::string::npos)
+			fail("Bad condition " + word);
+
+		std::string name = word.substr(0, pos);
+		std::string value = word.substr(pos + oplen);
+
+		if (c.op == condition::IDLE_LE || c.op == condition::IDLE_GT)
+		{
+			if (name != "idle")
+				fail("Only idle can be compared, not " + name);
+			c.from = parse_number(value);
+			return c;
+		}
+		if (name == "hour")
+		{
+			size_t dash = value.find('-');
+
+			if (c.op != condition::EQ || dash == std::string::npos)
+				fail("Bad hour range " + word);
+			c.op = condition::HOUR;
+			c.from = parse_number(value.substr(0, dash));
+			c.to = parse_number(value.substr(dash + 1));
+			if (c.from > 24 || c.to > 24)
+				fail("Bad hour range " + word);
+			return c;
+		}
+		if (name.empty())
+			fail("Bad condition " + word);
+		c.input = lr.intern(name);
+		c.value = parse_operand(value);
+		return c;
+	}
+
+	action parse_action(const std::vector<std::string> &words)
+	{
+		static const struct
+		{
+			const char *name;
+			action::op_t op;
+			size_t min, max;
+		} ops[] = {
+			{ "send", action::SEND, 2, 64 },
+			{ "set", action::SET, 2, 2 },
+			{ "call", action::CALL, 1, 10 },
+			{ "probe", action::PROBE, 4, 4 },
+			{ "unprobe", action::UNPROBE, 1, 1 },
+			{ "log", action::LOG, 0, 64 },
+			{ "stop", action::STOP, 0, 0 },
+		};
+		action a;
+		size_t n = words.size();
+
+		if (words.empty())
+			fail("Empty action");
+
+		a.until.input = -1;
+		if (words[0] == "send" && n >= 2 && words[n - 2] == "until")
+		{
+			a.until = parse_condition(words[n - 1]);
+			if (a.until.op != condition::EQ)
+				fail("until takes input=value");
+			n -= 2;
+		}
+
+		for (auto &o : ops)
+		{
+			if (words[0] != o.name)
+				continue;
+			if (n - 1 < o.min || n - 1 > o.max)
+				fail("Wrong number of arguments to " + words[0]);
+			a.op = o.op;
+			for (size_t i = 1 ; i < n ; i++)
+				a.words.push_back(parse_operand(words[i]));
+			return a;
+		}
+		fail("Unknown action " + words[0]);
+	}
+
+	void parse_line(listener_rules::ruleset &rs, std::string line)
+	{
+		size_t pos = line.find('#');
+		if (pos != std::string::npos)
+			line.erase(pos);
+		for (pos = 0 ; (pos = line.find(';', pos)) != std::string::npos ; pos += 3)
+			line.replace(pos, 1, " ; ");
+
+		std::istringstream ss(line);
+		std::vector<std::string> words;
+		std::string w;
+		while (ss >> w)
+			words.push_back(w);
+		if (words.empty())
+			return;
+
+		if (words[0] == "ignore")
+		{
+			if (words.size() != 3)
+				fail("ignore takes an input and a value");
+			rs.ignored.insert(std::make_pair(words[1] == "*" ? -1 : lr.intern(words[1]), lr.intern(words[2])));
+			return;
+		}
+
+		if (words.size() < 4 || words[0] == "*")
+			fail("Expected input value [condition ...] -> action");
+
+		rule r;
+		r.input = lr.intern(words[0]);
+		r.negate = words[1][0] == '!';
+		if (words[1] == "!")
+			fail("Missing value after !");
+		if (words[1] == "*")
+			r.value = -1;
+		else
+			r.value = lr.intern(r.negate ? words[1].substr(1) : words[1]);
+
+		size_t i;
+		for (i = 2 ; i < words.size() && words[i] != "->" ; i++)
+			r.conditions.push_back(parse_condition(words[i]));
+		if (i == words.size())
+			fail("Missing ->");
+
+		std::vector<std::string> aw;
+		for (i++ ; i <= words.size() ; i++)
+		{
+			if (i < words.size() && words[i] != ";")
+			{
+				aw.push_back(words[i]);
+				continue;
+			}
+			/* Allow a trailing ; */
+			if (aw.empty() && i == words.size() && !r.actions.empty())
+				break;
+			r.actions.push_back(parse_action(aw));
+			aw.clear();
+		}
+		rs.rules.push_back(std::move(r));
+	}
+};
+
+listener_rules::listener_rules()
+{
+}
+
+listener_rules::~listener_rules()
+{
+}
+
+int
+listener_rules::intern(const std::string &name)
+{
+	auto it = symbol_ids.insert(std::make_pair(name, (int)symbols.size()));
+
+	if (it.second)
+		symbols.push_back(name);
+	return it.first->second;
+}
+
+int
+listener_rules::lookup(const std::string &name) const
+{
+	auto it = symbol_ids.find(name);
+
+	if (it == symbol_ids.end())
+		return -2;
+	return it->second;
+}
+
+void
+listener_rules::load(const std::string &path)
+{
+	std::ifstream file(path.c_str());
+
+	if (!file)
+		throw std::runtime_error(path + ": Can't open");
+
+	std::shared_ptr<ruleset> rs = std::make_shared<ruleset>();
+	rules_parser parser(*this, path);
+	std::string line;
+
+	std::string more;
+	while (std::getline(file, more))
+	{
+		parser.lineno++;
+		/* A trailing \ continues on the next line, reported at its last line. */
+		if (!more.empty() && more[more.size() - 1] == '\\')
+		{
+			line += more.substr(0, more.size() - 1) + " ";
+			continue;
+		}
+		parser.parse_line(*rs, line + more);
+		line.clear();
+	}
+	if (!line.empty())
+		parser.parse_line(*rs, line);
+	if (file.bad())
+		throw std::runtime_error(path + ": Read error");
+
+	rs->compile(symbols.size());
+	rules = rs;
+}
+
+static std::string
+resolve(const operand &o, const std::string &value, const std::vector<std::string> &args)
+{
+	std::string s;
+
+	switch (o.kind)
+	{
+	case operand::LITERAL:
+		return o.text;
+	case operand::VALUE:
+		s = value;
+		break;
+	case operand::ARG:
+		if ((size_t)o.arg <= args.size())
+			s = args[o.arg - 1];
+		break;
+	}
+	if (o.arith)
+	{
+		std::ostringstream ss;
+
+		ss << atoi(s.c_str()) + o.add;
+		s = ss.str();
+	}
+	return s;
+}
+
+static int
+local_hour()
+{
+	time_t now = time(NULL);
+	struct tm tm = {0};
+
+	localtime_r(&now, &tm);
+	return tm.tm_hour;
+}
+
+static bool
+idle_at_most(int secs)
+{
+#ifdef IDLE
+	struct timespec idle;
+
+	return IDLE(&idle) == 0 && idle.tv_sec <= secs;
+#else
+	return false;
+#endif
+}
+
+void
+listener_rules::run(const ruleset &rs, int input, const frame &f, int depth)
+{
+	if ((size_t)input >= rs.inputs.size())
+		return;
+
+	const ruleset::input_table &t = rs.inputs[input];
+	const std::vector<const rule*> *list = &t.any;
+	auto it = t.by_value.find(f.value);
+	if (it != t.by_value.end())
+		list = &it->second;
+
+	for (const rule *r : *list)
+	{
+		bool match = true;
+
+		for (auto &c : r->conditions)
+		{
+			int have, want, hour;
+
+			switch (c.op)
+			{
+			case condition::EQ:
+			case condition::NE:
+				have = (size_t)c.input < values.size() ? values[c.input] : -1;
+				if (c.value.kind == operand::LITERAL)
+					want = c.value.sym;
+				else
+					want = lookup(resolve(c.value, f.value_text, f.args));
+				match = (have == want) == (c.op == condition::EQ);
+				break;
+			case condition::HOUR:
+				hour = local_hour();
+				if (c.from <= c.to)
+					match = hour >= c.from && hour < c.to;
+				else
+					match = hour >= c.from || hour < c.to;
+				break;
+			case condition::IDLE_LE:
+				match = idle_at_most(c.from);
+				break;
+			case condition::IDLE_GT:
+				match = !idle_at_most(c.from);
+				break;
+			}
+			if (!match)
+				break;
+		}
+		if (!match)
+			continue;
+
+		for (auto &a : r->actions)
+		{
+			std::vector<std::string> words;
+
+			for (auto &o : a.words)
+				words.push_back(resolve(o, f.value_text, f.args));
+
+			switch (a.op)
+			{
+			case action::SEND:
+				steps.push_back(step{words[0], std::vector<std::string>(words.begin() + 1, words.end()), -1, -1});
+				if (a.until.input >= 0)
+				{
+					steps.back().input = a.until.input;
+					if (a.until.value.kind == operand::LITERAL)
+						steps.back().value = a.until.value.sym;
+					else
+						steps.back().value = intern(resolve(a.until.value, f.value_text, f.args));
+				}
+				break;
+			case action::SET:
+				update(intern(words[0]), intern(words[1]), words[1], depth + 1);
+				break;
+			case action::CALL:
+				if (depth + 1 >= max_depth)
+				{
+					std::cerr << "warn: listener_rules: Too deep calling " << words[0] << "\n";
+					break;
+				}
+				run(rs, intern(words[0]), frame{f.value, f.value_text,
+						std::vector<std::string>(words.begin() + 1, words.end())}, depth + 1);
+				break;
+			case action::PROBE:
+				if (probe)
+					probe(words[0], words[1], words[2], words[3]);
+				break;
+			case action::UNPROBE:
+				if (unprobe)
+					unprobe(words[0]);
+				break;
+			case action::LOG:
+				for (size_t i = 0 ; i < words.size() ; i++)
+					std::cout << (i ? " " : "") << words[i];
+				std::cout << "\n";
+				break;
+			case action::STOP:
+				return;
+			}
+		}
+	}
+}
+
+void
+listener_rules::update(int input, int value, const std::string &value_text, int depth)
+{
+	if (depth >= max_depth)
+	{
+		std::cerr << "warn: listener_rules: Too deep setting " << symbols[input] << "\n";
+		return;
+	}
+
+	std::shared_ptr<const ruleset> rs = rules;
+	if (rs && (rs->ignored.count(std::make_pair(input, value)) || rs->ignored.count(std::make_pair(-1, value))))
+		return;
+
+	if ((size_t)input >= values.size())
+		values.resize(symbols.size(), -1);
+	if (values[input] == value)
+	{
+		std::cerr << "Not updating " << symbols[input] << ", " << value_text << " == " << symbols[values[input]] << "\n";
+		return;
+	}
+	values[input] = value;
+	if (changed)
+		changed(input);
+
+	if (rs)
+		run(*rs, input, frame{value, value_text, std::vector<std::string>()}, depth);
+
+	if (depth == 0 && !steps.empty())
+	{
+		std::vector<step> s;
+
+		s.swap(steps);
+		if (scene)
+			scene(symbols[input] + " " + value_text, std::move(s));
+	}
+}
+
+void
+listener_rules::event(const std::string &input, const std::string &value)
+{
+	update(intern(input), intern(value), value, 0);
+}
@@ -0,0 +1,116 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef LISTENER_RULES_HH
+#define LISTENER_RULES_HH
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/*
+ * The automation of listener, as rules read from a file. Each line of the
+ * file is
+ *
+ *	input value [condition ...] -> action [; action ...]
+ *
+ * where value is a value, * for any value or !value for any other value.
+ * The rules for an event are run in file order, until an action stops them.
+ * See listener.rules for the conditions and actions.
+ *
+ * Input and value names are interned once, and the rules are compiled into a
+ * table indexed by input and value, so an event only looks at the rules
+ * that can match it and conditions compare symbols rather than strings.
+ * Symbols are kept over reloads, and so are the values seen.
+ *
+ * The commands sent while running an event make up a scene, which is
+ * handed over as a whole to be run.
+ */
+class listener_rules
+{
+public:
+	struct step
+	{
+		std::string line;
+		std::vector<std::string> words;
+		/* Input and value symbols confirming the step, -1 if none. */
+		int input;
+		int value;
+	};
+
+	typedef std::function<void(const std::string &name, std::vector<step> &&steps)> scene_fn;
+	typedef std::function<void(int input)> changed_fn;
+	typedef std::function<void(const std::string &host, const std::string &port,
+			const std::string &input, const std::string &value)> probe_fn;
+	typedef std::function<void(const std::string &input)> unprobe_fn;
+
+	scene_fn scene;
+	/* Called when the value of an input changed, before its rules are run. */
+	changed_fn changed;
+	probe_fn probe;
+	unprobe_fn unprobe;
+
+	listener_rules();
+	~listener_rules();
+
+	/* Throws std::runtime_error with file and line, keeping the old rules. */
+	void load(const std::string &path);
+
+	void event(const std::string &input, const std::string &value);
+
+	/* Value symbol of an input, -1 if none yet. */
+	int value(int input) const
+	{
+		return (size_t)input < values.size() ? values[input] : -1;
+	}
+
+	const std::string &name(int sym) const
+	{
+		return symbols[sym];
+	}
+
+	struct ruleset;
+
+private:
+	std::unordered_map<std::string, int> symbol_ids;
+	std::vector<std::string> symbols;
+	/* Latest value of each input, by symbol, -1 if none yet. */
+	std::vector<int> values;
+	std::shared_ptr<const ruleset> rules;
+	std::vector<step> steps;
+
+	int intern(const std::string &name);
+	int lookup(const std::string &name) const;
+
+	struct frame;
+	void update(int input, int value, const std::string &value_text, int depth);
+	void run(const ruleset &rs, int input, const frame &f, int depth);
+
+	friend class rules_parser;
+};
+
+#endif /*LISTENER_RULES_HH*/
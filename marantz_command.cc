@@ -52,6 +52,53 @@ const struct ma_command {
 	{ NULL }
 };
 
+/*
+ * Arguments stepping a level or moving through a list, by code. Along with
+ * the toggles these do something else if repeated, so they aren't retried.
+ */
+static const struct ma_step {
+	const char *code;
+	const char *args;
+} ma_steps[] = {
+	{ "VOL", "1234" },
+	{ "TOB", "12" },
+	{ "TOT", "12" },
+	{ "MNU", "3" },
+	{ "CUR", "1234" },
+	{ "SSU", "3" },
+	{ "SUR", "12" },
+	{ "TTO", "34" },
+	{ "LIP", "12" },
+	{ "TFQ", "1234" },
+	{ "TPR", "1234" },
+	{ "CAT", "1234" },
+	{ "MVL", "12" },
+	{ "MSV", "12" },
+	{ "MTF", "1234" },
+	{ "MTP", "1234" },
+	{ NULL }
+};
+
+/* Commands setting a value, including on and off, are safe to repeat. */
+static bool
+ma_repeatable (const struct ma_command *macmd)
+{
+	const struct ma_step *step;
+	const char *arg = macmd->cmd + 3;
+
+	if (macmd->narg)
+		return true;
+	if (arg[1] != '\0')
+		return true;
+
+	for (step = ma_steps ; step->code ; step++) {
+		if (strncmp(macmd->cmd, step->code, 3) == 0 && strchr(step->args, arg[0]))
+			return false;
+	}
+	/* 0 toggles, or stores and clears for MEM and CLR, but is bypass for DHM. */
+	return arg[0] != '0' || strncmp(macmd->cmd, "DHM", 3) == 0;
+}
+
 int
 ma_status::query_command (const std::string &code)
 const
@@ -84,9 +131,11 @@ ma_status::send_command(const std::string &cmd, const std::vector<int32_t> &args
 		warnx("Mismatch number of arguments %zd <> %zd", args.size(), macmd->narg);
 		return;
 	}
+	int retries = ma_repeatable(macmd) ? max_retries : 0;
+
 	if (args.size() == 1)
-		send_throttle(&macmd->throttle, macmd->fmt, (int)args[0]);
+		send_throttle(&macmd->throttle, retries, macmd->fmt, (int)args[0]);
 	else
-		send_throttle(&macmd->throttle, macmd->fmt, "" /* Suppress warning */);
+		send_throttle(&macmd->throttle, retries, macmd->fmt, "" /* Suppress warning */);
 }
 
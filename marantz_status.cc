@@ -39,46 +39,48 @@
 struct ma_info;
 
 static status_bool_t
-parse_ma_bool (const std::string &arg) {
+parse_ma_bool (packet_view arg) {
 	if (arg[0] == '2')
 		return bool_on;
 	return bool_off;
 }
 
+/* Only copied when changed, the XM names are mostly repeated. */
 static void
-parse_ma_string (std::string &dest, const std::string &arg) {
+parse_ma_string (std::string &dest, packet_view arg) {
 	size_t len = arg.length();
 
 	while (len > 0 && arg[len - 1] == ' ')
 		len--;
 
-	dest = arg.substr(0, len);
+	if (dest.length() != len || dest.compare(0, len, arg.data(), len) != 0)
+		dest.assign(arg.data(), len);
 }
 
 #define UPDATE_FUNC_BOOL(field, code) \
 	void \
-	ma_status::update_ ## field (const struct ma_info *info, const std::string &arg) { \
+	ma_status::update_ ## field (const struct ma_info *info, packet_view arg) { \
 		field = parse_ma_bool (arg); \
 		notify(code, field); \
 	}
 
 #define UPDATE_FUNC_INT(field, code) \
 	void \
-	ma_status::update_ ## field (const struct ma_info *info, const std::string &arg) { \
-		field = atoi(arg.c_str()); \
+	ma_status::update_ ## field (const struct ma_info *info, packet_view arg) { \
+		field = arg.to_int(); \
 		notify(code, field); \
 	}
 
 #define UPDATE_FUNC_DIRECT(field, code) \
 	void \
-	ma_status::update_ ## field (const struct ma_info *info, const std::string &arg) { \
+	ma_status::update_ ## field (const struct ma_info *info, packet_view arg) { \
 		field = static_cast<decltype(field)>(arg[0]); \
 		notify(code, field); \
 	}
 
 #define UPDATE_FUNC_STRING(field, code) \
 	void \
-	ma_status::update_ ## field (const struct ma_info *info, const std::string &arg) { \
+	ma_status::update_ ## field (const struct ma_info *info, packet_view arg) { \
 		parse_ma_string(field, arg); \
 		notify(code, field); \
 	}
@@ -89,17 +91,17 @@ UPDATE_FUNC_BOOL(audio_att, "ATT ");
 UPDATE_FUNC_BOOL(audio_mute, "AMT ");
 
 void
-ma_status::update_video_mute(const struct ma_info *info, const std::string &arg) {
+ma_status::update_video_mute(const struct ma_info *info, packet_view arg) {
 	video_mute = parse_ma_bool(arg) == bool_on ? video_mute_on : video_mute_off;
 	notify("VMT ", video_mute);
 }
 
 void
-ma_status::update_volume (const struct ma_info *info, const std::string &arg) {
+ma_status::update_volume (const struct ma_info *info, packet_view arg) {
 	if (arg == "-FF")
 		volume = MAVOL_MIN;
 	else
-		volume = atoi(arg.c_str());
+		volume = arg.to_int();
 	notify("VOL ", volume);
 }
 
@@ -107,7 +109,7 @@ UPDATE_FUNC_INT(tone_bass, "TOB ");
 UPDATE_FUNC_INT(tone_treble, "TOT ");
 
 void
-ma_status::update_source_select (const struct ma_info *info, const std::string &arg) {
+ma_status::update_source_select (const struct ma_info *info, packet_view arg) {
 	video_source = (status_source)arg[0];
 	notify("SRCV", video_source);
 	audio_source = (status_source)arg[1];
@@ -124,7 +126,7 @@ UPDATE_FUNC_INT(sleep, "SLP ");
 UPDATE_FUNC_BOOL(menu, "MNU ");
 
 void
-ma_status::update_dc_trigger (const struct ma_info *info, const std::string &arg) {
+ma_status::update_dc_trigger (const struct ma_info *info, packet_view arg) {
 	if (arg[0] == '1') {
 		dc_trigger_1 = parse_ma_bool(arg.substr(1));
 		notify("DCT1", dc_trigger_1);
@@ -138,7 +140,7 @@ UPDATE_FUNC_DIRECT(surround_mode, "SUR ");
 UPDATE_FUNC_DIRECT(dolby_headphone_mode, "DHM ");
 
 void
-ma_status::update_test_tone (const struct ma_info *info, const std::string &arg) {
+ma_status::update_test_tone (const struct ma_info *info, packet_view arg) {
 	test_tone_enabled = parse_ma_bool(arg);
 	notify("TTOO", test_tone_enabled);
 	if (test_tone_enabled == bool_on) {
@@ -158,16 +160,16 @@ UPDATE_FUNC_DIRECT(digital_signal_format, "SIG ");
 UPDATE_FUNC_DIRECT(sampling_frequency, "SFQ ");
 
 void
-ma_status::update_channel_status (const struct ma_info *info, const std::string &arg) {
+ma_status::update_channel_status (const struct ma_info *info, packet_view arg) {
 	int x = arg[0];
 	int y = arg[1];
 
 	if (x >= 'A')
-		x -= 'A';
+		x -= 'A' - 10;
 	else
 		x -= '0';
 	if (y >= 'A')
-		y -= 'A';
+		y -= 'A' - 10;
 	else
 		y -= '0';
 
@@ -183,8 +185,8 @@ ma_status::update_channel_status (const struct ma_info *info, const std::string
 UPDATE_FUNC_INT(lip_sync, "LIP ");
 
 void
-ma_status::update_tuner_frequency (const struct ma_info *info, const std::string &arg) {
-	tuner_frequency = atoi(arg.c_str());
+ma_status::update_tuner_frequency (const struct ma_info *info, packet_view arg) {
+	tuner_frequency = arg.to_int();
 	notify("TFQF", tuner_frequency);
 	if (tuner_frequency < 256)
 		tuner_band = tuner_band_xm;
@@ -200,10 +202,10 @@ UPDATE_FUNC_BOOL(tuner_preset_info, "TPI ");
 UPDATE_FUNC_DIRECT(tuner_mode, "TMD ");
 
 void
-ma_status::update_xm_category_search (const struct ma_info *info, const std::string &arg) {
+ma_status::update_xm_category_search (const struct ma_info *info, packet_view arg) {
 	xm_in_search = parse_ma_bool(arg);
 	notify("CATS", xm_in_search);
-	xm_category = atoi(arg.substr(1).c_str());
+	xm_category = arg.substr(1).to_int();
 	notify("CATN", xm_category);
 }
 
@@ -216,18 +218,18 @@ UPDATE_FUNC_BOOL(multiroom_power, "MPW ");
 UPDATE_FUNC_BOOL(multiroom_audio_mute, "MAM ");
 
 void
-ma_status::update_multiroom_volume (const struct ma_info *info, const std::string &arg) {
+ma_status::update_multiroom_volume (const struct ma_info *info, packet_view arg) {
 	if (arg == "-FF")
 		multiroom_volume = MAVOL_MIN;
 	else
-		multiroom_volume = atoi(arg.c_str());
+		multiroom_volume = arg.to_int();
 	notify("MVL ", multiroom_volume);
 }
 
 UPDATE_FUNC_BOOL(multiroom_volume_fixed, "MVS ");
 
 void
-ma_status::update_multiroom_source_select (const struct ma_info *info, const std::string &arg) {
+ma_status::update_multiroom_source_select (const struct ma_info *info, packet_view arg) {
 	multiroom_video_source = (status_source)arg[0];
 	notify("MSCV", multiroom_video_source);
 	multiroom_audio_source = (status_source)arg[1];
@@ -238,11 +240,11 @@ UPDATE_FUNC_INT(multiroom_sleep, "MSL ");
 UPDATE_FUNC_BOOL(multiroom_speaker, "MSP ");
 
 void
-ma_status::update_multiroom_speaker_volume (const struct ma_info *info, const std::string &arg) {
+ma_status::update_multiroom_speaker_volume (const struct ma_info *info, packet_view arg) {
 	if (arg == "-FF")
 		multiroom_speaker_volume = MAVOL_MIN;
 	else
-		multiroom_speaker_volume = atoi(arg.c_str());
+		multiroom_speaker_volume = arg.to_int();
 	notify("MSV ", multiroom_speaker_volume);
 }
 
@@ -250,8 +252,8 @@ UPDATE_FUNC_BOOL(multiroom_speaker_volume_fixed, "MSS ");
 UPDATE_FUNC_BOOL(multiroom_speaker_audio_mute, "MSM ");
 
 void
-ma_status::update_multiroom_tuner_frequency (const struct ma_info *info, const std::string &arg) {
-	multiroom_tuner_frequency = atoi(arg.c_str());
+ma_status::update_multiroom_tuner_frequency (const struct ma_info *info, packet_view arg) {
+	multiroom_tuner_frequency = arg.to_int();
 	notify("MTFF", multiroom_tuner_frequency);
 	if (multiroom_tuner_frequency < 256)
 		multiroom_tuner_band = tuner_band_xm;
@@ -266,11 +268,11 @@ UPDATE_FUNC_INT(multiroom_tuner_preset, "MTP ");
 UPDATE_FUNC_DIRECT(multiroom_tuner_mode, "MTM ");
 
 void
-ma_status::update_auto_status_feedback (const struct ma_info *info, const std::string &arg) {
+ma_status::update_auto_status_feedback (const struct ma_info *info, packet_view arg) {
 	int x = arg[0];
 
 	if (x >= 'A')
-		x -= 'A';
+		x -= 'A' - 10;
 	else
 		x -= '0';
 
@@ -286,7 +288,7 @@ struct ma_info
 	int layer;
 	int flags;
 	uint64_t know_mask;
-	void (ma_status::*update_func)(const struct ma_info *info, const std::string &arg);
+	void (ma_status::*update_func)(const struct ma_info *info, packet_view arg);
 };
 
 #define ST_CMD_ONLY 1
@@ -327,52 +329,167 @@ static const struct ma_code ma_codes[] = {
 	{ NULL, NULL }
 };
 
+/* Subscribers get changes of these this often if the receiver won't send them. */
+static const struct timeval poll_interval = { 5, 0 };
+/* Layers are kept this long after the last subscriber, as queries come and go. */
+static const struct timeval layer_linger = { 5, 0 };
+
+static const struct ma_info *
+find_info(packet_view code)
+{
+	int i;
+
+	for (i = 0; i < num_infos; i++) {
+		if (code == infos[i].code)
+			return &infos[i];
+	}
+	return NULL;
+}
+
+/*
+ * Notify codes start with the code of the packet updating them, so the
+ * layers needed follow from what is subscribed to.
+ */
+int
+ma_status::subscribed_layers(bool *poll) const
+{
+	int layers = 0;
+
+	*poll = false;
+	for (auto &sub : subscriptions()) {
+		const struct ma_info *info = find_info(packet_view(sub.code).substr(0, 3));
+
+		if (!info)
+			continue;
+		if (info->layer > 0)
+			layers |= 1 << (info->layer - 1);
+		if (info->flags & ST_NO_AUTO)
+			*poll = true;
+	}
+	return layers;
+}
+
+bool
+ma_status::subscribed(const struct ma_info *info) const
+{
+	for (auto &sub : subscriptions()) {
+		if (packet_view(sub.code).substr(0, 3) == info->code)
+			return true;
+	}
+	return false;
+}
+
 void
-ma_status::enable_auto_status_layer(int layer)
+ma_status::set_auto_status_layers(int layers)
 {
-	int flags = 0;
 	int i;
 
-	for (i = 0 ; i < 4; i++) {
-		if (auto_status_feedback_layer[i] || layer == i + 1)
-			flags |= 1 << i;
+	if (layers == wanted_layers)
+		return;
+
+	/* Fields of layers turned off are no longer kept up to date. */
+	for (i = 0; i < num_infos; i++) {
+		if (infos[i].layer > 0 && !(layers & 1 << (infos[i].layer - 1)))
+			known_fields &= ~infos[i].know_mask;
 	}
-	send("@AST:%X\r", flags);
+
+	wanted_layers = layers;
+	send("@AST:%X\r", layers);
 }
 
+/*
+ * Layers are enabled as soon as someone subscribes, but only disabled once
+ * nobody has needed them for a while. Fields not in any layer are polled.
+ */
 void
-ma_status::update_status(const std::string &line, const struct backend_output *inptr)
+ma_status::update_layers(bool now)
 {
-	size_t cpos = line.find(':');
+	bool poll;
+	int layers = subscribed_layers(&poll);
+
+	if (now || wanted_layers < 0) {
+		layers_ev.del();
+		set_auto_status_layers(layers);
+	} else {
+		set_auto_status_layers(wanted_layers | layers);
+		if (layers != wanted_layers && !layers_ev.pending(EV_TIMEOUT))
+			layers_ev.add(layer_linger);
+	}
+
+	if (poll && !poll_ev.pending(EV_TIMEOUT))
+		poll_ev.add(poll_interval);
+	else if (!poll)
+		poll_ev.del();
+}
+
+void
+ma_status::layerscb()
+{
+	update_layers(true);
+}
+
+void
+ma_status::pollcb()
+{
+	bool poll = false;
 	int i;
 
-	/* Don't need this info */
-	while (inptr)
-		remove_output(&inptr);
+	for (i = 0; i < num_infos; i++) {
+		if ((infos[i].flags & ST_NO_AUTO) && subscribed(&infos[i])) {
+			send_status_request(infos[i].code);
+			poll = true;
+		}
+	}
+	if (poll)
+		poll_ev.add(poll_interval);
+}
+
+void
+ma_status::subscriptions_changed()
+{
+	if (opened)
+		update_layers(false);
+}
 
-	if (cpos == std::string::npos)
+void
+ma_status::update_status(packet_view line, const struct backend_output *inptr)
+{
+	size_t cpos = line.find(':');
+
+	if (cpos == packet_view::npos) {
+		metrics.packets_dropped++;
 		return;
+	}
 
-	std::string code = line.substr(0, cpos);
-	std::string arg = line.substr(cpos + 1);
+	packet_view code = line.substr(0, cpos);
+	packet_view arg = line.substr(cpos + 1);
 	if (code[0] == '@')
-		code.erase(0, 1);
+		code = code.substr(1);
 
-	for (i = 0; i < num_infos; i++) {
-		if (code == infos[i].code) {
-			(this->*infos[i].update_func)(&infos[i], arg);
-			if (infos[i].layer > 0 && auto_status_feedback_layer[infos[i].layer - 1] == bool_off) {
-				enable_auto_status_layer(infos[i].layer);
-			}
-			if (infos[i].layer > 0)
-				known_fields |= infos[i].know_mask;
-			return;
-		}
+	/* The receiver answers a command with the status of the same code. */
+	const struct backend_output *out;
+	for (out = inptr ; out ; out = output.next_sent(out)) {
+		if (out->len > 4 && code == packet_view(out->data + 1, 3))
+			break;
+	}
+	if (out)
+		output_replied(&inptr, out);
+
+	const struct ma_info *info = find_info(code);
+	if (!info) {
+		metrics.packets_dropped++;
+		return;
 	}
+	if (!info->update_func)
+		return;
+	(this->*info->update_func)(info, arg);
+	if (info->layer > 0 && auto_status_feedback_layer[info->layer - 1] == bool_on)
+		known_fields |= info->know_mask;
 }
 
 ma_status::ma_status(backend_ptr &ptr, std::string name, std::string line, std::string client, int throttle)
-	: status(ptr, std::move(name), std::move(line), std::move(client), throttle), known_fields(0)
+	: status(ptr, std::move(name), std::move(line), std::move(client), throttle), known_fields(0),
+	  wanted_layers(-1), opened(false)
 {
 }
 
@@ -408,9 +525,30 @@ ma_status::open()
 {
 	backend_device::open();
 
+	/* Still armed if the line was lost and is opened again. */
+	layers_ev.reset();
+	poll_ev.reset();
+	layers_ev.set_fd(-1);
+	layers_ev.set(EV_TIMEOUT, std::bind(&ma_status::layerscb, this));
+	poll_ev.set_fd(-1);
+	poll_ev.set(EV_TIMEOUT, std::bind(&ma_status::pollcb, this));
+	opened = true;
+
 	memset(auto_status_feedback_layer, 0, sizeof(auto_status_feedback_layer));
-	enable_auto_status_layer(1);
 	known_fields = 0;
+	/* Also turns off whatever layers the receiver was left with. */
+	wanted_layers = -1;
+	update_layers(true);
+}
+
+void
+ma_status::close()
+{
+	layers_ev.reset();
+	poll_ev.reset();
+	opened = false;
+
+	backend_device::close();
 }
 
 int
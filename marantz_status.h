@@ -60,27 +60,40 @@ struct ma_status : public status
 
 	uint64_t known_fields;
 
+	/* Layers last asked for with @AST, -1 if none since open. */
+	int wanted_layers;
+	bool opened;
+	smart_event<event_unhandled_exception::handle> layers_ev;
+	smart_event<event_unhandled_exception::handle> poll_ev;
+
 	ma_status(backend_ptr &ptr, std::string name, std::string line, std::string client, int throttle);
 
 	virtual void open();
+	virtual void close();
 
 	virtual const char *packet_separators() const;
-	virtual void update_status(const std::string &packet, const struct backend_output *inptr);
+	virtual void update_status(packet_view packet, const struct backend_output *inptr);
 	virtual int send_status_request(const std::string &code);
 	virtual int query_command(const std::string &code) const;
 	virtual int query_status(const std::string &code) const;
 	virtual int query(const std::string &code, std::string &out_buf);
 	virtual void send_command(const std::string &cmd, const std::vector<int32_t> &args);
 
-	void enable_auto_status_layer(int layer);
+	int subscribed_layers(bool *poll) const;
+	bool subscribed(const struct ma_info *info) const;
+	void set_auto_status_layers(int layers);
+	void update_layers(bool now);
+	void layerscb();
+	void pollcb();
+	virtual void subscriptions_changed();
 
-#define INFO(name, code, level, id) void update_##id(const struct ma_info *info, const std::string &arg);
-#define INFO_KNOW(name, code, level, know, id) void update_##id(const struct ma_info *info, const std::string &arg);
+#define INFO(name, code, level, id) void update_##id(const struct ma_info *info, packet_view arg);
+#define INFO_KNOW(name, code, level, know, id) void update_##id(const struct ma_info *info, packet_view arg);
 #define INFO_ACK_ONLY(name, code)
-#define INFO_NO_AUTO(name, code, id) void update_##id(const struct ma_info *info, const std::string &arg);
-#define INFO_KNOW_NO_AUTO(name, code, know, id) void update_##id(const struct ma_info *info, const std::string &arg);
+#define INFO_NO_AUTO(name, code, id) void update_##id(const struct ma_info *info, packet_view arg);
+#define INFO_KNOW_NO_AUTO(name, code, know, id) void update_##id(const struct ma_info *info, packet_view arg);
 #define NO_INFO(name, code, level)
-#define INFO_CMD_ONLY(name, code, id) void update_##id(const struct ma_info *info, const std::string &arg);
+#define INFO_CMD_ONLY(name, code, id) void update_##id(const struct ma_info *info, packet_view arg);
 #include "marantz_info.h"
 #undef INFO
 #undef INFO_KNOW
@@ -0,0 +1,169 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef METRICS_HH
+#define METRICS_HH
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include <string>
+
+/*
+ * Counters are plain integers bumped in the hot paths and only formatted
+ * when someone asks for them, using the QMET command or the stats socket.
+ */
+
+inline void
+metrics_append(std::string &out, const std::string &prefix, const char *key, uint64_t val)
+{
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "%llu", (unsigned long long)val);
+	if (!out.empty())
+		out += " ";
+	out += prefix;
+	out += key;
+	out += "=";
+	out += buf;
+}
+
+/* Bucket i counts latencies below 2^i microseconds, the last one everything above. */
+class latency_histogram
+{
+public:
+	enum { nbuckets = 25 };
+
+	uint64_t buckets[nbuckets];
+	uint64_t count;
+	uint64_t total_usec;
+
+	latency_histogram()
+		: count(0), total_usec(0)
+	{
+		memset(buckets, 0, sizeof(buckets));
+	}
+
+	void add(const struct timeval &tv)
+	{
+		uint64_t usec = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+		int b = 0;
+
+		while (b < nbuckets - 1 && usec >= (1ULL << b))
+			b++;
+		buckets[b]++;
+		count++;
+		total_usec += usec;
+	}
+
+	/* Upper bound of the bucket holding the pct percentile. */
+	uint64_t percentile(unsigned pct) const
+	{
+		uint64_t want = (count * pct + 99) / 100;
+		uint64_t sum = 0;
+		int b;
+
+		for (b = 0 ; b < nbuckets - 1 ; b++) {
+			sum += buckets[b];
+			if (sum >= want)
+				break;
+		}
+		return 1ULL << b;
+	}
+
+	void format(std::string &out, const std::string &prefix) const
+	{
+		metrics_append(out, prefix, ".count", count);
+		if (!count)
+			return;
+		metrics_append(out, prefix, ".avg_us", total_usec / count);
+		metrics_append(out, prefix, ".p50_us", percentile(50));
+		metrics_append(out, prefix, ".p99_us", percentile(99));
+
+		out += " " + prefix + ".buckets=";
+		for (int b = 0 ; b < nbuckets ; b++) {
+			char buf[24];
+
+			snprintf(buf, sizeof(buf), b ? ",%llu" : "%llu", (unsigned long long)buckets[b]);
+			out += buf;
+		}
+	}
+};
+
+struct backend_metrics
+{
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t packets_in;
+	uint64_t packets_out;
+	uint64_t packets_dropped;
+	uint64_t commands_retried;
+	uint64_t commands_dropped;
+	uint64_t queue_max;
+	uint64_t queue_wait_usec;
+	uint64_t throttle_stall_usec;
+	uint64_t notifications;
+	uint64_t opens;
+	struct timeval stall_start;
+	latency_histogram command_to_write;
+	latency_histogram write_to_reply;
+
+	backend_metrics()
+		: bytes_in(0), bytes_out(0), packets_in(0), packets_out(0), packets_dropped(0),
+		commands_retried(0), commands_dropped(0), queue_max(0), queue_wait_usec(0),
+		throttle_stall_usec(0), notifications(0), opens(0)
+	{
+		timerclear(&stall_start);
+	}
+};
+
+struct conn_metrics
+{
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t lines_in;
+	uint64_t lines_out;
+	uint64_t lines_dropped;
+	uint64_t notifications;
+
+	conn_metrics()
+		: bytes_in(0), bytes_out(0), lines_in(0), lines_out(0), lines_dropped(0), notifications(0)
+	{
+	}
+
+	void format(std::string &out, const std::string &prefix) const
+	{
+		metrics_append(out, prefix, ".bytes_in", bytes_in);
+		metrics_append(out, prefix, ".bytes_out", bytes_out);
+		metrics_append(out, prefix, ".lines_in", lines_in);
+		metrics_append(out, prefix, ".lines_out", lines_out);
+		metrics_append(out, prefix, ".lines_dropped", lines_dropped);
+		metrics_append(out, prefix, ".notifications", notifications);
+	}
+};
+
+#endif /*METRICS_HH*/
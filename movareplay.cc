@@ -0,0 +1,787 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Replays the traffic of a backend from a flight recorder capture. By default
+ * the device side is fed through a backend of the same type in this process,
+ * either as fast as possible or at the recorded pace. With -d the given
+ * movactld is run instead, and the client connections of the capture are
+ * replayed to it as well. Device commands no replayed client asked for are
+ * then not waited for, they are counted in commands_skipped.
+ *
+ * A line of key=value results is printed, followed by the final value of
+ * every status, one per line.
+ */
+
+#include <err.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "backend.h"
+#include "base64.h"
+#include "capture.h"
+#include "status.hh"
+#include "status_private.hh"
+#include "event_unhandled_exception.hh"
+#include "smart_event.hh"
+#include "pty.hh"
+
+std::exception_ptr event_unhandled_exception::exception;
+
+extern std::list<backend_ptr> backends;
+extern char **environ;
+
+struct replay_record
+{
+	uint64_t usec;
+	uint16_t stream;
+	uint8_t dir;
+	std::string data;
+};
+
+struct replay_capture
+{
+	std::vector<struct capture_stream> streams;
+	std::vector<replay_record> records;
+
+	void read(const char *path);
+	int find_stream(const char *name, enum capture_stream_kind kind) const;
+};
+
+void
+replay_capture::read(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	std::string buf;
+	char tmp[4096];
+	size_t n;
+
+	if (!f)
+		err(1, "%s", path);
+	while ((n = fread(tmp, 1, sizeof(tmp), f)) > 0)
+		buf.append(tmp, n);
+	if (ferror(f))
+		err(1, "%s", path);
+	fclose(f);
+
+	struct capture_file_header hdr;
+	if (buf.length() < sizeof(hdr))
+		errx(1, "%s: Truncated header", path);
+	memcpy(&hdr, buf.data(), sizeof(hdr));
+	if (memcmp(hdr.magic, CAPTURE_MAGIC, sizeof(hdr.magic)) != 0 || hdr.version != CAPTURE_VERSION)
+		errx(1, "%s: Not a version %d capture", path, CAPTURE_VERSION);
+
+	size_t pos = sizeof(hdr);
+	if (buf.length() < pos + hdr.nstreams * sizeof(struct capture_stream))
+		errx(1, "%s: Truncated stream headers", path);
+	streams.resize(hdr.nstreams);
+	memcpy(streams.data(), buf.data() + pos, hdr.nstreams * sizeof(struct capture_stream));
+	pos += hdr.nstreams * sizeof(struct capture_stream);
+	for (auto &st : streams) {
+		st.type[sizeof(st.type) - 1] = '\0';
+		st.name[sizeof(st.name) - 1] = '\0';
+	}
+
+	while (pos < buf.length()) {
+		struct capture_record cr;
+
+		if (buf.length() < pos + sizeof(cr))
+			errx(1, "%s: Truncated record", path);
+		memcpy(&cr, buf.data() + pos, sizeof(cr));
+		pos += sizeof(cr);
+		if (buf.length() < pos + cr.len || cr.stream >= streams.size())
+			errx(1, "%s: Invalid record", path);
+		records.push_back(replay_record{cr.usec, cr.stream, cr.dir, buf.substr(pos, cr.len)});
+		pos += cr.len;
+	}
+}
+
+int
+replay_capture::find_stream(const char *name, enum capture_stream_kind kind) const
+{
+	for (size_t i = 0 ; i < streams.size() ; i++) {
+		if (streams[i].kind == kind && (!name || strcmp(streams[i].name, name) == 0))
+			return i;
+	}
+	return -1;
+}
+
+/* Status values are formatted like movactl status does. */
+#define ESTART(type) \
+	static std::string format_ ## type (const std::string &val) { \
+		char buf[32]; \
+		int v = debase64_int24(val.c_str()); \
+		switch (v) {
+#define EV(type, name, val) \
+		case val: \
+			return #name;
+#define EEND(type) \
+		} \
+		snprintf(buf, sizeof(buf), "unknown:0x%x", v); \
+		return buf; \
+	}
+#include "status_enums.h"
+#undef ESTART
+#undef EV
+#undef EEND
+
+static std::string
+format_int(const std::string &val)
+{
+	return std::to_string(debase64_int24(val.c_str()));
+}
+
+static std::string
+format_string(const std::string &val)
+{
+	return val;
+}
+
+static const struct replay_code {
+	const char *name;
+	const char *code;
+	std::string (*format)(const std::string &val);
+} replay_codes[] = {
+#define NOTIFY(name, code, type) { #name, code, format_ ## type },
+#define STATUS(name, code, type) { #name, code, format_ ## type },
+#include "all_notify.h"
+#undef NOTIFY
+#undef STATUS
+	{ NULL }
+};
+
+/* Last value seen for each code, and how many notifications there were. */
+static std::map<std::string, std::string> final_state;
+static long notifications;
+
+static void
+observe(const std::string &code, const std::string &val)
+{
+	final_state[code] = val;
+	notifications++;
+}
+
+static void
+print_state()
+{
+	for (const struct replay_code *rc = replay_codes ; rc->name ; rc++) {
+		auto it = final_state.find(rc->code);
+
+		if (it != final_state.end() && it->second.length() == 4)
+			printf("%s %s\n", rc->name, rc->format(it->second).c_str());
+		else if (it != final_state.end() && rc->format == format_string)
+			printf("%s %s\n", rc->name, it->second.c_str());
+	}
+}
+
+static uint64_t
+now_usec()
+{
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/* Run the event loop until the recorded time of a record is reached. */
+static void
+wait_until(uint64_t usec)
+{
+	uint64_t now = now_usec();
+
+	if (usec <= now)
+		return;
+
+	struct timeval tv = { static_cast<time_t>((usec - now) / 1000000), static_cast<suseconds_t>((usec - now) % 1000000) };
+	event_loopexit(&tv);
+	event_dispatch();
+}
+
+static void
+drain(int fd)
+{
+	char buf[4096];
+
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+}
+
+/*
+ * Bare CRs are line flushes from opening and resynchronising the line, not
+ * commands, and the backend does those itself.
+ */
+static bool
+is_command(const replay_record &r)
+{
+	return r.data != "\r" && !r.data.empty();
+}
+
+struct replay_options
+{
+	int loops;
+	bool realtime;
+};
+
+struct replay_result
+{
+	uint64_t elapsed_usec;
+	uint64_t bytes;
+	uint64_t packets;
+	uint64_t dropped;
+	/* Commands in the capture that the replay didn't wait for. */
+	uint64_t skipped;
+};
+
+/*
+ * Commands the daemon wrote are sent through the backend again so that the
+ * replies are matched to them, the device side is written to the line.
+ */
+static replay_result
+replay_in_process(const replay_capture &cap, int stream, const char *type, const replay_options &opts)
+{
+	std::string slave_path;
+	int slave;
+	int master = open_sim_pty(slave_path, slave);
+
+	fcntl(master, F_SETFL, O_NONBLOCK);
+
+	std::string spec = std::string(cap.streams[stream].name) + ":" + type + ":" + slave_path;
+	add_backend_device(spec.c_str());
+	backend_device &bdev = backend_device::impl(backends.back());
+
+	std::vector<std::unique_ptr<status_notify_token>> tokens;
+	for (const struct replay_code *rc = replay_codes ; rc->name ; rc++) {
+		if (bdev.query_status(rc->code) == 0)
+			tokens.push_back(bdev.start_notify(rc->code, observe));
+	}
+
+	backend_reopen_devices();
+	/* Whatever the backend sends on open is also in the capture. */
+	bdev.discard_output();
+	drain(master);
+
+	uint64_t base = 0, start = now_usec();
+	uint64_t bytes_in = bdev.metrics.bytes_in;
+	bool first_open = true;
+
+	for (int loop = 0 ; loop < opts.loops ; loop++) {
+		for (auto &r : cap.records) {
+			if (r.stream != stream)
+				continue;
+			if (!base)
+				base = r.usec;
+			if (opts.realtime)
+				wait_until(start + (r.usec - base) + (uint64_t)loop * (cap.records.back().usec - base));
+
+			switch (r.dir) {
+			case CAPTURE_OPEN:
+				if (!first_open) {
+					bdev.close();
+					bdev.open();
+				}
+				first_open = false;
+				break;
+			case CAPTURE_OUT:
+				if (!is_command(r))
+					break;
+				bdev.send("%s", r.data.c_str());
+				while (bdev.output_pending()) {
+					event_loop(EVLOOP_ONCE);
+					drain(master);
+				}
+				break;
+			case CAPTURE_IN:
+				if (write(master, r.data.data(), r.data.length()) != static_cast<ssize_t>(r.data.length()))
+					err(1, "write");
+				bytes_in += r.data.length();
+				while (bdev.metrics.bytes_in < bytes_in) {
+					event_loop(EVLOOP_ONCE);
+					drain(master);
+				}
+				break;
+			}
+		}
+	}
+
+	replay_result res;
+	res.elapsed_usec = now_usec() - start;
+	res.bytes = bdev.metrics.bytes_in;
+	res.packets = bdev.metrics.packets_in;
+	res.dropped = bdev.metrics.packets_dropped;
+	res.skipped = 0;
+
+	tokens.clear();
+	backend_close_all();
+	close(slave);
+	close(master);
+	return res;
+}
+
+static int
+connect_local(const std::string &path)
+{
+	struct sockaddr_un unaddr = {0};
+
+	for (int i = 0 ; i < 100 ; i++) {
+		int fd = socket(PF_LOCAL, SOCK_STREAM, 0);
+
+		if (fd < 0)
+			err(1, "socket");
+		unaddr.sun_family = AF_LOCAL;
+		strncpy(unaddr.sun_path, path.c_str(), sizeof(unaddr.sun_path) - 1);
+		if (connect(fd, (struct sockaddr*)&unaddr, sizeof(unaddr)) == 0)
+			return fd;
+		close(fd);
+		usleep(20000);
+	}
+	err(1, "connect(%s)", path.c_str());
+}
+
+/*
+ * A client connection replayed to the daemon. What the daemon notifies it of
+ * is what the original client saw.
+ */
+class replay_conn
+{
+public:
+	int sock;
+	smart_event<> ev;
+	std::string input;
+	std::string metrics;
+	size_t received;
+	size_t expected;
+
+	replay_conn(int fd);
+	~replay_conn();
+
+private:
+	void readcb(int fd, short what);
+};
+
+replay_conn::replay_conn(int fd)
+	: sock(fd), received(0), expected(0)
+{
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	ev.set_fd(fd);
+	ev.set(EV_READ | EV_PERSIST, std::bind(&replay_conn::readcb, this, std::placeholders::_1, std::placeholders::_2));
+	ev.add();
+}
+
+replay_conn::~replay_conn()
+{
+	ev.reset();
+	close(sock);
+}
+
+void
+replay_conn::readcb(int fd, short what)
+{
+	char buf[4096];
+	ssize_t len = read(fd, buf, sizeof(buf));
+
+	if (len < 0 && errno == EAGAIN)
+		return;
+	if (len <= 0) {
+		ev.del();
+		return;
+	}
+	input.append(buf, len);
+	received += len;
+
+	size_t pos;
+	while ((pos = input.find('\n')) != std::string::npos) {
+		std::string line = input.substr(0, pos);
+
+		input.erase(0, pos + 1);
+		if (line.compare(0, 4, "STAT") == 0 && line.length() >= 8)
+			observe(line.substr(4, 4), line.substr(8));
+		else if (line.compare(0, 4, "QMET") == 0)
+			metrics = line.substr(4);
+	}
+}
+
+static uint64_t
+metric_value(const std::string &metrics, const std::string &key)
+{
+	size_t pos = metrics.find(key + "=");
+
+	if (pos == std::string::npos)
+		return 0;
+	return strtoull(metrics.c_str() + pos + key.length() + 1, NULL, 10);
+}
+
+/* Run the loop until nothing has been notified for a while. */
+static void
+settle()
+{
+	long before;
+
+	do {
+		before = notifications;
+		wait_until(now_usec() + 200000);
+	} while (notifications != before);
+}
+
+/* What the daemon has written to the line and not yet been matched. */
+static std::string line_written;
+
+static void
+line_readcb(int fd, short what)
+{
+	char buf[4096];
+	ssize_t len;
+
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		line_written.append(buf, len);
+}
+
+/*
+ * Device replies must not be written before the daemon has sent the command
+ * they answer, so wait for the daemon to write each command in the capture,
+ * giving up after a second.
+ */
+static void
+wait_for_command(const std::string &cmd)
+{
+	uint64_t deadline = now_usec() + 1000000;
+	size_t pos;
+
+	while ((pos = line_written.find(cmd)) == std::string::npos && now_usec() < deadline)
+		wait_until(now_usec() + 1000);
+	if (pos != std::string::npos)
+		line_written.erase(0, pos + cmd.length());
+	else
+		warnx("Daemon never wrote %.*s", (int)cmd.length() - 1, cmd.c_str());
+}
+
+/* Wait for len more bytes from the daemon on conn, giving up after a second. */
+static void
+wait_for_reply(replay_conn &conn, size_t len)
+{
+	uint64_t deadline = now_usec() + 1000000;
+
+	conn.expected += len;
+	while (conn.received < conn.expected && now_usec() < deadline)
+		wait_until(now_usec() + 1000);
+}
+
+/* A client connection of backend name, replayed along with it. */
+static bool
+is_client_of(const struct capture_stream &st, const std::string &name)
+{
+	return st.kind == CAPTURE_CONN && strncmp(st.name, name.c_str(), name.length()) == 0
+			&& st.name[name.length()] == '.';
+}
+
+/* Lines of a client that can make the daemon write to the device. */
+static int
+count_requests(const std::string &data)
+{
+	int n = 0;
+	size_t pos = 0;
+
+	do {
+		if (data.compare(pos, 4, "SEND") == 0 || data.compare(pos, 4, "STRT") == 0)
+			n++;
+		pos = data.find('\n', pos);
+	} while (pos != std::string::npos && ++pos < data.length());
+	return n;
+}
+
+enum command_cause
+{
+	CAUSE_NONE,
+	CAUSE_OPEN,
+	CAUSE_CLIENT,
+};
+
+/* Longest a request waits in the daemon's queue, the LG power on throttle. */
+static const uint64_t cause_usec = 10000000;
+/* Most the line is idle between the commands queued when it is opened. */
+static const uint64_t open_gap_usec = 250000;
+
+/*
+ * Works out which device commands in the capture the replayed daemon will
+ * write again. Commands for clients whose records were dropped from the
+ * capture, and those the daemon wrote on its own timers, have no request in
+ * the capture before them. Requests are matched to commands in order, and
+ * one the daemon wrote nothing for within cause_usec is given up on. The
+ * commands written back to back right after the line was first opened, with
+ * no client in between, are from opening it.
+ */
+static std::vector<enum command_cause>
+find_causes(const replay_capture &cap, int stream)
+{
+	std::vector<enum command_cause> causes(cap.records.size(), CAUSE_NONE);
+	std::string name = cap.streams[stream].name;
+	std::deque<uint64_t> requests;
+	/* Time of the last line traffic while opening, 0 once done. */
+	uint64_t opening = 0;
+	bool first_open = true;
+
+	for (size_t i = 0 ; i < cap.records.size() ; i++) {
+		const replay_record &rec = cap.records[i];
+
+		if (is_client_of(cap.streams[rec.stream], name)) {
+			opening = 0;
+			if (rec.dir == CAPTURE_IN)
+				requests.insert(requests.end(), count_requests(rec.data), rec.usec);
+			continue;
+		}
+		if (rec.stream != stream)
+			continue;
+		if (rec.dir == CAPTURE_OPEN) {
+			if (first_open)
+				opening = rec.usec;
+			first_open = false;
+			continue;
+		}
+		if (opening && rec.usec - opening > open_gap_usec)
+			opening = 0;
+		if (opening)
+			opening = rec.usec;
+		if (rec.dir != CAPTURE_OUT || !is_command(rec))
+			continue;
+
+		while (!requests.empty() && rec.usec - requests.front() > cause_usec)
+			requests.pop_front();
+		if (!requests.empty()) {
+			causes[i] = CAUSE_CLIENT;
+			requests.pop_front();
+		} else if (opening)
+			causes[i] = CAUSE_OPEN;
+	}
+	return causes;
+}
+
+static replay_result
+replay_daemon(const replay_capture &cap, int stream, const char *type, const char *daemon_path, const replay_options &opts)
+{
+	std::string slave_path;
+	int slave;
+	int master = open_sim_pty(slave_path, slave);
+
+	fcntl(master, F_SETFL, O_NONBLOCK);
+
+	char dir[] = "/tmp/movareplay.XXXXXX";
+	if (!mkdtemp(dir))
+		err(1, "mkdtemp");
+	std::string sock = std::string(dir) + "/sock";
+	std::string name = cap.streams[stream].name;
+	std::string spec = name + ":" + type + ":" + slave_path + ":" + sock;
+
+	const char *args[] = { daemon_path, spec.c_str(), NULL };
+	pid_t pid;
+	int r = posix_spawn(&pid, daemon_path, NULL, NULL, (char**)args, environ);
+	if (r) {
+		errno = r;
+		err(1, "posix_spawn(%s)", daemon_path);
+	}
+
+	smart_event<> line_ev;
+	line_ev.set_fd(master);
+	line_ev.set(EV_READ | EV_PERSIST, line_readcb);
+	line_ev.add();
+
+	/* Wait for the daemon to be up. */
+	close(connect_local(sock));
+
+	/*
+	 * One-shot clients leave their last command without a newline for the
+	 * daemon to handle at EOF, which it does before the close is recorded.
+	 * Close those right after their last input.
+	 */
+	std::vector<bool> close_after(cap.records.size());
+	std::map<uint16_t, size_t> last_in;
+	for (size_t i = 0 ; i < cap.records.size() ; i++) {
+		const replay_record &rec = cap.records[i];
+
+		if (rec.dir == CAPTURE_IN && !rec.data.empty())
+			last_in[rec.stream] = i;
+		else if (rec.dir == CAPTURE_CLOSE && last_in.count(rec.stream)
+				&& cap.records[last_in[rec.stream]].data.back() != '\n')
+			close_after[last_in[rec.stream]] = true;
+		else if (rec.dir == CAPTURE_OPEN)
+			last_in.erase(rec.stream);
+	}
+
+	/* The line is only opened once, the first loop. */
+	std::vector<enum command_cause> causes = find_causes(cap, stream);
+	uint64_t skipped = 0;
+
+	std::map<uint16_t, std::unique_ptr<replay_conn>> conns;
+	uint64_t base = 0, start = now_usec();
+
+	for (int loop = 0 ; loop < opts.loops ; loop++) {
+		for (size_t i = 0 ; i < cap.records.size() ; i++) {
+			const replay_record &rec = cap.records[i];
+			bool is_conn = is_client_of(cap.streams[rec.stream], name);
+
+			if (rec.stream != stream && !is_conn)
+				continue;
+			if (!base)
+				base = rec.usec;
+			if (opts.realtime)
+				wait_until(start + (rec.usec - base) + (uint64_t)loop * (cap.records.back().usec - base));
+			else
+				event_loop(EVLOOP_NONBLOCK);
+
+			if (is_conn && rec.dir == CAPTURE_CLOSE) {
+				conns.erase(rec.stream);
+			} else if (is_conn && rec.dir == CAPTURE_OUT) {
+				/* Let the client see what it saw before it goes on. */
+				if (conns[rec.stream])
+					wait_for_reply(*conns[rec.stream], rec.data.length());
+			} else if (is_conn) {
+				if (rec.dir == CAPTURE_OPEN || !conns[rec.stream])
+					conns[rec.stream].reset(new replay_conn(connect_local(sock)));
+				if (rec.dir == CAPTURE_IN && write(conns[rec.stream]->sock, rec.data.data(), rec.data.length()) < 0)
+					err(1, "write");
+				if (close_after[i])
+					conns.erase(rec.stream);
+			} else if (rec.dir == CAPTURE_OUT && is_command(rec)) {
+				if (causes[i] == CAUSE_CLIENT || (causes[i] == CAUSE_OPEN && loop == 0))
+					wait_for_command(rec.data);
+				else
+					skipped++;
+			} else if (rec.dir == CAPTURE_IN) {
+				if (write(master, rec.data.data(), rec.data.length()) != static_cast<ssize_t>(rec.data.length()))
+					err(1, "write");
+			}
+		}
+	}
+	settle();
+
+	replay_result res;
+	res.elapsed_usec = now_usec() - start;
+
+	replay_conn stats(connect_local(sock));
+	static const char qmet[] = "QMET\n";
+	if (write(stats.sock, qmet, sizeof(qmet) - 1) < 0)
+		err(1, "write");
+	while (stats.metrics.empty())
+		event_loop(EVLOOP_ONCE);
+	res.bytes = metric_value(stats.metrics, "bytes_in");
+	res.packets = metric_value(stats.metrics, "packets_in");
+	res.dropped = metric_value(stats.metrics, "packets_dropped");
+	res.skipped = skipped;
+
+	conns.clear();
+	kill(pid, SIGTERM);
+	waitpid(pid, NULL, 0);
+	unlink(sock.c_str());
+	rmdir(dir);
+	close(slave);
+	return res;
+}
+
+extern char *optarg;
+extern int optind;
+extern int optopt;
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	const char *stream_name = NULL;
+	const char *type = NULL;
+	const char *daemon_path = NULL;
+	replay_options opts = { 1, false };
+
+	while ((opt = getopt(argc, argv, ":s:t:d:n:r")) != -1) {
+		switch (opt) {
+		case 's':
+			stream_name = optarg;
+			break;
+		case 't':
+			type = optarg;
+			break;
+		case 'd':
+			daemon_path = optarg;
+			break;
+		case 'n':
+			opts.loops = atoi(optarg);
+			break;
+		case 'r':
+			opts.realtime = true;
+			break;
+		case ':':
+			errx(1, "-%c requires an argument.", optopt);
+		case '?':
+			errx(1, "unknown option -%c", optopt);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		errx(1, "usage: movareplay [-r] [-n loops] [-s stream] [-t type] [-d movactld] capture");
+
+	replay_capture cap;
+	cap.read(argv[0]);
+
+	int stream = cap.find_stream(stream_name, CAPTURE_BACKEND);
+	if (stream < 0)
+		errx(1, "No backend stream %s in %s", stream_name ? stream_name : "", argv[0]);
+	if (!type)
+		type = cap.streams[stream].type;
+	if (!*type)
+		errx(1, "No type for stream %s, use -t", cap.streams[stream].name);
+
+	signal(SIGPIPE, SIG_IGN);
+	event_init();
+
+	replay_result res;
+	if (daemon_path)
+		res = replay_daemon(cap, stream, type, daemon_path, opts);
+	else
+		res = replay_in_process(cap, stream, type, opts);
+
+	double secs = res.elapsed_usec / 1e6;
+	printf("stream=%s type=%s loops=%d realtime=%d elapsed_us=%llu bytes_in=%llu packets_in=%llu packets_dropped=%llu"
+			" commands_skipped=%llu notifications=%ld bytes_per_s=%.0f packets_per_s=%.0f\n",
+			cap.streams[stream].name, type, opts.loops, opts.realtime, (unsigned long long)res.elapsed_usec,
+			(unsigned long long)res.bytes, (unsigned long long)res.packets, (unsigned long long)res.dropped,
+			(unsigned long long)res.skipped, notifications, secs > 0 ? res.bytes / secs : 0, secs > 0 ? res.packets / secs : 0);
+	print_state();
+	return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * Device simulator. Opens a pseudo terminal and answers on it like a Marantz
+ * receiver or an LG TV would, so that movactld can be run and measured without
+ * the hardware. The slave path is printed on stdout and can be given to
+ * movactld as the line of a backend.
+ */
+
+#include <err.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <memory>
+#include <string>
+
+#include "simulator.hh"
+#include "pty.hh"
+
+static void
+set_msec(struct timeval &tv, double ms)
+{
+	long usec = static_cast<long>(ms * 1000);
+
+	tv.tv_sec = usec / 1000000;
+	tv.tv_usec = usec % 1000000;
+}
+
+static void
+quit_event(int signum, short what)
+{
+	event_loopexit(NULL);
+}
+
+extern char *optarg;
+extern int optind;
+extern int optopt;
+
+int
+main(int argc, char *argv[])
+{
+	int opt;
+	int baud = 9600;
+	double latency_ms = 0, updates = 0;
+	int jitter_ms = 0;
+	double drop_rate = 0, corrupt_rate = 0;
+	unsigned int seed = 1;
+	const char *link_path = NULL;
+
+	while ((opt = getopt(argc, argv, ":b:l:j:e:c:u:s:L:")) != -1) {
+		switch (opt) {
+		case 'b':
+			baud = atoi(optarg);
+			break;
+		case 'l':
+			latency_ms = atof(optarg);
+			break;
+		case 'j':
+			jitter_ms = atoi(optarg);
+			break;
+		case 'e':
+			drop_rate = atof(optarg);
+			break;
+		case 'c':
+			corrupt_rate = atof(optarg);
+			break;
+		case 'u':
+			updates = atof(optarg);
+			break;
+		case 's':
+			seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'L':
+			link_path = optarg;
+			break;
+		case ':':
+			errx(1, "-%c requires an argument.", optopt);
+		case '?':
+			errx(1, "unknown option -%c", optopt);
+		}
+	}
+	argc -= optind;
+	argv += optind;
+
+	if (argc != 1)
+		errx(1, "usage: movasim [-b baud] [-l latency_ms] [-j jitter_ms] [-e drop_rate] [-c corrupt_rate] [-u updates_per_s] [-s seed] [-L link] marantz|lge");
+
+	std::unique_ptr<simulator> sim;
+	if (strcmp(argv[0], "marantz") == 0)
+		sim.reset(new marantz_sim());
+	else if (strcmp(argv[0], "lge") == 0)
+		sim.reset(new lge_sim());
+	else
+		errx(1, "Unknown device type: %s", argv[0]);
+
+	srandom(seed);
+	sim->baud = baud;
+	set_msec(sim->latency, latency_ms);
+	sim->jitter_usec = jitter_ms * 1000;
+	sim->drop_rate = drop_rate;
+	sim->corrupt_rate = corrupt_rate;
+	if (updates > 0)
+		set_msec(sim->update_interval, 1000 / updates);
+
+	std::string slave_path;
+	int slave;
+	int master = open_sim_pty(slave_path, slave);
+
+	if (link_path) {
+		unlink(link_path);
+		if (symlink(slave_path.c_str(), link_path))
+			err(1, "%s", link_path);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	event_init();
+
+	smart_event<> term_ev, int_ev;
+	term_ev.set_signal(SIGTERM, quit_event);
+	term_ev.add();
+	int_ev.set_signal(SIGINT, quit_event);
+	int_ev.add();
+
+	sim->start(master);
+
+	printf("%s\n", slave_path.c_str());
+	fflush(stdout);
+
+	event_dispatch();
+
+	if (link_path)
+		unlink(link_path);
+	close(slave);
+	return 0;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PACER_HH
+#define PACER_HH
+
+#include <stdint.h>
+#include <sys/time.h>
+
+/*
+ * Estimates how long the device takes to answer a command, using the
+ * smoothed round trip time and variance from RFC 6298. The default throttle
+ * is kept as the upper bound, the estimate only allows the next command to
+ * go out earlier once the device has actually replied. Throttles given for
+ * a command in the command tables are never shortened.
+ */
+class adaptive_pacer
+{
+	int64_t srtt;
+	int64_t rttvar;
+	unsigned long nsamples;
+
+public:
+	adaptive_pacer()
+		: srtt(0), rttvar(0), nsamples(0)
+	{
+	}
+
+	void sample(const struct timeval &latency)
+	{
+		int64_t r = (int64_t)latency.tv_sec * 1000000 + latency.tv_usec;
+
+		if (r < 0)
+			return;
+
+		if (nsamples++ == 0) {
+			srtt = r;
+			rttvar = r / 2;
+			return;
+		}
+
+		int64_t delta = srtt > r ? srtt - r : r - srtt;
+
+		rttvar = (3 * rttvar + delta) / 4;
+		srtt = (7 * srtt + r) / 8;
+	}
+
+	/* Time after a write when the device is expected to be ready, bounded by upper. */
+	struct timeval interval(const struct timeval &upper) const
+	{
+		int64_t u = (int64_t)upper.tv_sec * 1000000 + upper.tv_usec;
+		int64_t est = srtt + 4 * rttvar;
+		struct timeval res;
+
+		if (nsamples == 0 || est > u)
+			return upper;
+
+		res.tv_sec = est / 1000000;
+		res.tv_usec = est % 1000000;
+		return res;
+	}
+
+	int64_t srtt_usec() const
+	{
+		return srtt;
+	}
+
+	int64_t rttvar_usec() const
+	{
+		return rttvar;
+	}
+
+	unsigned long samples() const
+	{
+		return nsamples;
+	}
+};
+
+#endif /*PACER_HH*/
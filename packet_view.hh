@@ -0,0 +1,132 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+#ifndef PACKET_VIEW_HH
+#define PACKET_VIEW_HH
+
+#include <string>
+
+#include <string.h>
+
+/*
+ * A packet or part of one, pointing into the receive buffer.
+ * Only valid until the buffer is drained, copy with str() to keep it.
+ */
+class packet_view
+{
+	const char *ptr;
+	size_t len;
+
+public:
+	static const size_t npos = std::string::npos;
+
+	packet_view(const char *data, size_t len)
+		: ptr(data), len(len)
+	{
+	}
+
+	packet_view(const char *str)
+		: ptr(str), len(strlen(str))
+	{
+	}
+
+	packet_view(const std::string &str)
+		: ptr(str.data()), len(str.length())
+	{
+	}
+
+	const char *
+	data() const
+	{
+		return ptr;
+	}
+
+	size_t
+	length() const
+	{
+		return len;
+	}
+
+	/* Reads past the end give '\0', as for a terminated string. */
+	char
+	operator [] (size_t i) const
+	{
+		return i < len ? ptr[i] : '\0';
+	}
+
+	size_t
+	find(char c) const
+	{
+		const void *p = memchr(ptr, c, len);
+
+		return p ? static_cast<const char*>(p) - ptr : npos;
+	}
+
+	packet_view
+	substr(size_t pos, size_t n = npos) const
+	{
+		if (pos > len)
+			pos = len;
+		if (n > len - pos)
+			n = len - pos;
+		return packet_view(ptr + pos, n);
+	}
+
+	bool
+	operator == (packet_view r) const
+	{
+		return len == r.len && memcmp(ptr, r.ptr, len) == 0;
+	}
+
+	bool
+	operator != (packet_view r) const
+	{
+		return !(*this == r);
+	}
+
+	/* Like atoi, but stops at the end of the view. */
+	int
+	to_int() const
+	{
+		size_t i = 0;
+		bool neg = false;
+		int v = 0;
+
+		while (i < len && (ptr[i] == ' ' || ptr[i] == '\t'))
+			i++;
+		if (i < len && (ptr[i] == '+' || ptr[i] == '-'))
+			neg = ptr[i++] == '-';
+		for ( ; i < len && ptr[i] >= '0' && ptr[i] <= '9' ; i++)
+			v = v * 10 + (ptr[i] - '0');
+		return neg ? -v : v;
+	}
+
+	std::string
+	str() const
+	{
+		return std::string(ptr, len);
+	}
+};
+
+#endif /*PACKET_VIEW_HH*/
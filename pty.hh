@@ -0,0 +1,71 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef PTY_HH
+#define PTY_HH
+
+#include <err.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include <string>
+
+/*
+ * Open a pseudo terminal for a simulated device, returning the master.
+ * The slave is kept open as well so that the master doesn't see hangups
+ * while the daemon reopens the line, and is raw until the daemon configures it.
+ */
+static inline int
+open_sim_pty(std::string &slave_path, int &slave)
+{
+	int master = posix_openpt(O_RDWR | O_NOCTTY);
+
+	if (master < 0)
+		err(1, "posix_openpt");
+	if (grantpt(master) || unlockpt(master))
+		err(1, "grantpt");
+
+	const char *name = ptsname(master);
+	if (!name)
+		err(1, "ptsname");
+	slave_path = name;
+
+	slave = open(name, O_RDWR | O_NOCTTY);
+	if (slave < 0)
+		err(1, "%s", name);
+
+	struct termios tattr;
+	if (tcgetattr(slave, &tattr))
+		err(1, "tcgetattr");
+	cfmakeraw(&tattr);
+	if (tcsetattr(slave, TCSANOW, &tattr))
+		err(1, "tcsetattr");
+
+	return master;
+}
+
+#endif /*PTY_HH*/
@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <err.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <memory>
+
+#include "simulator.hh"
+
+simulator::simulator()
+	: baud(9600), jitter_usec(0), drop_rate(0), corrupt_rate(0), master(-1)
+{
+	timerclear(&latency);
+	timerclear(&update_interval);
+	timerclear(&line_free);
+}
+
+bool
+simulator::chance(double rate)
+{
+	return rate > 0 && random() < rate * RAND_MAX;
+}
+
+void
+simulator::start(int master)
+{
+	auto fd = std::make_shared<smart_fd>(master);
+
+	this->master = master;
+
+	read_ev.set_fd(fd);
+	read_ev.set(EV_READ | EV_PERSIST, std::bind(&simulator::readcb, this, std::placeholders::_1, std::placeholders::_2));
+	read_ev.add();
+
+	write_ev.set_fd(fd);
+	write_ev.set(EV_TIMEOUT, std::bind(&simulator::writecb, this, std::placeholders::_1, std::placeholders::_2));
+
+	if (timerisset(&update_interval)) {
+		update_ev.set_fd(-1);
+		update_ev.set(EV_TIMEOUT | EV_PERSIST, std::bind(&simulator::updatecb, this, std::placeholders::_1, std::placeholders::_2));
+		update_ev.add(update_interval);
+	}
+}
+
+void
+simulator::readcb(int fd, short what)
+{
+	char buf[256];
+	ssize_t len = read(fd, buf, sizeof(buf));
+
+	if (len < 0)
+		err(1, "read");
+	if (len == 0)
+		return;
+
+	input.append(buf, len);
+
+	size_t pos;
+	while ((pos = input.find_first_of(packet_separators())) != std::string::npos) {
+		std::string packet = input.substr(0, pos);
+
+		input.erase(0, pos + 1);
+		if (!packet.empty())
+			handle_packet(packet);
+	}
+}
+
+/*
+ * Replies are held back by the latency, then occupy the line for the time it
+ * takes to transmit them at the simulated baud rate (10 bits per byte).
+ */
+void
+simulator::reply(std::string data)
+{
+	if (chance(drop_rate))
+		return;
+	if (chance(corrupt_rate) && data.length() > 1)
+		data[random() % (data.length() - 1)] = ' ' + random() % ('~' - ' ');
+
+	struct timeval now, at, tx = {0, 0};
+
+	gettimeofday(&now, NULL);
+	timeradd(&now, &latency, &at);
+	if (jitter_usec > 0) {
+		long usec = random() % jitter_usec;
+		struct timeval jitter = {usec / 1000000, static_cast<suseconds_t>(usec % 1000000)};
+
+		timeradd(&at, &jitter, &at);
+	}
+	if (timercmp(&line_free, &at, >))
+		at = line_free;
+	if (baud > 0) {
+		long usec = static_cast<long>(data.length()) * 10 * 1000000 / baud;
+
+		tx.tv_sec = usec / 1000000;
+		tx.tv_usec = usec % 1000000;
+	}
+	timeradd(&at, &tx, &line_free);
+
+	/* Nothing holds it back, don't wait for the loop to write it. */
+	if (replies.empty() && !timercmp(&line_free, &now, >)) {
+		if (write(master, data.data(), data.length()) != static_cast<ssize_t>(data.length()))
+			warn("write");
+		return;
+	}
+	replies.push_back(sim_reply{line_free, std::move(data)});
+	if (replies.size() == 1)
+		schedule_write();
+}
+
+void
+simulator::schedule_write()
+{
+	struct timeval now, left = {0, 0};
+
+	gettimeofday(&now, NULL);
+	if (timercmp(&replies.front().at, &now, >))
+		timersub(&replies.front().at, &now, &left);
+	write_ev.add(left);
+}
+
+void
+simulator::writecb(int fd, short what)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	while (!replies.empty() && !timercmp(&replies.front().at, &now, >)) {
+		const std::string &data = replies.front().data;
+
+		if (write(fd, data.data(), data.length()) != static_cast<ssize_t>(data.length()))
+			warn("write");
+		replies.pop_front();
+	}
+	if (!replies.empty())
+		schedule_write();
+}
+
+void
+simulator::updatecb(int fd, short what)
+{
+	update();
+}
+
+struct marantz_sim_info
+{
+	const char *code;
+	int layer;
+	bool ack_only;
+};
+
+static const struct marantz_sim_info marantz_sim_infos[] = {
+#define INFO(name, code, level, id) {code, level, false},
+#define INFO_KNOW(name, code, level, know, id) {code, level, false},
+#define INFO_ACK_ONLY(name, code) {code, 0, true},
+#define INFO_NO_AUTO(name, code, id) {code, 0, false},
+#define INFO_KNOW_NO_AUTO(name, code, know, id) {code, 0, false},
+#define NO_INFO(name, code, level) {code, 0, false},
+#define INFO_CMD_ONLY(name, code, id) {code, 0, true},
+#include "marantz_info.h"
+#undef INFO
+#undef INFO_KNOW
+#undef INFO_ACK_ONLY
+#undef INFO_NO_AUTO
+#undef INFO_KNOW_NO_AUTO
+#undef NO_INFO
+#undef INFO_CMD_ONLY
+	{ NULL }
+};
+
+/* Codes with boolean 1 (off) / 2 (on) values, toggled by 0. */
+static const char *const marantz_sim_bools[] = {
+	"PWR", "ATT", "AMT", "VMT", "71C", "HAM", "MNU", "FKL", "SSU", "NGT", "TPI",
+	"MPW", "MAM", "MVS", "MSP", "MSS", "MSM", NULL
+};
+
+/* Codes with a signed level, set by 0<level> and stepped by 1 to 4. */
+static const char *const marantz_sim_levels[] = {
+	"VOL", "TOB", "TOT", "MVL", "MSV", NULL
+};
+
+static const struct {
+	const char *code;
+	const char *value;
+} marantz_sim_initial[] = {
+	{ "PWR", "2" },
+	{ "VOL", "-30" },
+	{ "TOB", "+0" },
+	{ "TOT", "+0" },
+	{ "SRC", "22" },
+	{ "IST", "0" },
+	{ "SLP", "000" },
+	{ "DCT", "11" },
+	{ "SUR", "0" },
+	{ "TTO", "1" },
+	{ "DHM", "0" },
+	{ "SIG", "0" },
+	{ "SFQ", "0" },
+	{ "CHS", "77" },
+	{ "LIP", "000" },
+	{ "TFQ", "08750" },
+	{ "TPR", "01" },
+	{ "TMD", "0" },
+	{ "CAT", "100" },
+	{ "CTN", "Rock            " },
+	{ "CHN", "Channel         " },
+	{ "ARN", "Artist          " },
+	{ "SON", "Song            " },
+	{ "MVL", "-40" },
+	{ "MSC", "22" },
+	{ "MSL", "000" },
+	{ "MSV", "-40" },
+	{ "MTF", "08750" },
+	{ "MTP", "01" },
+	{ "MTM", "0" },
+	{ NULL }
+};
+
+static bool
+in_list(const char *const *list, const std::string &code)
+{
+	for (; *list ; list++) {
+		if (code == *list)
+			return true;
+	}
+	return false;
+}
+
+marantz_sim::marantz_sim()
+	: auto_status(0)
+{
+	for (const struct marantz_sim_info *info = marantz_sim_infos ; info->code ; info++) {
+		if (!info->ack_only)
+			values[info->code] = "1";
+	}
+	for (int i = 0 ; marantz_sim_initial[i].code ; i++)
+		values[marantz_sim_initial[i].code] = marantz_sim_initial[i].value;
+}
+
+const char *
+marantz_sim::packet_separators()
+const
+{
+	return "\r";
+}
+
+void
+marantz_sim::set_value(const std::string &code, const std::string &value)
+{
+	values[code] = value;
+}
+
+void
+marantz_sim::send_status(const std::string &code)
+{
+	reply("@" + code + ":" + values[code] + "\r");
+}
+
+void
+marantz_sim::step(const std::string &code, int delta)
+{
+	char buf[16];
+
+	snprintf(buf, sizeof(buf), "%+d", atoi(values[code].c_str()) + delta);
+	values[code] = buf;
+}
+
+void
+marantz_sim::handle_packet(const std::string &packet)
+{
+	size_t cpos = packet.find(':');
+
+	if (packet[0] != '@' || cpos == std::string::npos)
+		return;
+
+	std::string code = packet.substr(1, cpos - 1);
+	std::string arg = packet.substr(cpos + 1);
+
+	if (arg.empty())
+		return;
+
+	if (code == "AST") {
+		char buf[sizeof("@AST:F\r")];
+
+		if (arg != "?")
+			auto_status = strtol(arg.c_str(), NULL, 16) & 0xF;
+		snprintf(buf, sizeof(buf), "@AST:%X\r", auto_status);
+		reply(buf);
+		return;
+	}
+
+	auto it = values.find(code);
+	if (it == values.end()) {
+		/* Command only, the receiver just echoes it. */
+		reply(packet + "\r");
+		return;
+	}
+
+	if (arg == "?") {
+		send_status(code);
+		return;
+	}
+
+	if (in_list(marantz_sim_bools, code)) {
+		switch (arg[0]) {
+		case '0':
+			it->second = it->second == "2" ? "1" : "2";
+			break;
+		case '1':
+		case '2':
+			it->second = arg.substr(0, 1);
+			break;
+		case '3':
+			if (code == "PWR")
+				it->second = "1";
+			break;
+		}
+	} else if (in_list(marantz_sim_levels, code)) {
+		switch (arg[0]) {
+		case '0':
+			it->second = arg.substr(1);
+			break;
+		case '1':
+			step(code, 1);
+			break;
+		case '2':
+			step(code, -1);
+			break;
+		case '3':
+			step(code, 5);
+			break;
+		case '4':
+			step(code, -5);
+			break;
+		}
+	} else if (code == "SRC" || code == "MSC") {
+		it->second = std::string(2, arg[0]);
+	} else {
+		it->second = arg;
+	}
+	send_status(code);
+}
+
+/* Change a random field in one of the enabled layers. */
+void
+marantz_sim::update()
+{
+	const struct marantz_sim_info *candidates[sizeof(marantz_sim_infos) / sizeof(*marantz_sim_infos)];
+	int n = 0;
+
+	for (const struct marantz_sim_info *info = marantz_sim_infos ; info->code ; info++) {
+		if (info->layer > 0 && (auto_status & (1 << (info->layer - 1))))
+			candidates[n++] = info;
+	}
+	if (!n)
+		return;
+
+	std::string code = candidates[random() % n]->code;
+	if (in_list(marantz_sim_bools, code))
+		values[code] = values[code] == "2" ? "1" : "2";
+	else if (in_list(marantz_sim_levels, code))
+		step(code, random() % 2 ? 1 : -1);
+	send_status(code);
+}
+
+static const char *const lge_sim_cmds[] = {
+#define NOTIFY(name, code, cmd, type) cmd,
+#include "lge_notify.h"
+#undef NOTIFY
+	"mc",
+	NULL
+};
+
+lge_sim::lge_sim()
+{
+	for (int i = 0 ; lge_sim_cmds[i] ; i++)
+		values[lge_sim_cmds[i]] = "01";
+	values["kf"] = "0A";
+	values["ma"] = "000100";
+	values["xb"] = "90";
+}
+
+const char *
+lge_sim::packet_separators()
+const
+{
+	return "\r";
+}
+
+void
+lge_sim::handle_packet(const std::string &packet)
+{
+	if (packet.length() < sizeof("ka 00 0") || packet[2] != ' ')
+		return;
+
+	std::string cmd = packet.substr(0, 2);
+	std::string data;
+
+	/* Data bytes after the set id, without the separating spaces. */
+	for (size_t i = sizeof("ka 00") ; i < packet.length() ; i++) {
+		if (packet[i] != ' ')
+			data += packet[i];
+	}
+
+	auto it = values.find(cmd);
+	if (it == values.end()) {
+		reply(cmd.substr(1) + " 01 NG" + data + "x");
+		return;
+	}
+	if (data != "FF")
+		it->second = data;
+	reply(cmd.substr(1) + " 01 OK" + it->second + "x");
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef SIMULATOR_HH
+#define SIMULATOR_HH
+
+#include <sys/time.h>
+
+#include <deque>
+#include <map>
+#include <string>
+
+#include "smart_event.hh"
+
+/*
+ * Simulated devices, answering on the master of a pseudo terminal like the
+ * real ones would on their serial line. Used by movasim and bench_fanout.
+ */
+
+struct sim_reply
+{
+	struct timeval at;
+	std::string data;
+};
+
+class simulator
+{
+public:
+	int baud;
+	struct timeval latency;
+	int jitter_usec;
+	double drop_rate;
+	double corrupt_rate;
+	struct timeval update_interval;
+
+	simulator();
+	virtual ~simulator() {}
+
+	void start(int master);
+
+protected:
+	virtual const char *packet_separators() const = 0;
+	virtual void handle_packet(const std::string &packet) = 0;
+	virtual void update() {}
+
+	void reply(std::string data);
+
+	static bool chance(double rate);
+
+private:
+	int master;
+	smart_event<> read_ev;
+	smart_event<> write_ev;
+	smart_event<> update_ev;
+	std::string input;
+	std::deque<sim_reply> replies;
+	struct timeval line_free;
+
+	void readcb(int fd, short what);
+	void writecb(int fd, short what);
+	void updatecb(int fd, short what);
+	void schedule_write();
+};
+
+/*
+ * Marantz receiver. Packets are @CODE:arg\r in both directions. Every command
+ * is answered with the status of its code, and status for the layers enabled
+ * with @AST is sent unprompted when it changes.
+ */
+class marantz_sim : public simulator
+{
+public:
+	marantz_sim();
+
+	/* Change a value as if on the receiver, send_status tells about it. */
+	void set_value(const std::string &code, const std::string &value);
+	void send_status(const std::string &code);
+
+protected:
+	virtual const char *packet_separators() const;
+	virtual void handle_packet(const std::string &packet);
+	virtual void update();
+
+private:
+	std::map<std::string, std::string> values;
+	int auto_status;
+
+	void step(const std::string &code, int delta);
+};
+
+/*
+ * LG TV. Commands are "kf 00 1A\r", answered with "f 01 OK1Ax", or NG if the
+ * command is unknown. The data FF queries the current value. The TV never
+ * sends anything unprompted.
+ */
+class lge_sim : public simulator
+{
+public:
+	lge_sim();
+
+protected:
+	virtual const char *packet_separators() const;
+	virtual void handle_packet(const std::string &packet);
+
+private:
+	std::map<std::string, std::string> values;
+};
+
+#endif /*SIMULATOR_HH*/
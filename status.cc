@@ -34,6 +34,7 @@
 
 #include "line.h"
 #include "base64.h"
+#include "trace.hh"
 
 #include <forward_list>
 #include <string>
@@ -61,14 +62,22 @@ std::unique_ptr<status_notify_token>
 status::start_notify(const std::string &code, backend_ptr::notify_cb cb)
 {
 	auto iter = notify_chain.emplace_after(notify_chain.before_begin(), *this, code, std::move(cb));
+	std::unique_ptr<status_notify_token> token(new status_notify_token(*iter));
 
-	return std::unique_ptr<status_notify_token>(new status_notify_token(*iter));
+	subscriptions_changed();
+	return token;
 }
 
 void
 status::stop_notify (struct status_notify_info &ptr)
 {
 	notify_chain.remove(ptr);
+	subscriptions_changed();
+}
+
+void
+status::subscriptions_changed()
+{
 }
 
 void
@@ -77,18 +86,29 @@ status::notify(const std::string &code, int val)
 	char v[4];
 
 	base64_int24(v, val);
-	for (auto &notify : notify_chain) {
-		if (code == notify.code)
-			notify.cb(notify.code, std::string(v, 4));
-	}
+	notify(code, std::string(v, 4));
 }
 
 void
 status::notify(const std::string &code, const std::string &val)
 {
+	uint32_t trace = trace_current;
+	int subscribers = 0;
+
+	if (trace)
+		trace_event(trace, "notify", ",\"backend\":%s,\"code\":%s,\"value\":%s",
+				trace_quote(name).c_str(), trace_quote(code).c_str(), trace_quote(val).c_str());
+
 	for (auto &notify : notify_chain) {
-		if (code == notify.code)
+		if (code == notify.code) {
+			metrics.notifications++;
+			subscribers++;
 			notify.cb(notify.code, val);
+		}
 	}
+
+	if (trace)
+		trace_event(trace, "notified", ",\"backend\":%s,\"code\":%s,\"subscribers\":%d",
+				trace_quote(name).c_str(), trace_quote(code).c_str(), subscribers);
 }
 
@@ -64,6 +64,15 @@ public:
 protected:
 	void notify(const std::string &code, int val);
 	void notify(const std::string &code, const std::string &val);
+
+	const std::forward_list<status_notify_info> &
+	subscriptions() const
+	{
+		return notify_chain;
+	}
+
+	/* Called after a subscription was added or removed. */
+	virtual void subscriptions_changed();
 };
 
 #endif /*STATUS_PRIVATE_HH*/
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "trace.hh"
+
+#include <err.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+uint32_t trace_current;
+
+static FILE *trace_file;
+
+void
+trace_open(const char *path)
+{
+	if (strcmp(path, "-") == 0) {
+		trace_file = stderr;
+		return;
+	}
+
+	trace_file = fopen(path, "a");
+	if (!trace_file)
+		err(1, "%s", path);
+	setvbuf(trace_file, NULL, _IOLBF, 0);
+}
+
+bool
+trace_enabled()
+{
+	return trace_file != NULL;
+}
+
+std::string
+trace_quote(const char *data, size_t len)
+{
+	std::string res = "\"";
+
+	for (size_t i = 0 ; i < len ; i++) {
+		unsigned char c = data[i];
+
+		if (c == '"' || c == '\\') {
+			res += '\\';
+			res += c;
+		} else if (c < 0x20 || c >= 0x7f) {
+			char buf[8];
+
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			res += buf;
+		} else {
+			res += c;
+		}
+	}
+	res += '"';
+	return res;
+}
+
+void
+trace_event(uint32_t id, const char *stage, const char *fields, ...)
+{
+	struct timespec ts;
+	va_list ap;
+
+	if (!trace_file || !id)
+		return;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	fprintf(trace_file, "{\"usec\":%llu,\"trace\":%u,\"stage\":\"%s\"",
+			(unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000, (unsigned)id, stage);
+	va_start(ap, fields);
+	vfprintf(trace_file, fields, ap);
+	va_end(ap);
+	fputs("}\n", trace_file);
+}
@@ -0,0 +1,85 @@
+/*
+ * Copyright (c) 2013 Pelle Johansson
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef TRACE_HH
+#define TRACE_HH
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <string>
+
+/*
+ * Opt-in tracing of single commands. A client tags its SEND commands with a
+ * trace ID using TRCE, and the ID follows the command through the queue, the
+ * write to the line and the reply, on to the notifications the reply caused.
+ * Each stage is written as a line of JSON to the trace file, with a
+ * monotonic timestamp, to be aggregated into per-stage latencies.
+ *
+ * Untagged commands have ID 0 and cost a compare at each stage.
+ */
+
+/* Start writing trace events to path, "-" for stderr. */
+void trace_open(const char *path);
+
+bool trace_enabled();
+
+/* The ID of the command being handled, 0 if none. */
+extern uint32_t trace_current;
+
+/* Sets trace_current for the lifetime of the scope. */
+class trace_scope
+{
+	uint32_t saved;
+
+public:
+	trace_scope(uint32_t id)
+		: saved(trace_current)
+	{
+		trace_current = id;
+	}
+
+	~trace_scope()
+	{
+		trace_current = saved;
+	}
+};
+
+/* data as a quoted JSON string. */
+std::string trace_quote(const char *data, size_t len);
+
+static inline std::string
+trace_quote(const std::string &str)
+{
+	return trace_quote(str.data(), str.length());
+}
+
+/*
+ * Write an event for stage of trace id. fields is either empty or a list of
+ * JSON members, starting with a comma.
+ */
+void trace_event(uint32_t id, const char *stage, const char *fields, ...) __attribute__((format(printf, 3, 4)));
+
+#endif /*TRACE_HH*/